@@ -19,6 +19,8 @@
 #include <utils/Log.h>
 
 #include "ANetworkSession.h"
+#include "MediaPacket.h"
+#include "NetworkCapture.h"
 #include "ParsedMessage.h"
 
 #include <arpa/inet.h>
@@ -80,8 +82,10 @@ struct ANetworkSession::Session : public RefBase {
     status_t writeMore();
 
     status_t sendRequest(const void *data, ssize_t size);
+    status_t sendDatagram(const sp<ABuffer> &datagram);
 
     void setIsRTSPConnection(bool yesno);
+    void setCapture(const sp<NetworkCapture> &capture);
 
 protected:
     virtual ~Session();
@@ -102,9 +106,17 @@ private:
 
     AString mInBuffer;
 
+    sp<NetworkCapture> mCapture;
+    uint32_t mCapturedBytesIn, mCapturedBytesOut;
+
     void notifyError(bool send, status_t err, const char *detail);
     void notify(NotificationReason reason);
 
+    // "remoteAddr" may be NULL for connected sockets.
+    void capture(
+            bool incoming, int64_t timeUs, const void *data, size_t size,
+            const struct sockaddr_in *remoteAddr);
+
     DISALLOW_EVIL_CONSTRUCTORS(Session);
 };
 ////////////////////////////////////////////////////////////////////////////////
@@ -135,7 +147,9 @@ ANetworkSession::Session::Session(
       mSocket(s),
       mNotify(notify),
       mSawReceiveFailure(false),
-      mSawSendFailure(false) {
+      mSawSendFailure(false),
+      mCapturedBytesIn(0),
+      mCapturedBytesOut(0) {
     if (mState == CONNECTED) {
         struct sockaddr_in localAddr;
         socklen_t localAddrLen = sizeof(localAddr);
@@ -197,6 +211,53 @@ void ANetworkSession::Session::setIsRTSPConnection(bool yesno) {
     mIsRTSPConnection = yesno;
 }
 
+void ANetworkSession::Session::setCapture(
+        const sp<NetworkCapture> &capture) {
+    mCapture = capture;
+}
+
+void ANetworkSession::Session::capture(
+        bool incoming, int64_t timeUs, const void *data, size_t size,
+        const struct sockaddr_in *remoteAddr) {
+    struct sockaddr_in localAddr;
+    socklen_t addrLen = sizeof(localAddr);
+    if (getsockname(mSocket, (struct sockaddr *)&localAddr, &addrLen) < 0) {
+        memset(&localAddr, 0, sizeof(localAddr));
+    }
+
+    struct sockaddr_in peerAddr;
+    if (remoteAddr == NULL) {
+        addrLen = sizeof(peerAddr);
+        if (getpeername(
+                    mSocket, (struct sockaddr *)&peerAddr, &addrLen) < 0) {
+            memset(&peerAddr, 0, sizeof(peerAddr));
+        }
+        remoteAddr = &peerAddr;
+    }
+
+    const struct sockaddr_in &from = incoming ? *remoteAddr : localAddr;
+    const struct sockaddr_in &to = incoming ? localAddr : *remoteAddr;
+
+    if (mState == DATAGRAM) {
+        mCapture->addDatagram(timeUs, from, to, data, size);
+        return;
+    }
+
+    if (incoming) {
+        mCapture->addStreamData(
+                timeUs, from, to, mCapturedBytesIn, mCapturedBytesOut,
+                data, size);
+
+        mCapturedBytesIn += size;
+    } else {
+        mCapture->addStreamData(
+                timeUs, from, to, mCapturedBytesOut, mCapturedBytesIn,
+                data, size);
+
+        mCapturedBytesOut += size;
+    }
+}
+
 sp<AMessage> ANetworkSession::Session::getNotificationMessage() const {
     return mNotify;
 }
@@ -224,7 +285,7 @@ status_t ANetworkSession::Session::readMore() {
     if (mState == DATAGRAM) {
         status_t err;
         do {
-            sp<ABuffer> buf = new ABuffer(kMaxUDPSize);
+            sp<MediaPacket> buf = new MediaPacket(kMaxUDPSize);
 
             struct sockaddr_in remoteAddr;
             socklen_t remoteAddrLen = sizeof(remoteAddr);
@@ -244,8 +305,12 @@ status_t ANetworkSession::Session::readMore() {
             } else {
                 buf->setRange(0, n);
 
-                int64_t nowUs = ALooper::GetNowUs();
-                buf->meta()->setInt64("arrivalTimeUs", nowUs);
+                buf->mArrivalTimeUs = ALooper::GetNowUs();
+
+                if (mCapture != NULL) {
+                    capture(true /* incoming */, buf->mArrivalTimeUs,
+                            buf->data(), buf->size(), &remoteAddr);
+                }
 
                 sp<AMessage> notify = mNotify->dup();
                 notify->setInt32("sessionID", mSessionID);
@@ -291,6 +356,10 @@ status_t ANetworkSession::Session::readMore() {
     if (n > 0) {
         mInBuffer.append(tmp, n);
 
+        if (mCapture != NULL) {
+            capture(true /* incoming */, ALooper::GetNowUs(), tmp, n, NULL);
+        }
+
 #if 0
         ALOGI("in:");
         hexdump(tmp, n);
@@ -313,8 +382,9 @@ status_t ANetworkSession::Session::readMore() {
                 break;
             }
 
-            sp<ABuffer> packet = new ABuffer(packetSize);
+            sp<MediaPacket> packet = new MediaPacket(packetSize);
             memcpy(packet->data(), mInBuffer.c_str() + 2, packetSize);
+            packet->mArrivalTimeUs = ALooper::GetNowUs();
 
             sp<AMessage> notify = mNotify->dup();
             notify->setInt32("sessionID", mSessionID);
@@ -344,11 +414,9 @@ status_t ANetworkSession::Session::readMore() {
                 notify->setInt32("reason", kWhatBinaryData);
                 notify->setInt32("channel", mInBuffer.c_str()[1]);
 
-                sp<ABuffer> data = new ABuffer(length);
+                sp<MediaPacket> data = new MediaPacket(length);
                 memcpy(data->data(), mInBuffer.c_str() + 4, length);
-
-                int64_t nowUs = ALooper::GetNowUs();
-                data->meta()->setInt64("arrivalTimeUs", nowUs);
+                data->mArrivalTimeUs = ALooper::GetNowUs();
 
                 notify->setBuffer("data", data);
                 notify->post();
@@ -435,6 +503,11 @@ status_t ANetworkSession::Session::writeMore() {
             err = OK;
 
             if (n > 0) {
+                if (mCapture != NULL) {
+                    capture(false /* incoming */, ALooper::GetNowUs(),
+                            datagram->data(), n, NULL);
+                }
+
                 mOutDatagrams.erase(mOutDatagrams.begin());
             } else if (n < 0) {
                 err = -errno;
@@ -495,6 +568,11 @@ status_t ANetworkSession::Session::writeMore() {
         hexdump(mOutBuffer.c_str(), n);
 #endif
 
+        if (mCapture != NULL) {
+            capture(false /* incoming */, ALooper::GetNowUs(),
+                    mOutBuffer.c_str(), n, NULL);
+        }
+
         mOutBuffer.erase(0, n);
     } else if (n < 0) {
         err = -errno;
@@ -540,6 +618,16 @@ status_t ANetworkSession::Session::sendRequest(const void *data, ssize_t size) {
     return OK;
 }
 
+status_t ANetworkSession::Session::sendDatagram(
+        const sp<ABuffer> &datagram) {
+    if (mState != DATAGRAM) {
+        return sendRequest(datagram->data(), datagram->size());
+    }
+
+    mOutDatagrams.push_back(datagram);
+    return OK;
+}
+
 void ANetworkSession::Session::notifyError(
         bool send, status_t err, const char *detail) {
     sp<AMessage> msg = mNotify->dup();
@@ -569,6 +657,12 @@ ANetworkSession::~ANetworkSession() {
     stop();
 }
 
+void ANetworkSession::setCapture(const sp<NetworkCapture> &capture) {
+    CHECK(mThread == NULL);
+
+    mCapture = capture;
+}
+
 status_t ANetworkSession::start() {
     if (mThread != NULL) {
         return INVALID_OPERATION;
@@ -895,6 +989,8 @@ status_t ANetworkSession::createClientOrServer(
         session->setIsRTSPConnection(true);
     }
 
+    session->setCapture(mCapture);
+
     mSessions.add(session->sessionID(), session);
 
     interrupt();
@@ -968,6 +1064,25 @@ status_t ANetworkSession::sendRequest(
     return err;
 }
 
+status_t ANetworkSession::sendDatagram(
+        int32_t sessionID, const sp<ABuffer> &datagram) {
+    Mutex::Autolock autoLock(mLock);
+
+    ssize_t index = mSessions.indexOfKey(sessionID);
+
+    if (index < 0) {
+        return -ENOENT;
+    }
+
+    const sp<Session> session = mSessions.valueAt(index);
+
+    status_t err = session->sendDatagram(datagram);
+
+    interrupt();
+
+    return err;
+}
+
 void ANetworkSession::interrupt() {
     static const char dummy = 0;
 
@@ -1105,6 +1220,8 @@ void ANetworkSession::threadLoop() {
                             clientSession->setIsRTSPConnection(
                                     session->isRTSPServer());
 
+                            clientSession->setCapture(mCapture);
+
                             sessionsToAdd.push_back(clientSession);
                         }
                     } else {
@@ -27,7 +27,9 @@
 
 namespace android {
 
+struct ABuffer;
 struct AMessage;
+struct NetworkCapture;
 
 // Helper class to manage a number of live sockets (datagram and stream-based)
 // on a single thread. Clients are notified about activity through AMessages.
@@ -37,6 +39,10 @@ struct ANetworkSession : public RefBase {
     status_t start();
     status_t stop();
 
+    // Records all data received and sent by sessions created from now on.
+    // Must be called before start().
+    void setCapture(const sp<NetworkCapture> &capture);
+
     status_t createRTSPClient(
             const char *host, unsigned port, const sp<AMessage> &notify,
             int32_t *sessionID);
@@ -76,6 +82,10 @@ struct ANetworkSession : public RefBase {
     status_t sendRequest(
             int32_t sessionID, const void *data, ssize_t size = -1);
 
+    // Like sendRequest, but datagram sessions queue "datagram" itself
+    // instead of a copy. Its contents must not change until it is sent.
+    status_t sendDatagram(int32_t sessionID, const sp<ABuffer> &datagram);
+
     enum NotificationReason {
         kWhatError,
         kWhatConnected,
@@ -97,6 +107,8 @@ private:
 
     int32_t mNextSessionID;
 
+    sp<NetworkCapture> mCapture;
+
     int mPipeFd[2];
 
     KeyedVector<int32_t, sp<Session> > mSessions;
@@ -4,10 +4,18 @@ include $(CLEAR_VARS)
 
 LOCAL_SRC_FILES:= \
         ANetworkSession.cpp             \
+        MediaPacket.cpp                 \
+        NetworkCapture.cpp              \
         Parameters.cpp                  \
         ParsedMessage.cpp               \
-        sink/LinearRegression.cpp       \
+        sink/AVSyncMonitor.cpp          \
+        sink/BandwidthEstimator.cpp     \
+        sink/ClockRecovery.cpp          \
+        sink/DriftEstimator.cpp         \
+        sink/HeadlessRenderer.cpp       \
+        sink/RTPReplayer.cpp            \
         sink/RTPSink.cpp                \
+        sink/TSValidator.cpp            \
         sink/TunnelRenderer.cpp         \
         sink/WifiDisplaySink.cpp        \
         source/Converter.cpp            \
@@ -83,3 +91,21 @@ LOCAL_MODULE:= udptest
 LOCAL_MODULE_TAGS := debug
 
 # include $(BUILD_EXECUTABLE)
+
+################################################################################
+
+include $(CLEAR_VARS)
+
+LOCAL_SRC_FILES:= \
+        tsbench.cpp                 \
+
+LOCAL_SHARED_LIBRARIES:= \
+        libstagefright_foundation       \
+        libutils                        \
+        libwfd                          \
+
+LOCAL_MODULE:= tsbench
+
+LOCAL_MODULE_TAGS := debug
+
+include $(BUILD_EXECUTABLE)
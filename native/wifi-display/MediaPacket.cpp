@@ -0,0 +1,53 @@
+/*
+ * Copyright 2012, The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "MediaPacket.h"
+
+#include <media/stagefright/foundation/ADebug.h>
+
+namespace android {
+
+MediaPacket::MediaPacket(size_t capacity)
+    : ABuffer(capacity),
+      mArrivalTimeUs(-1ll),
+      mSeqNo(0),
+      mExtSeqNo(-1),
+      mSSRC(0),
+      mRTPTime(0),
+      mPayloadType(0),
+      mMarker(false),
+      mPayloadOffset(0) {
+}
+
+MediaPacket::MediaPacket(
+        const sp<ABuffer> &buffer, size_t offset, size_t size)
+    : ABuffer(buffer->data() + offset, size),
+      mArrivalTimeUs(-1ll),
+      mSeqNo(0),
+      mExtSeqNo(-1),
+      mSSRC(0),
+      mRTPTime(0),
+      mPayloadType(0),
+      mMarker(false),
+      mPayloadOffset(0),
+      mBacking(buffer) {
+    CHECK_LE(offset + size, buffer->size());
+}
+
+MediaPacket::~MediaPacket() {
+}
+
+}  // namespace android
@@ -0,0 +1,69 @@
+/*
+ * Copyright 2012, The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef MEDIA_PACKET_H_
+
+#define MEDIA_PACKET_H_
+
+#include <media/stagefright/foundation/ABuffer.h>
+
+namespace android {
+
+// A received or sent RTP packet. The header fields the sink and the source
+// look at on every packet live here instead of in ABuffer::meta(), which
+// would cost an AMessage allocation and a string lookup per field.
+//
+// Every datagram and every chunk of interleaved binary data posted by
+// ANetworkSession is a MediaPacket with only mArrivalTimeUs filled in,
+// the rest is up to whoever parses the RTP header.
+struct MediaPacket : public ABuffer {
+    MediaPacket(size_t capacity);
+
+    // Refers to "size" bytes at "offset" into "buffer" instead of holding
+    // a copy, "buffer" is kept alive for as long as the packet is.
+    MediaPacket(const sp<ABuffer> &buffer, size_t offset, size_t size);
+
+    // Only valid for buffers known to have been allocated as MediaPackets,
+    // i.e. the "data" of ANetworkSession notifications.
+    static MediaPacket *From(const sp<ABuffer> &buffer) {
+        return static_cast<MediaPacket *>(buffer.get());
+    }
+
+    int64_t mArrivalTimeUs;
+
+    uint16_t mSeqNo;
+    int32_t mExtSeqNo;
+    uint32_t mSSRC;
+    uint32_t mRTPTime;
+    uint8_t mPayloadType;
+    bool mMarker;
+
+    // Where the payload starts relative to base(), i.e. the size of the
+    // RTP header including CSRCs and extensions.
+    size_t mPayloadOffset;
+
+protected:
+    virtual ~MediaPacket();
+
+private:
+    sp<ABuffer> mBacking;
+
+    DISALLOW_EVIL_CONSTRUCTORS(MediaPacket);
+};
+
+}  // namespace android
+
+#endif  // MEDIA_PACKET_H_
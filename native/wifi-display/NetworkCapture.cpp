@@ -0,0 +1,355 @@
+/*
+ * Copyright 2012, The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+//#define LOG_NDEBUG 0
+#define LOG_TAG "NetworkCapture"
+#include <utils/Log.h>
+
+#include "NetworkCapture.h"
+
+#include "MediaPacket.h"
+
+#include <arpa/inet.h>
+#include <sys/time.h>
+
+#include <media/stagefright/foundation/ADebug.h>
+#include <media/stagefright/foundation/ALooper.h>
+#include <media/stagefright/MediaErrors.h>
+#include <media/stagefright/Utils.h>
+
+namespace android {
+
+static const uint32_t kPcapMagic = 0xa1b2c3d4;
+static const uint32_t kPcapSwappedMagic = 0xd4c3b2a1;
+static const uint32_t kLinkTypeRaw = 101;  // IPv4/IPv6, no link layer
+static const size_t kSnapLength = 65535;
+
+static const uint8_t kProtocolTCP = 6;
+static const uint8_t kProtocolUDP = 17;
+
+static const size_t kIPHeaderSize = 20;
+static const size_t kUDPHeaderSize = 8;
+static const size_t kTCPHeaderSize = 20;
+
+// Stream data is split up so that every record fits an IPv4 packet.
+static const size_t kMaxSegmentSize = 65535 - kIPHeaderSize - kTCPHeaderSize;
+
+struct PcapFileHeader {
+    uint32_t mMagic;
+    uint16_t mVersionMajor;
+    uint16_t mVersionMinor;
+    int32_t mThisZone;
+    uint32_t mSigFigs;
+    uint32_t mSnapLength;
+    uint32_t mLinkType;
+};
+
+struct PcapRecordHeader {
+    uint32_t mTimeSecs;
+    uint32_t mTimeUsecs;
+    uint32_t mCapturedLength;
+    uint32_t mOriginalLength;
+};
+
+static void WriteU16(uint8_t *ptr, uint16_t x) {
+    ptr[0] = x >> 8;
+    ptr[1] = x & 0xff;
+}
+
+static void WriteU32(uint8_t *ptr, uint32_t x) {
+    ptr[0] = x >> 24;
+    ptr[1] = (x >> 16) & 0xff;
+    ptr[2] = (x >> 8) & 0xff;
+    ptr[3] = x & 0xff;
+}
+
+static uint16_t IPChecksum(const uint8_t *header, size_t size) {
+    uint32_t sum = 0;
+    for (size_t i = 0; i + 1 < size; i += 2) {
+        sum += U16_AT(&header[i]);
+    }
+
+    while (sum >> 16) {
+        sum = (sum & 0xffff) + (sum >> 16);
+    }
+
+    return ~sum & 0xffff;
+}
+
+NetworkCapture::NetworkCapture(const char *path)
+    : mFile(fopen(path, "wb")),
+      mTimeOffsetUs(0ll),
+      mNextIPID(0) {
+    if (mFile == NULL) {
+        ALOGE("unable to open capture file '%s'", path);
+        return;
+    }
+
+    struct timeval tv;
+    gettimeofday(&tv, NULL);
+    mTimeOffsetUs =
+        tv.tv_sec * 1000000ll + tv.tv_usec - ALooper::GetNowUs();
+
+    PcapFileHeader header;
+    header.mMagic = kPcapMagic;
+    header.mVersionMajor = 2;
+    header.mVersionMinor = 4;
+    header.mThisZone = 0;
+    header.mSigFigs = 0;
+    header.mSnapLength = kSnapLength;
+    header.mLinkType = kLinkTypeRaw;
+
+    if (fwrite(&header, sizeof(header), 1, mFile) != 1) {
+        ALOGE("unable to write to capture file '%s'", path);
+
+        fclose(mFile);
+        mFile = NULL;
+    }
+}
+
+NetworkCapture::~NetworkCapture() {
+    if (mFile != NULL) {
+        fclose(mFile);
+        mFile = NULL;
+    }
+}
+
+status_t NetworkCapture::initCheck() const {
+    return mFile != NULL ? OK : NO_INIT;
+}
+
+void NetworkCapture::addDatagram(
+        int64_t timeUs,
+        const struct sockaddr_in &from, const struct sockaddr_in &to,
+        const void *data, size_t size) {
+    Mutex::Autolock autoLock(mLock);
+
+    if (mFile == NULL || size > kSnapLength - kIPHeaderSize - kUDPHeaderSize) {
+        return;
+    }
+
+    uint8_t header[kUDPHeaderSize];
+    memcpy(&header[0], &from.sin_port, 2);
+    memcpy(&header[2], &to.sin_port, 2);
+    WriteU16(&header[4], kUDPHeaderSize + size);
+    WriteU16(&header[6], 0);  // no checksum
+
+    writeRecord_l(
+            timeUs, from, to, kProtocolUDP,
+            header, sizeof(header), data, size);
+}
+
+void NetworkCapture::addStreamData(
+        int64_t timeUs,
+        const struct sockaddr_in &from, const struct sockaddr_in &to,
+        uint32_t seqNo, uint32_t ackNo,
+        const void *data, size_t size) {
+    Mutex::Autolock autoLock(mLock);
+
+    if (mFile == NULL) {
+        return;
+    }
+
+    const uint8_t *ptr = (const uint8_t *)data;
+    while (size > 0) {
+        size_t segmentSize = size;
+        if (segmentSize > kMaxSegmentSize) {
+            segmentSize = kMaxSegmentSize;
+        }
+
+        uint8_t header[kTCPHeaderSize];
+        memcpy(&header[0], &from.sin_port, 2);
+        memcpy(&header[2], &to.sin_port, 2);
+        WriteU32(&header[4], seqNo);
+        WriteU32(&header[8], ackNo);
+        header[12] = (kTCPHeaderSize / 4) << 4;
+        header[13] = 0x18;  // PSH, ACK
+        WriteU16(&header[14], 65535);  // window
+        WriteU16(&header[16], 0);  // checksum, not verified by default
+        WriteU16(&header[18], 0);  // urgent pointer
+
+        writeRecord_l(
+                timeUs, from, to, kProtocolTCP,
+                header, sizeof(header), ptr, segmentSize);
+
+        ptr += segmentSize;
+        size -= segmentSize;
+        seqNo += segmentSize;
+    }
+}
+
+void NetworkCapture::writeRecord_l(
+        int64_t timeUs,
+        const struct sockaddr_in &from, const struct sockaddr_in &to,
+        uint8_t protocol,
+        const uint8_t *header, size_t headerSize,
+        const void *data, size_t size) {
+    uint8_t ipHeader[kIPHeaderSize];
+    ipHeader[0] = 0x45;  // version 4, 5 words of header
+    ipHeader[1] = 0;
+    WriteU16(&ipHeader[2], kIPHeaderSize + headerSize + size);
+    WriteU16(&ipHeader[4], mNextIPID++);
+    WriteU16(&ipHeader[6], 0x4000);  // don't fragment
+    ipHeader[8] = 64;  // TTL
+    ipHeader[9] = protocol;
+    WriteU16(&ipHeader[10], 0);
+    memcpy(&ipHeader[12], &from.sin_addr.s_addr, 4);
+    memcpy(&ipHeader[16], &to.sin_addr.s_addr, 4);
+    WriteU16(&ipHeader[10], IPChecksum(ipHeader, sizeof(ipHeader)));
+
+    timeUs += mTimeOffsetUs;
+
+    PcapRecordHeader record;
+    record.mTimeSecs = timeUs / 1000000ll;
+    record.mTimeUsecs = timeUs % 1000000ll;
+    record.mCapturedLength = kIPHeaderSize + headerSize + size;
+    record.mOriginalLength = record.mCapturedLength;
+
+    if (fwrite(&record, sizeof(record), 1, mFile) != 1
+            || fwrite(ipHeader, sizeof(ipHeader), 1, mFile) != 1
+            || fwrite(header, headerSize, 1, mFile) != 1
+            || (size > 0 && fwrite(data, size, 1, mFile) != 1)) {
+        ALOGE("writing to capture file failed, capture stopped.");
+
+        fclose(mFile);
+        mFile = NULL;
+    }
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+NetworkCaptureReader::NetworkCaptureReader(const char *path)
+    : mFile(fopen(path, "rb")),
+      mSwapped(false) {
+    if (mFile == NULL) {
+        ALOGE("unable to open capture file '%s'", path);
+        return;
+    }
+
+    PcapFileHeader header;
+    if (fread(&header, sizeof(header), 1, mFile) != 1) {
+        ALOGE("'%s' is too short to be a capture file.", path);
+
+        fclose(mFile);
+        mFile = NULL;
+        return;
+    }
+
+    if (header.mMagic == kPcapSwappedMagic) {
+        mSwapped = true;
+    }
+
+    if ((header.mMagic != kPcapMagic && !mSwapped)
+            || readU32((const uint8_t *)&header.mLinkType) != kLinkTypeRaw) {
+        ALOGE("'%s' is not a capture file written by NetworkCapture.", path);
+
+        fclose(mFile);
+        mFile = NULL;
+    }
+}
+
+NetworkCaptureReader::~NetworkCaptureReader() {
+    if (mFile != NULL) {
+        fclose(mFile);
+        mFile = NULL;
+    }
+}
+
+status_t NetworkCaptureReader::initCheck() const {
+    return mFile != NULL ? OK : NO_INIT;
+}
+
+uint32_t NetworkCaptureReader::readU32(const uint8_t *ptr) const {
+    uint32_t x;
+    memcpy(&x, ptr, sizeof(x));
+
+    if (mSwapped) {
+        x = (x >> 24) | ((x >> 8) & 0xff00) | ((x << 8) & 0xff0000) | (x << 24);
+    }
+
+    return x;
+}
+
+status_t NetworkCaptureReader::readPacket(Packet *packet) {
+    if (mFile == NULL) {
+        return NO_INIT;
+    }
+
+    for (;;) {
+        PcapRecordHeader record;
+        if (fread(&record, sizeof(record), 1, mFile) != 1) {
+            return ERROR_END_OF_STREAM;
+        }
+
+        size_t size = readU32((const uint8_t *)&record.mCapturedLength);
+        if (size > kSnapLength) {
+            return ERROR_MALFORMED;
+        }
+
+        sp<MediaPacket> data = new MediaPacket(size);
+        if (size > 0 && fread(data->data(), size, 1, mFile) != 1) {
+            return ERROR_END_OF_STREAM;
+        }
+
+        const uint8_t *ip = data->data();
+        if (size < kIPHeaderSize || (ip[0] >> 4) != 4) {
+            continue;
+        }
+
+        size_t ipHeaderSize = (ip[0] & 0x0f) * 4;
+        size_t ipLength = U16_AT(&ip[2]);
+        if (ipHeaderSize < kIPHeaderSize
+                || ipLength < ipHeaderSize || ipLength > size) {
+            continue;
+        }
+
+        const uint8_t *transport = &ip[ipHeaderSize];
+        size_t transportSize = ipLength - ipHeaderSize;
+
+        size_t headerSize;
+        if (ip[9] == kProtocolUDP) {
+            headerSize = kUDPHeaderSize;
+        } else if (ip[9] == kProtocolTCP && transportSize >= kTCPHeaderSize) {
+            headerSize = (transport[12] >> 4) * 4;
+        } else {
+            continue;
+        }
+
+        if (transportSize < headerSize) {
+            continue;
+        }
+
+        packet->mTimeUs =
+            readU32((const uint8_t *)&record.mTimeSecs) * 1000000ll
+                + readU32((const uint8_t *)&record.mTimeUsecs);
+
+        packet->mIsDatagram = (ip[9] == kProtocolUDP);
+        packet->mFromAddr = U32_AT(&ip[12]);
+        packet->mToAddr = U32_AT(&ip[16]);
+        packet->mFromPort = U16_AT(&transport[0]);
+        packet->mToPort = U16_AT(&transport[2]);
+
+        data->setRange(
+                ipHeaderSize + headerSize, transportSize - headerSize);
+        data->mArrivalTimeUs = packet->mTimeUs;
+
+        packet->mData = data;
+
+        return OK;
+    }
+}
+
+}  // namespace android
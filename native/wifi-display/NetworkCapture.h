@@ -0,0 +1,111 @@
+/*
+ * Copyright 2012, The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef NETWORK_CAPTURE_H_
+
+#define NETWORK_CAPTURE_H_
+
+#include <media/stagefright/foundation/ABase.h>
+#include <utils/RefBase.h>
+#include <utils/threads.h>
+
+#include <netinet/in.h>
+#include <stdio.h>
+
+namespace android {
+
+struct MediaPacket;
+
+// Records the traffic of an ANetworkSession to a pcap file. There are no
+// link layer headers, every record is an IPv4 packet made up around the
+// captured payload, UDP for datagrams and TCP for stream data, so that
+// the usual tools can dissect RTP, RTCP and RTSP.
+// Timestamps are those at which ANetworkSession received or sent the data.
+struct NetworkCapture : public RefBase {
+    NetworkCapture(const char *path);
+
+    status_t initCheck() const;
+
+    void addDatagram(
+            int64_t timeUs,
+            const struct sockaddr_in &from, const struct sockaddr_in &to,
+            const void *data, size_t size);
+
+    // "seqNo" is the number of bytes previously captured in the same
+    // direction of this connection, "ackNo" that in the other direction.
+    void addStreamData(
+            int64_t timeUs,
+            const struct sockaddr_in &from, const struct sockaddr_in &to,
+            uint32_t seqNo, uint32_t ackNo,
+            const void *data, size_t size);
+
+protected:
+    virtual ~NetworkCapture();
+
+private:
+    Mutex mLock;
+    FILE *mFile;
+
+    // Converts ALooper::GetNowUs() to wallclock time.
+    int64_t mTimeOffsetUs;
+
+    uint16_t mNextIPID;
+
+    void writeRecord_l(
+            int64_t timeUs,
+            const struct sockaddr_in &from, const struct sockaddr_in &to,
+            uint8_t protocol,
+            const uint8_t *header, size_t headerSize,
+            const void *data, size_t size);
+
+    DISALLOW_EVIL_CONSTRUCTORS(NetworkCapture);
+};
+
+// Reads back files written by NetworkCapture.
+struct NetworkCaptureReader {
+    struct Packet {
+        int64_t mTimeUs;
+        bool mIsDatagram;
+
+        // Host byte order.
+        uint32_t mFromAddr, mToAddr;
+        uint16_t mFromPort, mToPort;
+
+        // The UDP or TCP payload, mArrivalTimeUs is the capture time.
+        sp<MediaPacket> mData;
+    };
+
+    NetworkCaptureReader(const char *path);
+    ~NetworkCaptureReader();
+
+    status_t initCheck() const;
+
+    // Returns ERROR_END_OF_STREAM after the last packet. Records that
+    // aren't IPv4 UDP or TCP are skipped.
+    status_t readPacket(Packet *packet);
+
+private:
+    FILE *mFile;
+    bool mSwapped;
+
+    uint32_t readU32(const uint8_t *ptr) const;
+
+    DISALLOW_EVIL_CONSTRUCTORS(NetworkCaptureReader);
+};
+
+}  // namespace android
+
+#endif  // NETWORK_CAPTURE_H_
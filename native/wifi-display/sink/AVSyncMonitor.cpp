@@ -0,0 +1,170 @@
+/*
+ * Copyright 2012, The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+
+//#define LOG_NDEBUG 0
+#define LOG_TAG "AVSyncMonitor"
+#include <utils/Log.h>
+
+#include "AVSyncMonitor.h"
+
+namespace android {
+
+// In 90kHz units, buckets of a second over the last five minutes.
+static const int64_t kBucketSpan = 90000ll;
+static const size_t kHistorySize = 300;
+static const int64_t kMinOutlierDistance = 450ll;
+
+static const int64_t kTimeMask = (1ll << 33) - 1;
+
+AVSyncMonitor::Stream::Stream()
+    : mDriftEstimator(kBucketSpan, kHistorySize, kMinOutlierDistance) {
+    reset();
+}
+
+void AVSyncMonitor::Stream::reset() {
+    mHavePTS = false;
+    mLastPTS = 0ll;
+    mDriftEstimator.reset();
+    mHaveLatency = false;
+    mLatency = 0.0;
+}
+
+void AVSyncMonitor::Stream::addFrame(int64_t PTS33, int64_t arrivalTime) {
+    if (!mHavePTS) {
+        mHavePTS = true;
+        mLastPTS = PTS33;
+    } else {
+        int64_t diff = (PTS33 - mLastPTS) & kTimeMask;
+        if (diff >= (1ll << 32)) {
+            diff -= (1ll << 33);
+        }
+
+        mLastPTS += diff;
+    }
+
+    mDriftEstimator.addSample(mLastPTS, arrivalTime);
+
+    if (!mDriftEstimator.hasEstimate()) {
+        return;
+    }
+
+    double latency =
+        arrivalTime - mDriftEstimator.expectedArrivalTime(mLastPTS);
+
+    if (!mHaveLatency) {
+        mHaveLatency = true;
+        mLatency = latency;
+    } else {
+        mLatency += (latency - mLatency) / 16.0;
+    }
+}
+
+AVSyncMonitor::AVSyncMonitor() {
+}
+
+void AVSyncMonitor::reset() {
+    mVideo.reset();
+    mAudio.reset();
+}
+
+void AVSyncMonitor::process(
+        const uint8_t *data, size_t size, int64_t arrivalTimeUs) {
+    int64_t arrivalTime = (arrivalTimeUs * 9ll) / 100ll;
+
+    for (; size >= 188; data += 188, size -= 188) {
+        // Only the first packet of each PES packet is of interest.
+        if (data[0] != 0x47 || !(data[1] & 0x40)) {
+            continue;
+        }
+
+        unsigned adaptation_field_control = (data[3] >> 4) & 3;
+        if (!(adaptation_field_control & 1)) {
+            continue;
+        }
+
+        size_t offset = 4;
+        if (adaptation_field_control & 2) {
+            offset += 1 + data[4];
+        }
+
+        if (offset + 14 > 188) {
+            continue;
+        }
+
+        const uint8_t *pes = &data[offset];
+        if (pes[0] != 0x00 || pes[1] != 0x00 || pes[2] != 0x01
+                || !(pes[7] & 0x80)) {
+            continue;
+        }
+
+        Stream *stream;
+        unsigned stream_id = pes[3];
+        if ((stream_id & 0xf0) == 0xe0) {
+            stream = &mVideo;
+        } else if ((stream_id & 0xe0) == 0xc0 || stream_id == 0xbd) {
+            stream = &mAudio;
+        } else {
+            continue;
+        }
+
+        int64_t PTS =
+            ((int64_t)((pes[9] >> 1) & 7) << 30)
+            | (pes[10] << 22)
+            | ((pes[11] >> 1) << 15)
+            | (pes[12] << 7)
+            | (pes[13] >> 1);
+
+        stream->addFrame(PTS, arrivalTime);
+    }
+}
+
+void AVSyncMonitor::getStats(Stats *stats) const {
+    stats->mValid = mVideo.mDriftEstimator.hasEstimate()
+        && mAudio.mDriftEstimator.hasEstimate();
+
+    stats->mPTSOffsetMs = (mAudio.mLastPTS - mVideo.mLastPTS) / 90.0;
+
+    stats->mArrivalSkewMs =
+        (mAudio.mDriftEstimator.offset() - mVideo.mDriftEstimator.offset())
+            / 90.0;
+
+    stats->mVideoLatencyMs = mVideo.mLatency / 90.0;
+    stats->mAudioLatencyMs = mAudio.mLatency / 90.0;
+
+    stats->mVideoDriftPPM = mVideo.mDriftEstimator.skewPPM();
+    stats->mAudioDriftPPM = mAudio.mDriftEstimator.skewPPM();
+}
+
+void AVSyncMonitor::logStats() const {
+    Stats stats;
+    getStats(&stats);
+
+    if (!stats.mValid) {
+        return;
+    }
+
+    ALOGI("A/V: PTS offset %.2f ms, audio arrives %.2f ms later than video, "
+          "latency %.2f/%.2f ms, drift %.2f/%.2f ppm (video/audio)",
+          stats.mPTSOffsetMs,
+          stats.mArrivalSkewMs,
+          stats.mVideoLatencyMs,
+          stats.mAudioLatencyMs,
+          stats.mVideoDriftPPM,
+          stats.mAudioDriftPPM);
+}
+
+}  // namespace android
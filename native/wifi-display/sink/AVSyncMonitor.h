@@ -0,0 +1,98 @@
+/*
+ * Copyright 2012, The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+
+#ifndef AV_SYNC_MONITOR_H_
+
+#define AV_SYNC_MONITOR_H_
+
+#include "DriftEstimator.h"
+
+#include <sys/types.h>
+#include <stdint.h>
+#include <media/stagefright/foundation/ABase.h>
+
+namespace android {
+
+// Follows the PTSs of the audio and video PES packets in the transport
+// stream as they arrive. Since both are on the source's clock and arrival
+// times on ours, the difference in transit delay between the two streams
+// tells how much earlier one stream arrives than the other relative to
+// when it is to be presented, independent of the offset between the
+// clocks. Transit delays are the minimum over time, jitter doesn't count.
+struct AVSyncMonitor {
+    AVSyncMonitor();
+
+    void reset();
+
+    // "size" must be a multiple of 188.
+    void process(const uint8_t *data, size_t size, int64_t arrivalTimeUs);
+
+    struct Stats {
+        // All of the below are only valid if both streams are locked.
+        bool mValid;
+
+        // The PTS of the latest audio frame minus that of the latest video
+        // frame.
+        double mPTSOffsetMs;
+
+        // The audio's minimum transit delay minus the video's, positive if
+        // audio arrives later relative to its PTS.
+        double mArrivalSkewMs;
+
+        // How far frames arrived behind the minimum transit delay,
+        // smoothed.
+        double mVideoLatencyMs;
+        double mAudioLatencyMs;
+
+        // How much faster our clock runs than the source's, as seen
+        // through either stream.
+        double mVideoDriftPPM;
+        double mAudioDriftPPM;
+    };
+
+    void getStats(Stats *stats) const;
+
+    void logStats() const;
+
+private:
+    struct Stream {
+        Stream();
+
+        void reset();
+        void addFrame(int64_t PTS33, int64_t arrivalTime);
+
+        bool mHavePTS;
+        int64_t mLastPTS;  // extended beyond 33 bits
+
+        DriftEstimator mDriftEstimator;
+
+        bool mHaveLatency;
+        double mLatency;
+
+    private:
+        DISALLOW_EVIL_CONSTRUCTORS(Stream);
+    };
+
+    Stream mVideo;
+    Stream mAudio;
+
+    DISALLOW_EVIL_CONSTRUCTORS(AVSyncMonitor);
+};
+
+}  // namespace android
+
+#endif  // AV_SYNC_MONITOR_H_
@@ -0,0 +1,329 @@
+/*
+ * Copyright 2012, The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+//#define LOG_NDEBUG 0
+#define LOG_TAG "BandwidthEstimator"
+#include <utils/Log.h>
+
+#include "BandwidthEstimator.h"
+
+#include <math.h>
+
+namespace android {
+
+// The trend is scaled by this much and by the number of samples it is
+// based on before comparing it against the threshold.
+static const double kTrendGain = 4.0;
+static const size_t kMaxNumDeltasForGain = 60;
+
+static const double kInitialThresholdMs = 12.5;
+static const double kMinThresholdMs = 6.0;
+static const double kMaxThresholdMs = 600.0;
+
+// The threshold follows the trend quickly when it drops and slowly when
+// it rises, so that it isn't dragged along by actual congestion.
+static const double kThresholdGainDown = 0.039;
+static const double kThresholdGainUp = 0.0087;
+
+BandwidthEstimator::BandwidthEstimator() {
+    reset();
+}
+
+void BandwidthEstimator::reset() {
+    mHaveGroup = false;
+    mGroupFirstSendTimeUs = 0ll;
+    mGroupLastSendTimeUs = 0ll;
+    mGroupLastArrivalTimeUs = 0ll;
+
+    mHavePrevGroup = false;
+    mPrevGroupSendTimeUs = 0ll;
+    mPrevGroupArrivalTimeUs = 0ll;
+
+    mAccumulatedDelayMs = 0.0;
+    mSmoothedDelayMs = 0.0;
+    mFirstGroupArrivalTimeUs = -1ll;
+    mTrendFirst = 0;
+    mTrendCount = 0;
+    mNumDeltas = 0;
+
+    mThresholdMs = kInitialThresholdMs;
+    mLastThresholdUpdateUs = -1ll;
+    mNumOverusingGroups = 0;
+    mPrevTrend = 0.0;
+    mUsage = NORMAL;
+
+    mRateWindowStartUs = -1ll;
+    mRateWindowBytes = 0ll;
+    mIncomingBitrate = -1ll;
+
+    mBitrate = -1ll;
+    mLastUpdateUs = -1ll;
+    mLastDecreaseUs = -1ll;
+}
+
+void BandwidthEstimator::onPacketReceived(
+        int64_t sendTimeUs, int64_t arrivalTimeUs, size_t size) {
+    if (mRateWindowStartUs < 0ll) {
+        mRateWindowStartUs = arrivalTimeUs;
+    }
+
+    mRateWindowBytes += size;
+
+    int64_t windowUs = arrivalTimeUs - mRateWindowStartUs;
+    if (windowUs >= kRateWindowUs) {
+        mIncomingBitrate = mRateWindowBytes * 8000000ll / windowUs;
+
+        mRateWindowStartUs = arrivalTimeUs;
+        mRateWindowBytes = 0ll;
+
+        if (mBitrate < 0ll) {
+            // Start out at whatever the source is sending.
+            mBitrate = mIncomingBitrate;
+            mLastUpdateUs = arrivalTimeUs;
+            clampBitrate();
+        }
+    }
+
+    if (!mHaveGroup) {
+        mHaveGroup = true;
+        mGroupFirstSendTimeUs = sendTimeUs;
+        mGroupLastSendTimeUs = sendTimeUs;
+        mGroupLastArrivalTimeUs = arrivalTimeUs;
+        return;
+    }
+
+    if (sendTimeUs < mGroupFirstSendTimeUs) {
+        // Reordered, says nothing about the current state of the queues.
+        return;
+    }
+
+    if (sendTimeUs - mGroupFirstSendTimeUs > kGroupSpanUs) {
+        onGroupComplete();
+
+        mGroupFirstSendTimeUs = sendTimeUs;
+    }
+
+    if (sendTimeUs >= mGroupLastSendTimeUs) {
+        mGroupLastSendTimeUs = sendTimeUs;
+    }
+    mGroupLastArrivalTimeUs = arrivalTimeUs;
+}
+
+void BandwidthEstimator::onGroupComplete() {
+    if (mHavePrevGroup) {
+        int64_t sendDeltaUs = mGroupLastSendTimeUs - mPrevGroupSendTimeUs;
+        int64_t arrivalDeltaUs =
+            mGroupLastArrivalTimeUs - mPrevGroupArrivalTimeUs;
+
+        mAccumulatedDelayMs += (arrivalDeltaUs - sendDeltaUs) / 1E3;
+        mSmoothedDelayMs = 0.9 * mSmoothedDelayMs + 0.1 * mAccumulatedDelayMs;
+
+        if (mFirstGroupArrivalTimeUs < 0ll) {
+            mFirstGroupArrivalTimeUs = mGroupLastArrivalTimeUs;
+        }
+
+        size_t index;
+        if (mTrendCount < kTrendWindowSize) {
+            index = (mTrendFirst + mTrendCount) % kTrendWindowSize;
+            ++mTrendCount;
+        } else {
+            index = mTrendFirst;
+            mTrendFirst = (mTrendFirst + 1) % kTrendWindowSize;
+        }
+
+        mTrendX[index] =
+            (mGroupLastArrivalTimeUs - mFirstGroupArrivalTimeUs) / 1E3;
+        mTrendY[index] = mSmoothedDelayMs;
+
+        ++mNumDeltas;
+
+        if (mTrendCount == kTrendWindowSize) {
+            detectUsage(computeTrend(), mGroupLastArrivalTimeUs);
+        }
+
+        updateBitrate(mGroupLastArrivalTimeUs);
+    }
+
+    mHavePrevGroup = true;
+    mPrevGroupSendTimeUs = mGroupLastSendTimeUs;
+    mPrevGroupArrivalTimeUs = mGroupLastArrivalTimeUs;
+}
+
+double BandwidthEstimator::computeTrend() const {
+    double meanX = 0.0;
+    double meanY = 0.0;
+    for (size_t i = 0; i < mTrendCount; ++i) {
+        meanX += mTrendX[i];
+        meanY += mTrendY[i];
+    }
+    meanX /= mTrendCount;
+    meanY /= mTrendCount;
+
+    double numerator = 0.0;
+    double denominator = 0.0;
+    for (size_t i = 0; i < mTrendCount; ++i) {
+        double dx = mTrendX[i] - meanX;
+        numerator += dx * (mTrendY[i] - meanY);
+        denominator += dx * dx;
+    }
+
+    if (denominator == 0.0) {
+        return 0.0;
+    }
+
+    size_t numDeltas = mNumDeltas;
+    if (numDeltas > kMaxNumDeltasForGain) {
+        numDeltas = kMaxNumDeltasForGain;
+    }
+
+    return numDeltas * kTrendGain * numerator / denominator;
+}
+
+void BandwidthEstimator::detectUsage(double trend, int64_t nowUs) {
+    if (trend > mThresholdMs) {
+        ++mNumOverusingGroups;
+
+        // A single group could just have been unlucky.
+        if (mNumOverusingGroups > 1 && trend >= mPrevTrend) {
+            if (mUsage != OVERUSING) {
+                ALOGV("overusing, trend %.2f > %.2f", trend, mThresholdMs);
+            }
+            mUsage = OVERUSING;
+        }
+    } else if (trend < -mThresholdMs) {
+        mNumOverusingGroups = 0;
+        mUsage = UNDERUSING;
+    } else {
+        mNumOverusingGroups = 0;
+        mUsage = NORMAL;
+    }
+
+    mPrevTrend = trend;
+
+    double absTrend = fabs(trend);
+
+    // Sudden spikes, i.e. route changes, shouldn't move the threshold.
+    if (mLastThresholdUpdateUs >= 0ll && absTrend <= mThresholdMs + 15.0) {
+        int64_t elapsedUs = nowUs - mLastThresholdUpdateUs;
+        if (elapsedUs > 100000ll) {
+            elapsedUs = 100000ll;
+        }
+
+        double gain =
+            (absTrend < mThresholdMs) ? kThresholdGainDown : kThresholdGainUp;
+
+        mThresholdMs += gain * (absTrend - mThresholdMs) * (elapsedUs / 1E3);
+
+        if (mThresholdMs < kMinThresholdMs) {
+            mThresholdMs = kMinThresholdMs;
+        } else if (mThresholdMs > kMaxThresholdMs) {
+            mThresholdMs = kMaxThresholdMs;
+        }
+    }
+
+    mLastThresholdUpdateUs = nowUs;
+}
+
+void BandwidthEstimator::updateBitrate(int64_t nowUs) {
+    if (mBitrate < 0ll || mIncomingBitrate < 0ll) {
+        return;
+    }
+
+    switch (mUsage) {
+        case OVERUSING:
+        {
+            if (mLastDecreaseUs < 0ll
+                    || nowUs - mLastDecreaseUs >= kMinDecreaseIntervalUs) {
+                int64_t target = mIncomingBitrate * 85 / 100;
+
+                if (target < mBitrate) {
+                    ALOGV("decreasing bitrate to %lld bps", target);
+                    mBitrate = target;
+                }
+
+                mLastDecreaseUs = nowUs;
+            }
+            break;
+        }
+
+        case UNDERUSING:
+        {
+            // Queues are draining, don't add to the load until they're empty.
+            break;
+        }
+
+        case NORMAL:
+        {
+            int64_t elapsedUs = nowUs - mLastUpdateUs;
+            if (elapsedUs > 1000000ll) {
+                elapsedUs = 1000000ll;
+            }
+
+            // 8% per second.
+            mBitrate = (int64_t)(mBitrate * pow(1.08, elapsedUs / 1E6) + 0.5);
+
+            // There's no telling whether the link could sustain much more
+            // than what's actually been sent.
+            int64_t maxBitrate = mIncomingBitrate * 3 / 2 + 10000ll;
+            if (mBitrate > maxBitrate) {
+                mBitrate = maxBitrate;
+            }
+            break;
+        }
+    }
+
+    mLastUpdateUs = nowUs;
+
+    clampBitrate();
+}
+
+void BandwidthEstimator::onLossReport(
+        uint32_t numExpected, uint32_t numLost, int64_t nowUs) {
+    if (numExpected == 0 || mBitrate < 0ll) {
+        return;
+    }
+
+    double lossFraction = (double)numLost / numExpected;
+
+    // A little loss is normal on wireless links.
+    if (lossFraction > 0.1) {
+        mBitrate = (int64_t)(mBitrate * (1.0 - 0.5 * lossFraction));
+        mLastDecreaseUs = nowUs;
+
+        ALOGV("%.1f%% loss, decreasing bitrate to %lld bps",
+              lossFraction * 100.0, mBitrate);
+
+        clampBitrate();
+    }
+}
+
+void BandwidthEstimator::clampBitrate() {
+    if (mBitrate < kMinBitrate) {
+        mBitrate = kMinBitrate;
+    } else if (mBitrate > kMaxBitrate) {
+        mBitrate = kMaxBitrate;
+    }
+}
+
+bool BandwidthEstimator::hasEstimate() const {
+    return mBitrate >= 0ll;
+}
+
+int64_t BandwidthEstimator::estimatedBitrate() const {
+    return mBitrate;
+}
+
+}  // namespace android
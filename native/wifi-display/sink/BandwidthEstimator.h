@@ -0,0 +1,120 @@
+/*
+ * Copyright 2012, The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef BANDWIDTH_ESTIMATOR_H_
+
+#define BANDWIDTH_ESTIMATOR_H_
+
+#include <sys/types.h>
+#include <stdint.h>
+#include <media/stagefright/foundation/ABase.h>
+
+namespace android {
+
+// Estimates the bitrate the link from the source can sustain. Packets are
+// grouped by send time, a growing difference between the spacing of
+// groups on arrival and at the sender means queues are building up
+// somewhere along the way, long before anything gets dropped. The rate
+// is increased multiplicatively while that isn't the case, cut back to
+// below the current receive rate when it is, and cut further in
+// proportion to packet loss.
+struct BandwidthEstimator {
+    BandwidthEstimator();
+
+    void reset();
+
+    // "sendTimeUs" is the sender's (unwrapped) timestamp of the packet,
+    // "size" its size including the RTP header.
+    void onPacketReceived(
+            int64_t sendTimeUs, int64_t arrivalTimeUs, size_t size);
+
+    // Number of packets expected and lost since the last call.
+    void onLossReport(uint32_t numExpected, uint32_t numLost, int64_t nowUs);
+
+    bool hasEstimate() const;
+
+    // In bits per second.
+    int64_t estimatedBitrate() const;
+
+private:
+    enum Usage {
+        NORMAL,
+        OVERUSING,
+        UNDERUSING,
+    };
+
+    enum {
+        kTrendWindowSize = 20,
+    };
+
+    // Packets sent within this long are treated as a burst.
+    static const int64_t kGroupSpanUs = 5000ll;
+
+    static const int64_t kRateWindowUs = 500000ll;
+
+    static const int64_t kMinBitrate = 150000ll;
+    static const int64_t kMaxBitrate = 50000000ll;
+
+    // Don't cut the rate again before the previous cut had a chance to
+    // take effect.
+    static const int64_t kMinDecreaseIntervalUs = 200000ll;
+
+    bool mHaveGroup;
+    int64_t mGroupFirstSendTimeUs;
+    int64_t mGroupLastSendTimeUs;
+    int64_t mGroupLastArrivalTimeUs;
+
+    bool mHavePrevGroup;
+    int64_t mPrevGroupSendTimeUs;
+    int64_t mPrevGroupArrivalTimeUs;
+
+    // Accumulated one-way delay variation and its trend.
+    double mAccumulatedDelayMs;
+    double mSmoothedDelayMs;
+    int64_t mFirstGroupArrivalTimeUs;
+    double mTrendX[kTrendWindowSize];
+    double mTrendY[kTrendWindowSize];
+    size_t mTrendFirst;
+    size_t mTrendCount;
+    size_t mNumDeltas;
+
+    double mThresholdMs;
+    int64_t mLastThresholdUpdateUs;
+    size_t mNumOverusingGroups;
+    double mPrevTrend;
+    Usage mUsage;
+
+    // Receive rate, measured over consecutive windows.
+    int64_t mRateWindowStartUs;
+    int64_t mRateWindowBytes;
+    int64_t mIncomingBitrate;
+
+    int64_t mBitrate;
+    int64_t mLastUpdateUs;
+    int64_t mLastDecreaseUs;
+
+    void onGroupComplete();
+    double computeTrend() const;
+    void detectUsage(double trend, int64_t nowUs);
+    void updateBitrate(int64_t nowUs);
+    void clampBitrate();
+
+    DISALLOW_EVIL_CONSTRUCTORS(BandwidthEstimator);
+};
+
+}  // namespace android
+
+#endif  // BANDWIDTH_ESTIMATOR_H_
@@ -0,0 +1,250 @@
+/*
+ * Copyright 2012, The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+
+//#define LOG_NDEBUG 0
+#define LOG_TAG "ClockRecovery"
+#include <utils/Log.h>
+
+#include "ClockRecovery.h"
+
+#include <math.h>
+
+namespace android {
+
+static const int64_t kTimeMask = (1ll << 33) - 1;
+
+// Removes about a tenth of the phase error per window, critically damped.
+const double ClockRecovery::kProportionalGain = 0.1;
+const double ClockRecovery::kIntegralGain = 0.005;
+
+// 1000ppm, far more than any crystal is off.
+const double ClockRecovery::kMaxRate = 0.001;
+
+static int64_t ReadTimestamp(const uint8_t *ptr) {
+    return ((int64_t)((ptr[0] >> 1) & 7) << 30)
+        | (ptr[1] << 22)
+        | ((ptr[2] >> 1) << 15)
+        | (ptr[3] << 7)
+        | (ptr[4] >> 1);
+}
+
+static void WriteTimestamp(uint8_t *ptr, int64_t time) {
+    ptr[0] = (ptr[0] & 0xf0) | (((time >> 30) & 7) << 1) | 1;
+    ptr[1] = (time >> 22) & 0xff;
+    ptr[2] = (((time >> 15) & 0x7f) << 1) | 1;
+    ptr[3] = (time >> 7) & 0xff;
+    ptr[4] = ((time & 0x7f) << 1) | 1;
+}
+
+ClockRecovery::ClockRecovery() {
+    reset();
+}
+
+void ClockRecovery::reset() {
+    mPCRPID = -1;
+    mHavePCR = false;
+    mLastPCR = 0ll;
+    mAnchorSource = 0ll;
+    mAnchorTarget = 0ll;
+    mRate = 0.0;
+    mFrequency = 0.0;
+    mHaveReferenceDelay = false;
+    mReferenceDelay = 0ll;
+    mWindowStart = -1ll;
+    mWindowMinDelay = 0ll;
+}
+
+bool ClockRecovery::isLocked() const {
+    return mHaveReferenceDelay;
+}
+
+double ClockRecovery::skewPPM() const {
+    return mFrequency * 1E6;
+}
+
+int64_t ClockRecovery::extend(int64_t time33) const {
+    int64_t diff = (time33 - mLastPCR) & kTimeMask;
+    if (diff >= (1ll << 32)) {
+        diff -= (1ll << 33);
+    }
+
+    return mLastPCR + diff;
+}
+
+int64_t ClockRecovery::mapTime(int64_t time) const {
+    return mAnchorTarget
+        + (int64_t)floor((time - mAnchorSource) * (1.0 + mRate) + 0.5);
+}
+
+void ClockRecovery::process(
+        uint8_t *data, size_t size, int64_t arrivalTimeUs) {
+    int64_t arrivalTime = (arrivalTimeUs * 9ll) / 100ll;
+
+    for (; size >= 188; data += 188, size -= 188) {
+        if (data[0] != 0x47) {
+            continue;
+        }
+
+        unsigned PID = ((data[1] & 0x1f) << 8) | data[2];
+        bool payload_unit_start_indicator = data[1] & 0x40;
+        unsigned adaptation_field_control = (data[3] >> 4) & 3;
+
+        size_t offset = 4;
+        if (adaptation_field_control & 2) {
+            unsigned adaptation_field_length = data[4];
+
+            if (adaptation_field_length >= 7
+                    && (data[5] & 0x10)  // PCR_flag
+                    && (mPCRPID < 0 || (int32_t)PID == mPCRPID)) {
+                mPCRPID = PID;
+
+                // Only the 90kHz base, the extension is left alone.
+                int64_t PCR = ((int64_t)data[6] << 25)
+                    | (data[7] << 17)
+                    | (data[8] << 9)
+                    | (data[9] << 1)
+                    | (data[10] >> 7);
+
+                onPCR(PCR, arrivalTime);
+
+                int64_t mapped = mapTime(mLastPCR) & kTimeMask;
+                data[6] = mapped >> 25;
+                data[7] = (mapped >> 17) & 0xff;
+                data[8] = (mapped >> 9) & 0xff;
+                data[9] = (mapped >> 1) & 0xff;
+                data[10] = ((mapped & 1) << 7) | (data[10] & 0x7f);
+            }
+
+            offset += 1 + adaptation_field_length;
+        }
+
+        if (payload_unit_start_indicator
+                && (adaptation_field_control & 1)
+                && offset < 188
+                && mHavePCR) {
+            rewritePESTimes(&data[offset], 188 - offset);
+        }
+    }
+}
+
+void ClockRecovery::rewritePESTimes(uint8_t *pes, size_t size) {
+    if (size < 19 || pes[0] != 0x00 || pes[1] != 0x00 || pes[2] != 0x01) {
+        return;
+    }
+
+    unsigned stream_id = pes[3];
+    if (stream_id == 0xbc  // program_stream_map
+            || stream_id == 0xbe  // padding_stream
+            || stream_id == 0xbf  // private_stream_2
+            || stream_id == 0xf0  // ECM
+            || stream_id == 0xf1  // EMM
+            || stream_id == 0xff  // program_stream_directory
+            || stream_id == 0xf2  // DSMCC
+            || stream_id == 0xf8) {  // H.222.1 type E
+        return;
+    }
+
+    unsigned PTS_DTS_flags = pes[7] >> 6;
+
+    if (PTS_DTS_flags & 2) {
+        WriteTimestamp(
+                &pes[9], mapTime(extend(ReadTimestamp(&pes[9]))) & kTimeMask);
+    }
+
+    if (PTS_DTS_flags == 3) {
+        WriteTimestamp(
+                &pes[14],
+                mapTime(extend(ReadTimestamp(&pes[14]))) & kTimeMask);
+    }
+}
+
+void ClockRecovery::onPCR(int64_t PCR, int64_t arrivalTime) {
+    if (!mHavePCR) {
+        mHavePCR = true;
+        mLastPCR = PCR;
+
+        // Identity until the loop has something to go on.
+        mAnchorSource = mAnchorTarget = PCR;
+    } else {
+        mLastPCR = extend(PCR);
+    }
+
+    int64_t delay = arrivalTime - mapTime(mLastPCR);
+
+    if (mWindowStart < 0ll) {
+        mWindowStart = arrivalTime;
+        mWindowMinDelay = delay;
+    } else if (delay < mWindowMinDelay) {
+        mWindowMinDelay = delay;
+    }
+
+    if (arrivalTime >= mWindowStart + kWindowDuration) {
+        onWindowComplete();
+
+        mWindowStart = -1ll;
+    }
+}
+
+void ClockRecovery::onWindowComplete() {
+    if (!mHaveReferenceDelay) {
+        mHaveReferenceDelay = true;
+        mReferenceDelay = mWindowMinDelay;
+        return;
+    }
+
+    // Positive if our clock runs faster than the mapping assumes.
+    int64_t error = mWindowMinDelay - mReferenceDelay;
+
+    if (error > kMaxPhaseError || error < -kMaxPhaseError) {
+        // The source's clock jumped, start over from where the mapping
+        // is now. Dropping the anchor would step the rewritten times by
+        // the offset accumulated so far, behind the player's back.
+        ALOGW("phase error of %.2f ms, relocking.", error / 90.0);
+
+        mAnchorTarget = mapTime(mLastPCR);
+        mAnchorSource = mLastPCR;
+        mRate = 0.0;
+        mFrequency = 0.0;
+        mHaveReferenceDelay = false;
+        return;
+    }
+
+    double relativeError = (double)error / kWindowDuration;
+
+    mFrequency += kIntegralGain * relativeError;
+    if (mFrequency > kMaxRate) {
+        mFrequency = kMaxRate;
+    } else if (mFrequency < -kMaxRate) {
+        mFrequency = -kMaxRate;
+    }
+
+    // Keep the mapping continuous.
+    mAnchorTarget = mapTime(mLastPCR);
+    mAnchorSource = mLastPCR;
+
+    mRate = mFrequency + kProportionalGain * relativeError;
+    if (mRate > 2 * kMaxRate) {
+        mRate = 2 * kMaxRate;
+    } else if (mRate < -2 * kMaxRate) {
+        mRate = -2 * kMaxRate;
+    }
+
+    ALOGV("phase error %.2f ms, skew %.2f ppm",
+          error / 90.0, mFrequency * 1E6);
+}
+
+}  // namespace android
@@ -0,0 +1,94 @@
+/*
+ * Copyright 2012, The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+
+#ifndef CLOCK_RECOVERY_H_
+
+#define CLOCK_RECOVERY_H_
+
+#include <sys/types.h>
+#include <stdint.h>
+#include <media/stagefright/foundation/ABase.h>
+
+namespace android {
+
+// Locks onto the source's clock through the PCRs in the transport stream
+// and rewrites PCRs, PTSs and DTSs in place to our clock, so that the
+// player, which only ever syncs to our clock once, doesn't drift away
+// from the source over time.
+//
+// A phase locked loop keeps the delay between a PCR's arrival and the
+// time it maps to constant. Only the smallest delay observed over each
+// second counts, the rest is network jitter.
+struct ClockRecovery {
+    ClockRecovery();
+
+    void reset();
+
+    // "size" must be a multiple of 188, "arrivalTimeUs" is when the data
+    // was received.
+    void process(uint8_t *data, size_t size, int64_t arrivalTimeUs);
+
+    bool isLocked() const;
+
+    // How much faster our clock runs than the source's.
+    double skewPPM() const;
+
+private:
+    // In 90kHz units.
+    static const int64_t kWindowDuration = 90000ll;
+    static const int64_t kMaxPhaseError = 90000ll;
+
+    static const double kProportionalGain;
+    static const double kIntegralGain;
+    static const double kMaxRate;
+
+    // The PID carrying the PCRs we lock onto, the first one seen.
+    int32_t mPCRPID;
+
+    // The last PCR base, extended beyond 33 bits.
+    bool mHavePCR;
+    int64_t mLastPCR;
+
+    // Maps "t" on the source's clock to
+    // mAnchorTarget + (t - mAnchorSource) * (1 + mRate).
+    int64_t mAnchorSource;
+    int64_t mAnchorTarget;
+    double mRate;
+
+    // The loop's frequency estimate, mRate adds the proportional term.
+    double mFrequency;
+
+    bool mHaveReferenceDelay;
+    int64_t mReferenceDelay;
+
+    int64_t mWindowStart;
+    int64_t mWindowMinDelay;
+
+    void onPCR(int64_t PCR, int64_t arrivalTime);
+    void onWindowComplete();
+
+    int64_t extend(int64_t time33) const;
+    int64_t mapTime(int64_t time) const;
+
+    void rewritePESTimes(uint8_t *pes, size_t size);
+
+    DISALLOW_EVIL_CONSTRUCTORS(ClockRecovery);
+};
+
+}  // namespace android
+
+#endif  // CLOCK_RECOVERY_H_
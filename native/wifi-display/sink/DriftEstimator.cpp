@@ -0,0 +1,228 @@
+/*
+ * Copyright 2012, The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+//#define LOG_NDEBUG 0
+#define LOG_TAG "DriftEstimator"
+#include <utils/Log.h>
+
+#include "DriftEstimator.h"
+
+#include <math.h>
+
+namespace android {
+
+DriftEstimator::DriftEstimator(
+        int64_t bucketSpan, size_t historySize, int64_t minOutlierDistance)
+    : mBucketSpan(bucketSpan),
+      mHistorySize(historySize),
+      mMinOutlierDistance(minOutlierDistance),
+      mHistory(new Point[mHistorySize]) {
+    reset();
+}
+
+DriftEstimator::~DriftEstimator() {
+    delete[] mHistory;
+    mHistory = NULL;
+}
+
+void DriftEstimator::reset() {
+    mFirst = 0;
+    mCount = 0;
+
+    mBaseX = mBaseY = 0;
+    mSumX = mSumY = mSumXX = mSumXY = 0;
+
+    mHaveBucket = false;
+
+    mHaveLine = false;
+    mSlope = 0.0;
+    mIntercept = 0.0;
+    mMeanAbsResidual = 0.0;
+    mNumConsecutiveOutliers = 0;
+}
+
+void DriftEstimator::addSample(int64_t sendTime, int64_t arrivalTime) {
+    Point p;
+    p.mX = sendTime;
+    p.mY = arrivalTime - sendTime;
+
+    if (mHaveBucket) {
+        int64_t maxJump = mBucketSpan * (int64_t)mHistorySize;
+
+        if (sendTime < mBucketStart && mBucketStart - sendTime <= maxJump) {
+            // Reordered or retransmitted, it was delayed anyway and its
+            // bucket is done with.
+            return;
+        }
+
+        if (sendTime < mBucketStart
+                || sendTime - mBucketStart > maxJump + mBucketSpan) {
+            // The sender's clock jumped, nothing we have is of any use
+            // anymore.
+            ALOGI("send time discontinuity, starting over.");
+            reset();
+        }
+    }
+
+    if (!mHaveBucket) {
+        mHaveBucket = true;
+        mBucketStart = sendTime;
+        mBucketMin = p;
+        return;
+    }
+
+    if (sendTime - mBucketStart < mBucketSpan) {
+        if (p.mY < mBucketMin.mY) {
+            mBucketMin = p;
+        }
+        return;
+    }
+
+    addPoint(mBucketMin);
+
+    mBucketStart = sendTime;
+    mBucketMin = p;
+}
+
+void DriftEstimator::addPoint(const Point &p) {
+    if (mHaveLine) {
+        double residual = fabs(p.mY - transitAt(p.mX));
+
+        if (residual > mMinOutlierDistance
+                && residual > kOutlierFactor * mMeanAbsResidual) {
+            if (++mNumConsecutiveOutliers < kMaxNumConsecutiveOutliers) {
+                ALOGV("ignoring outlier, %.2f off the line.", residual);
+                return;
+            }
+
+            // This is no outlier, the relationship between the clocks
+            // changed.
+            ALOGI("too many consecutive outliers, starting over.");
+
+            Point bucketMin = mBucketMin;
+            reset();
+
+            mHaveBucket = true;
+            mBucketStart = bucketMin.mX;
+            mBucketMin = bucketMin;
+        } else {
+            mMeanAbsResidual += (residual - mMeanAbsResidual) / 16.0;
+        }
+    }
+
+    mNumConsecutiveOutliers = 0;
+
+    if (mCount == mHistorySize) {
+        removeOldestPoint();
+    }
+
+    if (mCount == 0) {
+        mBaseX = p.mX;
+        mBaseY = p.mY;
+    }
+
+    mHistory[(mFirst + mCount) % mHistorySize] = p;
+    ++mCount;
+
+    int64_t x = p.mX - mBaseX;
+    int64_t y = p.mY - mBaseY;
+
+    mSumX += x;
+    mSumY += y;
+    mSumXX += x * x;
+    mSumXY += x * y;
+
+    fitLine();
+}
+
+void DriftEstimator::removeOldestPoint() {
+    const Point &oldest = mHistory[mFirst];
+
+    int64_t x = oldest.mX - mBaseX;
+    int64_t y = oldest.mY - mBaseY;
+
+    mSumX -= x;
+    mSumY -= y;
+    mSumXX -= x * x;
+    mSumXY -= x * y;
+
+    mFirst = (mFirst + 1) % mHistorySize;
+    --mCount;
+
+    if (mCount > 0) {
+        // Keep the values summed up small.
+        const Point &first = mHistory[mFirst];
+        rebase(first.mX, first.mY);
+    }
+}
+
+void DriftEstimator::rebase(int64_t x, int64_t y) {
+    int64_t dx = x - mBaseX;
+    int64_t dy = y - mBaseY;
+    int64_t n = mCount;
+
+    // sum((x - dx) * (x - dx)) and sum((x - dx) * (y - dy)) expanded.
+    mSumXX += n * dx * dx - 2 * dx * mSumX;
+    mSumXY += n * dx * dy - dx * mSumY - dy * mSumX;
+    mSumX -= n * dx;
+    mSumY -= n * dy;
+
+    mBaseX = x;
+    mBaseY = y;
+}
+
+void DriftEstimator::fitLine() {
+    if (mCount < kMinNumPoints) {
+        return;
+    }
+
+    double n = mCount;
+    double varX = n * (double)mSumXX - (double)mSumX * (double)mSumX;
+
+    if (varX <= 0.0) {
+        return;
+    }
+
+    mSlope = (n * (double)mSumXY - (double)mSumX * (double)mSumY) / varX;
+    mIntercept = ((double)mSumY - mSlope * (double)mSumX) / n;
+    mHaveLine = true;
+}
+
+double DriftEstimator::transitAt(int64_t x) const {
+    return mBaseY + mIntercept + mSlope * (double)(x - mBaseX);
+}
+
+bool DriftEstimator::hasEstimate() const {
+    return mHaveLine;
+}
+
+double DriftEstimator::skewPPM() const {
+    return mSlope * 1E6;
+}
+
+double DriftEstimator::offset() const {
+    if (mCount == 0) {
+        return 0.0;
+    }
+
+    return transitAt(mHistory[(mFirst + mCount - 1) % mHistorySize].mX);
+}
+
+double DriftEstimator::expectedArrivalTime(int64_t sendTime) const {
+    return sendTime + transitAt(sendTime);
+}
+
+}  // namespace android
@@ -0,0 +1,107 @@
+/*
+ * Copyright 2012, The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef DRIFT_ESTIMATOR_H_
+
+#define DRIFT_ESTIMATOR_H_
+
+#include <sys/types.h>
+#include <stdint.h>
+#include <media/stagefright/foundation/ABase.h>
+
+namespace android {
+
+// Estimates the offset and the relative skew between a sender's clock and
+// ours from (send time, arrival time) pairs, both in the same time unit.
+// Samples are reduced to the one with the smallest transit delay per
+// "bucketSpan" of send time, a line is fitted to the transit delay of the
+// last "historySize" of those. All work per sample is O(1).
+struct DriftEstimator {
+    // Points further than "minOutlierDistance" and a multiple of the
+    // average residual off the line are ignored.
+    DriftEstimator(
+            int64_t bucketSpan, size_t historySize,
+            int64_t minOutlierDistance);
+
+    ~DriftEstimator();
+
+    void reset();
+
+    // "sendTime" must not wrap around. Samples sent before the current
+    // bucket started are ignored unless they go back further than the
+    // history spans, which is taken to be a discontinuity.
+    void addSample(int64_t sendTime, int64_t arrivalTime);
+
+    bool hasEstimate() const;
+
+    // How much faster our clock runs than the sender's, in parts per million.
+    double skewPPM() const;
+
+    // The minimum transit delay, i.e. arrivalTime - sendTime, at the
+    // most recent point.
+    double offset() const;
+
+    // The arrival time of a packet sent at "sendTime" that didn't incur any
+    // queueing delay.
+    double expectedArrivalTime(int64_t sendTime) const;
+
+private:
+    enum {
+        kMinNumPoints = 8,
+        kMaxNumConsecutiveOutliers = 5,
+        kOutlierFactor = 4,
+    };
+
+    struct Point {
+        int64_t mX;  // send time
+        int64_t mY;  // transit delay
+    };
+
+    int64_t mBucketSpan;
+    size_t mHistorySize;
+    int64_t mMinOutlierDistance;
+
+    Point *mHistory;
+    size_t mFirst;
+    size_t mCount;
+
+    // Running sums over the points in the history, relative to the oldest
+    // one, in integer arithmetic so that removing points is exact.
+    int64_t mBaseX, mBaseY;
+    int64_t mSumX, mSumY, mSumXX, mSumXY;
+
+    bool mHaveBucket;
+    int64_t mBucketStart;
+    Point mBucketMin;
+
+    bool mHaveLine;
+    double mSlope;
+    double mIntercept;  // transit delay at mBaseX
+    double mMeanAbsResidual;
+    size_t mNumConsecutiveOutliers;
+
+    void addPoint(const Point &p);
+    void removeOldestPoint();
+    void rebase(int64_t x, int64_t y);
+    void fitLine();
+    double transitAt(int64_t x) const;
+
+    DISALLOW_EVIL_CONSTRUCTORS(DriftEstimator);
+};
+
+}  // namespace android
+
+#endif  // DRIFT_ESTIMATOR_H_
@@ -0,0 +1,255 @@
+/*
+ * Copyright 2012, The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+
+//#define LOG_NDEBUG 0
+#define LOG_TAG "HeadlessRenderer"
+#include <utils/Log.h>
+
+#include "HeadlessRenderer.h"
+
+#include "MediaPacket.h"
+
+#include <media/stagefright/foundation/ABuffer.h>
+#include <media/stagefright/foundation/ALooper.h>
+
+namespace android {
+
+static const unsigned kPATPID = 0;
+static const unsigned kNullPID = 0x1fff;
+
+HeadlessRenderer::HeadlessRenderer()
+    : mStatsStartUs(-1ll),
+      mNumDiscontinuities(0) {
+}
+
+HeadlessRenderer::~HeadlessRenderer() {
+    logStats();
+}
+
+HeadlessRenderer::StreamInfo *HeadlessRenderer::getStreamInfo(unsigned PID) {
+    ssize_t index = mStreams.indexOfKey(PID);
+
+    if (index < 0) {
+        StreamInfo info;
+        info.mStreamID = 0;
+        info.mInFrame = false;
+        info.mFramePTS = -1ll;
+        info.mFrameFirstArrivalUs = -1ll;
+        info.mFrameLastArrivalUs = -1ll;
+        info.mNumFrames = 0;
+        info.mNumBytes = 0ll;
+        info.mTotalLatencyUs = 0ll;
+        info.mMaxLatencyUs = 0ll;
+        info.mHaveTransit = false;
+        info.mTransitUs = 0ll;
+        info.mJitterUs = 0.0;
+
+        index = mStreams.add(PID, info);
+    }
+
+    return &mStreams.editValueAt(index);
+}
+
+uint32_t HeadlessRenderer::queueBuffer(
+        const sp<ABuffer> &buffer, bool discontinuity) {
+    int64_t nowUs = ALooper::GetNowUs();
+
+    int64_t arrivalTimeUs = MediaPacket::From(buffer)->mArrivalTimeUs;
+    if (arrivalTimeUs < 0ll) {
+        arrivalTimeUs = nowUs;
+    }
+
+    if (mStatsStartUs < 0ll) {
+        mStatsStartUs = nowUs;
+    }
+
+    if (discontinuity) {
+        // Whatever was in progress won't be completed.
+        for (size_t i = 0; i < mStreams.size(); ++i) {
+            mStreams.editValueAt(i).mInFrame = false;
+        }
+
+        ++mNumDiscontinuities;
+    }
+
+    uint32_t flags = mValidator.validate(buffer->data(), buffer->size());
+
+    const uint8_t *data = buffer->data();
+    size_t size = buffer->size();
+
+    for (; size >= 188; data += 188, size -= 188) {
+        if (data[0] != 0x47) {
+            continue;
+        }
+
+        unsigned PID = ((data[1] & 0x1f) << 8) | data[2];
+        if (PID == kPATPID || PID == kNullPID) {
+            continue;
+        }
+
+        bool payload_unit_start_indicator = data[1] & 0x40;
+        unsigned adaptation_field_control = (data[3] >> 4) & 3;
+
+        if (!(adaptation_field_control & 1)) {
+            continue;
+        }
+
+        size_t offset = 4;
+        if (adaptation_field_control & 2) {
+            offset += 1 + data[4];
+        }
+
+        if (offset >= 188) {
+            continue;
+        }
+
+        const uint8_t *payload = &data[offset];
+        size_t payloadSize = 188 - offset;
+
+        if (payload_unit_start_indicator) {
+            if (payloadSize < 9
+                    || payload[0] != 0x00
+                    || payload[1] != 0x00
+                    || payload[2] != 0x01) {
+                // PSI, i.e. the PMT.
+                continue;
+            }
+
+            StreamInfo *info = getStreamInfo(PID);
+
+            if (info->mInFrame) {
+                completeFrame(info);
+            }
+
+            info->mStreamID = payload[3];
+            info->mInFrame = true;
+            info->mFrameFirstArrivalUs = arrivalTimeUs;
+            info->mFramePTS = -1ll;
+
+            if ((payload[7] & 0x80) && payloadSize >= 14) {
+                info->mFramePTS =
+                    ((int64_t)((payload[9] >> 1) & 7) << 30)
+                    | (payload[10] << 22)
+                    | ((payload[11] >> 1) << 15)
+                    | (payload[12] << 7)
+                    | (payload[13] >> 1);
+            }
+        }
+
+        ssize_t index = mStreams.indexOfKey(PID);
+        if (index < 0) {
+            continue;
+        }
+
+        StreamInfo *info = &mStreams.editValueAt(index);
+        if (!info->mInFrame) {
+            continue;
+        }
+
+        info->mFrameLastArrivalUs = arrivalTimeUs;
+        info->mNumBytes += payloadSize;
+    }
+
+    if (nowUs >= mStatsStartUs + kLogStatsIntervalUs) {
+        logStats();
+    }
+
+    return flags;
+}
+
+void HeadlessRenderer::completeFrame(StreamInfo *info) {
+    info->mInFrame = false;
+
+    int64_t latencyUs =
+        info->mFrameLastArrivalUs - info->mFrameFirstArrivalUs;
+
+    ++info->mNumFrames;
+    info->mTotalLatencyUs += latencyUs;
+    if (latencyUs > info->mMaxLatencyUs) {
+        info->mMaxLatencyUs = latencyUs;
+    }
+
+    if (info->mFramePTS < 0ll) {
+        return;
+    }
+
+    // The PTS wraps around after about 26 hours, don't bother.
+    int64_t transitUs =
+        info->mFrameLastArrivalUs - (info->mFramePTS * 100ll) / 9ll;
+
+    if (info->mHaveTransit) {
+        int64_t d = transitUs - info->mTransitUs;
+        if (d < 0ll) {
+            d = -d;
+        }
+
+        info->mJitterUs += (d - info->mJitterUs) / 16.0;
+    }
+
+    info->mHaveTransit = true;
+    info->mTransitUs = transitUs;
+}
+
+void HeadlessRenderer::logStats() {
+    if (mStatsStartUs < 0ll) {
+        return;
+    }
+
+    int64_t nowUs = ALooper::GetNowUs();
+    int64_t elapsedUs = nowUs - mStatsStartUs;
+
+    if (elapsedUs <= 0ll) {
+        return;
+    }
+
+    for (size_t i = 0; i < mStreams.size(); ++i) {
+        StreamInfo *info = &mStreams.editValueAt(i);
+
+        if (info->mNumFrames == 0) {
+            continue;
+        }
+
+        bool isVideo = (info->mStreamID & 0xf0) == 0xe0;
+
+        ALOGI("PID 0x%04x (%s): %d frames (%.2f fps), %.2f Mbit/s, "
+              "latency avg %.2f ms, max %.2f ms, jitter %.2f ms",
+              mStreams.keyAt(i),
+              isVideo ? "video" : "audio",
+              info->mNumFrames,
+              info->mNumFrames * 1E6 / elapsedUs,
+              info->mNumBytes * 8.0 / elapsedUs,
+              info->mTotalLatencyUs / (info->mNumFrames * 1E3),
+              info->mMaxLatencyUs / 1E3,
+              info->mJitterUs / 1E3);
+
+        info->mNumFrames = 0;
+        info->mNumBytes = 0ll;
+        info->mTotalLatencyUs = 0ll;
+        info->mMaxLatencyUs = 0ll;
+    }
+
+    if (mNumDiscontinuities > 0) {
+        ALOGI("%d discontinuities", mNumDiscontinuities);
+        mNumDiscontinuities = 0;
+    }
+
+    mValidator.logStats();
+
+    mStatsStartUs = nowUs;
+}
+
+}  // namespace android
@@ -0,0 +1,88 @@
+/*
+ * Copyright 2012, The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+
+#ifndef HEADLESS_RENDERER_H_
+
+#define HEADLESS_RENDERER_H_
+
+#include "TSValidator.h"
+
+#include <media/stagefright/foundation/ABase.h>
+#include <utils/KeyedVector.h>
+#include <utils/RefBase.h>
+
+namespace android {
+
+struct ABuffer;
+
+// Takes the place of the media player when there's nothing to render to,
+// e.g. for soak and throughput testing. The transport stream is split
+// into PES packets, i.e. frames, but not decoded. Per stream, it keeps
+// track of the number of frames and bytes, the time from the arrival of
+// a frame's first packet to that of its last one and the interarrival
+// jitter of complete frames relative to their PTS.
+struct HeadlessRenderer {
+    HeadlessRenderer();
+    ~HeadlessRenderer();
+
+    // "buffer" is a MediaPacket's payload, "discontinuity" is set if data
+    // preceding it was discarded. Returns TSValidator flags.
+    uint32_t queueBuffer(const sp<ABuffer> &buffer, bool discontinuity);
+
+    void logStats();
+
+private:
+    struct StreamInfo {
+        uint8_t mStreamID;
+
+        // The frame in progress.
+        bool mInFrame;
+        int64_t mFramePTS;  // -1 if none
+        int64_t mFrameFirstArrivalUs;
+        int64_t mFrameLastArrivalUs;
+
+        // Since the last logStats().
+        size_t mNumFrames;
+        int64_t mNumBytes;
+        int64_t mTotalLatencyUs;
+        int64_t mMaxLatencyUs;
+
+        // Of complete frames, RFC 3550 style, in us.
+        bool mHaveTransit;
+        int64_t mTransitUs;
+        double mJitterUs;
+    };
+
+    static const int64_t kLogStatsIntervalUs = 10000000ll;
+
+    TSValidator mValidator;
+
+    KeyedVector<unsigned, StreamInfo> mStreams;
+
+    int64_t mStatsStartUs;
+
+    size_t mNumDiscontinuities;
+
+    StreamInfo *getStreamInfo(unsigned PID);
+    void completeFrame(StreamInfo *info);
+
+    DISALLOW_EVIL_CONSTRUCTORS(HeadlessRenderer);
+};
+
+}  // namespace android
+
+#endif  // HEADLESS_RENDERER_H_
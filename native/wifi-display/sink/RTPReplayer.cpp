@@ -0,0 +1,318 @@
+/*
+ * Copyright 2012, The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+//#define LOG_NDEBUG 0
+#define LOG_TAG "RTPReplayer"
+#include <utils/Log.h>
+
+#include "RTPReplayer.h"
+
+#include "ANetworkSession.h"
+#include "MediaPacket.h"
+#include "ParsedMessage.h"
+#include "RTPSink.h"
+
+#include <media/stagefright/foundation/ABuffer.h>
+#include <media/stagefright/foundation/ADebug.h>
+#include <media/stagefright/foundation/AMessage.h>
+#include <media/stagefright/MediaErrors.h>
+#include <media/stagefright/Utils.h>
+
+namespace android {
+
+RTPReplayer::RTPReplayer(
+        const sp<ANetworkSession> &netSession,
+        const sp<ISurfaceTexture> &surfaceTex,
+        bool realTime,
+        bool headless)
+    : mNetSession(netSession),
+      mSurfaceTex(surfaceTex),
+      mRealTime(realTime),
+      mHeadless(headless),
+      mReader(NULL),
+      mHavePacket(false),
+      mRTPPort(-1),
+      mFirstPacketTimeUs(-1ll),
+      mLastPacketTimeUs(-1ll),
+      mStartTimeUs(-1ll),
+      mNumPacketsInjected(0),
+      mNumBytesInjected(0ll),
+      mNumIDRRequests(0) {
+}
+
+RTPReplayer::~RTPReplayer() {
+    delete mReader;
+    mReader = NULL;
+}
+
+void RTPReplayer::start(const char *path) {
+    sp<AMessage> msg = new AMessage(kWhatStart, id());
+    msg->setString("path", path);
+    msg->post();
+}
+
+void RTPReplayer::onMessageReceived(const sp<AMessage> &msg) {
+    switch (msg->what()) {
+        case kWhatStart:
+        {
+            AString path;
+            CHECK(msg->findString("path", &path));
+
+            status_t err = onStart(path.c_str());
+
+            if (err != OK) {
+                finish(err);
+            }
+            break;
+        }
+
+        case kWhatReplay:
+        {
+            onReplay();
+            break;
+        }
+
+        case kWhatRTPSinkNotify:
+        {
+            int32_t what;
+            CHECK(msg->findInt32("what", &what));
+
+            if (what == RTPSink::kWhatRequestIDR) {
+                ALOGI("sink requested an IDR frame.");
+                ++mNumIDRRequests;
+            }
+            break;
+        }
+
+        default:
+            TRESPASS();
+    }
+}
+
+status_t RTPReplayer::onStart(const char *path) {
+    mReader = new NetworkCaptureReader(path);
+
+    status_t err = mReader->initCheck();
+    if (err != OK) {
+        return err;
+    }
+
+    sp<AMessage> notify = new AMessage(kWhatRTPSinkNotify, id());
+    mRTPSink = new RTPSink(mNetSession, notify, mSurfaceTex, mHeadless);
+    looper()->registerHandler(mRTPSink);
+
+    // No sockets, everything is injected.
+    err = mRTPSink->init(true /* useTCPInterleaving */);
+
+    if (err != OK) {
+        return err;
+    }
+
+    (new AMessage(kWhatReplay, id()))->post();
+
+    return OK;
+}
+
+void RTPReplayer::onReplay() {
+    size_t numInjected = 0;
+
+    for (;;) {
+        if (!mHavePacket) {
+            status_t err = mReader->readPacket(&mPacket);
+
+            if (err != OK) {
+                finish(err == ERROR_END_OF_STREAM ? OK : err);
+                return;
+            }
+
+            mHavePacket = true;
+            mLastPacketTimeUs = mPacket.mTimeUs;
+        }
+
+        int64_t nowUs = ALooper::GetNowUs();
+
+        if (mFirstPacketTimeUs < 0ll) {
+            mFirstPacketTimeUs = mPacket.mTimeUs;
+            mStartTimeUs = nowUs;
+        }
+
+        if (mRealTime) {
+            int64_t delayUs =
+                (mPacket.mTimeUs - mFirstPacketTimeUs)
+                    - (nowUs - mStartTimeUs);
+
+            if (delayUs > 0ll) {
+                (new AMessage(kWhatReplay, id()))->post(delayUs);
+                return;
+            }
+        } else if (numInjected == kMaxNumPacketsPerBatch) {
+            // Let the sink work off what we've given it so far.
+            (new AMessage(kWhatReplay, id()))->post();
+            return;
+        }
+
+        mHavePacket = false;
+
+        if (mPacket.mIsDatagram) {
+            injectDatagram(mPacket);
+        } else {
+            injectStreamData(mPacket);
+        }
+
+        ++numInjected;
+    }
+}
+
+void RTPReplayer::injectDatagram(const NetworkCaptureReader::Packet &packet) {
+    const sp<MediaPacket> &data = packet.mData;
+
+    if (data->size() < 2) {
+        return;
+    }
+
+    // RTCP packet types 192-223 don't collide with RTP payload types,
+    // marker bit included (RFC 5761).
+    uint8_t type = data->data()[1];
+    bool isRTP = (type < 192 || type > 223);
+
+    if (isRTP) {
+        if (mRTPPort < 0) {
+            mRTPPort = packet.mToPort;
+            ALOGI("sink received RTP on port %d", mRTPPort);
+        } else if (packet.mToPort != mRTPPort) {
+            return;
+        }
+    } else if (mRTPPort < 0 || packet.mToPort != mRTPPort + 1) {
+        // Sent by the sink or unrelated.
+        return;
+    }
+
+    inject(isRTP, data, packet.mTimeUs);
+}
+
+void RTPReplayer::injectStreamData(
+        const NetworkCaptureReader::Packet &packet) {
+    AString key = StringPrintf(
+            "%u:%u>%u:%u",
+            packet.mFromAddr, packet.mFromPort,
+            packet.mToAddr, packet.mToPort);
+
+    ssize_t index = mStreams.indexOfKey(key);
+    if (index < 0) {
+        index = mStreams.add(key, AString());
+    }
+
+    AString *stream = &mStreams.editValueAt(index);
+    stream->append(
+            (const char *)packet.mData->data(), packet.mData->size());
+
+    // Same framing as in ANetworkSession, RTSP messages are skipped.
+    while (!stream->empty()) {
+        if (stream->c_str()[0] == '$') {
+            if (stream->size() < 4) {
+                break;
+            }
+
+            size_t length = U16_AT((const uint8_t *)stream->c_str() + 2);
+
+            if (stream->size() < 4 + length) {
+                break;
+            }
+
+            sp<MediaPacket> data = new MediaPacket(length);
+            memcpy(data->data(), stream->c_str() + 4, length);
+
+            inject(stream->c_str()[1] == 0 /* isRTP */,
+                   data,
+                   packet.mTimeUs);
+
+            stream->erase(0, 4 + length);
+            continue;
+        }
+
+        size_t length;
+        sp<ParsedMessage> msg =
+            ParsedMessage::Parse(
+                    stream->c_str(), stream->size(), false, &length);
+
+        if (msg == NULL) {
+            break;
+        }
+
+        stream->erase(0, length);
+    }
+}
+
+void RTPReplayer::inject(
+        bool isRTP, const sp<MediaPacket> &data, int64_t captureTimeUs) {
+    if (mRealTime) {
+        // Spaced as captured, rather than by when the looper got around
+        // to injecting them.
+        data->mArrivalTimeUs =
+            mStartTimeUs + (captureTimeUs - mFirstPacketTimeUs);
+    } else {
+        // The sink's timers run on the current clock, so must its packets.
+        data->mArrivalTimeUs = ALooper::GetNowUs();
+    }
+
+    mRTPSink->injectPacket(isRTP, data);
+
+    ++mNumPacketsInjected;
+    mNumBytesInjected += data->size();
+}
+
+void RTPReplayer::finish(status_t err) {
+    if (err != OK) {
+        ALOGE("replay failed (err %d)", err);
+    }
+
+    if (mStartTimeUs >= 0ll) {
+        int64_t elapsedUs = ALooper::GetNowUs() - mStartTimeUs;
+
+        ALOGI("replayed %d packets, %lld bytes in %.2f secs (%.2f Mbit/s), "
+              "capture spans %.2f secs, %d IDR frame requests",
+              mNumPacketsInjected,
+              mNumBytesInjected,
+              elapsedUs / 1E6,
+              elapsedUs > 0ll ? mNumBytesInjected * 8.0 / elapsedUs : 0.0,
+              (mLastPacketTimeUs - mFirstPacketTimeUs) / 1E6,
+              mNumIDRRequests);
+
+        if (!mRealTime) {
+            ALOGI("replayed as fast as possible, only the throughput is "
+                  "meaningful.");
+        }
+    }
+
+    if (mRTPSink != NULL) {
+        AVSyncMonitor::Stats stats;
+        mRTPSink->getAVSyncStats(&stats);
+
+        if (stats.mValid) {
+            ALOGI("final A/V sync: audio arrives %.2f ms later than video, "
+                  "latency %.2f/%.2f ms, drift %.2f/%.2f ppm (video/audio)",
+                  stats.mArrivalSkewMs,
+                  stats.mVideoLatencyMs,
+                  stats.mAudioLatencyMs,
+                  stats.mVideoDriftPPM,
+                  stats.mAudioDriftPPM);
+        }
+    }
+
+    looper()->stop();
+}
+
+}  // namespace android
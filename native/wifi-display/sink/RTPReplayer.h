@@ -0,0 +1,107 @@
+/*
+ * Copyright 2012, The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef RTP_REPLAYER_H_
+
+#define RTP_REPLAYER_H_
+
+#include "NetworkCapture.h"
+
+#include <gui/Surface.h>
+#include <media/stagefright/foundation/AHandler.h>
+#include <media/stagefright/foundation/AString.h>
+#include <utils/KeyedVector.h>
+
+namespace android {
+
+struct ANetworkSession;
+struct MediaPacket;
+struct RTPSink;
+
+// Feeds the RTP and RTCP packets received by a sink, as recorded by
+// NetworkCapture, into an RTPSink of its own running on the same looper.
+// Packets are either paced like they were captured or injected as fast as
+// the sink takes them. Stops the looper once the capture is exhausted.
+//
+// The sink's timers, i.e. NACK and playout deadlines, run on the current
+// clock. So only a paced replay reproduces the capture's timing, the
+// packets arriving when they did relative to the first. Replaying as fast
+// as possible is good for measuring throughput only, its jitter, latency
+// and loss recovery figures reflect the replay itself.
+struct RTPReplayer : public AHandler {
+    // See TunnelRenderer for "headless".
+    RTPReplayer(
+            const sp<ANetworkSession> &netSession,
+            const sp<ISurfaceTexture> &surfaceTex,
+            bool realTime,
+            bool headless = false);
+
+    void start(const char *path);
+
+protected:
+    virtual ~RTPReplayer();
+    virtual void onMessageReceived(const sp<AMessage> &msg);
+
+private:
+    enum {
+        kWhatStart,
+        kWhatReplay,
+        kWhatRTPSinkNotify,
+    };
+
+    // Packets injected per message when not pacing.
+    static const size_t kMaxNumPacketsPerBatch = 32;
+
+    sp<ANetworkSession> mNetSession;
+    sp<ISurfaceTexture> mSurfaceTex;
+    bool mRealTime;
+    bool mHeadless;
+
+    NetworkCaptureReader *mReader;
+    sp<RTPSink> mRTPSink;
+
+    // The next packet to be injected, if already read.
+    bool mHavePacket;
+    NetworkCaptureReader::Packet mPacket;
+
+    // The sink's RTP port, the destination of the first RTP packet.
+    int32_t mRTPPort;
+
+    // Stream data by direction, for RTP and RTCP interleaved with RTSP.
+    KeyedVector<AString, AString> mStreams;
+
+    int64_t mFirstPacketTimeUs;
+    int64_t mLastPacketTimeUs;
+    int64_t mStartTimeUs;
+
+    size_t mNumPacketsInjected;
+    int64_t mNumBytesInjected;
+    size_t mNumIDRRequests;
+
+    status_t onStart(const char *path);
+    void onReplay();
+    void injectDatagram(const NetworkCaptureReader::Packet &packet);
+    void injectStreamData(const NetworkCaptureReader::Packet &packet);
+    void inject(
+            bool isRTP, const sp<MediaPacket> &data, int64_t captureTimeUs);
+    void finish(status_t err);
+
+    DISALLOW_EVIL_CONSTRUCTORS(RTPReplayer);
+};
+
+}  // namespace android
+
+#endif  // RTP_REPLAYER_H_
@@ -21,6 +21,7 @@
 #include "RTPSink.h"
 
 #include "ANetworkSession.h"
+#include "MediaPacket.h"
 #include "TunnelRenderer.h"
 
 #include <media/stagefright/foundation/ABuffer.h>
@@ -33,13 +34,36 @@
 namespace android {
 
 struct RTPSink::Source : public RefBase {
-    Source(uint16_t seq, const sp<ABuffer> &buffer,
-           const sp<AMessage> queueBufferMsg);
+    Source(uint16_t seq, const sp<MediaPacket> &buffer,
+           List<sp<MediaPacket> > *pendingPackets);
 
-    bool updateSeq(uint16_t seq, const sp<ABuffer> &buffer);
+    bool updateSeq(uint16_t seq, const sp<MediaPacket> &buffer);
+
+    // "ntpTime" is the NTP timestamp carried by a sender report arriving
+    // at "arrivalTimeUs".
+    void onSenderReport(uint64_t ntpTime, int64_t arrivalTimeUs);
 
     void addReportBlock(uint32_t ssrc, const sp<ABuffer> &buf);
 
+    // Number of packets expected and lost since the last call.
+    void collectLossStats(uint32_t *numExpected, uint32_t *numLost);
+
+    // True if gaps in the sequence were detected that haven't been
+    // NACKed yet.
+    bool hasNewLosses() const;
+
+    // Appends the extended sequence numbers of all missing packets for which
+    // a (re)transmission request is due to "extSeqNos", in ascending order.
+    // Returns the time at which this should be called again, or -1 if there
+    // are no missing packets left to wait for.
+    int64_t collectNACKs(int64_t nowUs, Vector<uint32_t> *extSeqNos);
+
+    // True if an access unit, as delimited by the marker bit, was completed
+    // since the last call, i.e. all of its packets have arrived.
+    bool checkFrameCompleted();
+
+    void logFrameStats(uint32_t ssrc);
+
 protected:
     virtual ~Source();
 
@@ -49,7 +73,20 @@ private:
     static const uint32_t kMaxMisorder = 100;
     static const uint32_t kRTPSeqMod = 1u << 16;
 
-    sp<AMessage> mQueueBufferMsg;
+    static const size_t kMaxNumMissingPackets = 512;
+
+    // Used until we have measured the time between a NACK and the arrival
+    // of the retransmitted packet.
+    static const int64_t kDefaultRTTUs = 20000ll;
+    static const int64_t kMinNACKRetryIntervalUs = 5000ll;
+
+    struct MissingPacket {
+        int64_t mDetectedUs;
+        int64_t mLastNACKUs;
+        int32_t mNumNACKs;
+    };
+
+    List<sp<MediaPacket> > *mPendingPackets;
 
     uint16_t mMaxSeq;
     uint32_t mCycles;
@@ -60,8 +97,48 @@ private:
     uint32_t mExpectedPrior;
     uint32_t mReceivedPrior;
 
+    // As above, for the bandwidth estimate.
+    uint32_t mExpectedPriorLossStats;
+    uint32_t mReceivedPriorLossStats;
+
+    // Interarrival jitter in RTP time units, scaled by 16 (RFC 3550 A.8).
+    bool mHaveTransit;
+    int32_t mTransit;
+    uint32_t mJitter;
+
+    // The middle 32 bits of the last SR's NTP timestamp and its arrival time.
+    uint32_t mLastSR;
+    int64_t mLastSRArrivalTimeUs;
+
+    // Keyed by extended sequence number.
+    KeyedVector<uint32_t, MissingPacket> mMissingPackets;
+    size_t mNumNewLosses;
+
+    // Smoothed round trip time as observed through retransmissions.
+    int64_t mRTTUs;
+
+    // The frame in progress starts with the first packet following the
+    // last marker, the last frame whose marker arrived may still be
+    // missing packets.
+    int64_t mFrameStartUs;
+    int32_t mLastFrameEndExtSeqNo;
+    int64_t mIncompleteFrameStartUs;
+    int32_t mIncompleteFrameEndExtSeqNo;
+    bool mFrameCompleted;
+
+    // Time from the arrival of a frame's first packet until it was
+    // complete, since the last logFrameStats().
+    size_t mNumFrames;
+    size_t mNumAbandonedFrames;
+    int64_t mTotalFrameLatencyUs;
+    int64_t mMaxFrameLatencyUs;
+
     void initSeq(uint16_t seq);
-    void queuePacket(const sp<ABuffer> &buffer);
+    void addMissingPackets(uint32_t fromExtSeqNo, uint32_t toExtSeqNo);
+    void onPacketArrived(uint32_t extSeqNo);
+    void updateJitter(const sp<MediaPacket> &buffer);
+    void queuePacket(const sp<MediaPacket> &buffer);
+    void updateFrameState(const sp<MediaPacket> &buffer);
 
     DISALLOW_EVIL_CONSTRUCTORS(Source);
 };
@@ -69,14 +146,23 @@ private:
 ////////////////////////////////////////////////////////////////////////////////
 
 RTPSink::Source::Source(
-        uint16_t seq, const sp<ABuffer> &buffer,
-        const sp<AMessage> queueBufferMsg)
-    : mQueueBufferMsg(queueBufferMsg),
-      mProbation(kMinSequential) {
+        uint16_t seq, const sp<MediaPacket> &buffer,
+        List<sp<MediaPacket> > *pendingPackets)
+    : mPendingPackets(pendingPackets),
+      mProbation(kMinSequential),
+      mHaveTransit(false),
+      mTransit(0),
+      mJitter(0),
+      mLastSR(0),
+      mLastSRArrivalTimeUs(-1ll),
+      mNumNewLosses(0),
+      mRTTUs(-1ll) {
     initSeq(seq);
     mMaxSeq = seq - 1;
 
-    buffer->setInt32Data(mCycles | seq);
+    updateJitter(buffer);
+
+    buffer->mExtSeqNo = mCycles | seq;
     queuePacket(buffer);
 }
 
@@ -91,16 +177,34 @@ void RTPSink::Source::initSeq(uint16_t seq) {
     mReceived = 0;
     mExpectedPrior = 0;
     mReceivedPrior = 0;
+    mExpectedPriorLossStats = 0;
+    mReceivedPriorLossStats = 0;
+
+    mMissingPackets.clear();
+    mNumNewLosses = 0;
+
+    mFrameStartUs = -1ll;
+    mLastFrameEndExtSeqNo = -1;
+    mIncompleteFrameStartUs = -1ll;
+    mIncompleteFrameEndExtSeqNo = -1;
+    mFrameCompleted = false;
+
+    mNumFrames = 0;
+    mNumAbandonedFrames = 0;
+    mTotalFrameLatencyUs = 0ll;
+    mMaxFrameLatencyUs = 0ll;
 }
 
-bool RTPSink::Source::updateSeq(uint16_t seq, const sp<ABuffer> &buffer) {
+bool RTPSink::Source::updateSeq(uint16_t seq, const sp<MediaPacket> &buffer) {
     uint16_t udelta = seq - mMaxSeq;
 
     if (mProbation) {
         // Startup phase
 
         if (seq == mMaxSeq + 1) {
-            buffer->setInt32Data(mCycles | seq);
+            updateJitter(buffer);
+
+            buffer->mExtSeqNo = mCycles | seq;
             queuePacket(buffer);
 
             --mProbation;
@@ -123,22 +227,35 @@ bool RTPSink::Source::updateSeq(uint16_t seq, const sp<ABuffer> &buffer) {
             ALOGI("XXX cleared packets");
 #endif
 
-            buffer->setInt32Data(mCycles | seq);
+            buffer->mExtSeqNo = mCycles | seq;
             queuePacket(buffer);
         }
 
         return false;
     }
 
+    uint32_t extSeqNo;
+
     if (udelta < kMaxDropout) {
         // In order, with permissible gap.
 
+        uint32_t prevExtMaxSeq = mCycles | mMaxSeq;
+
         if (seq < mMaxSeq) {
             // Sequence number wrapped - count another 64K cycle
             mCycles += kRTPSeqMod;
         }
 
         mMaxSeq = seq;
+        extSeqNo = mCycles | seq;
+
+        if (udelta > 0) {
+            updateJitter(buffer);
+        }
+
+        if (udelta > 1) {
+            addMissingPackets(prevExtMaxSeq + 1, extSeqNo - 1);
+        }
     } else if (udelta <= kRTPSeqMod - kMaxMisorder) {
         // The sequence number made a very large jump
 
@@ -153,22 +270,270 @@ bool RTPSink::Source::updateSeq(uint16_t seq, const sp<ABuffer> &buffer) {
 
             return false;
         }
+
+        extSeqNo = mCycles | seq;
     } else {
         // Duplicate or reordered packet.
+
+        extSeqNo = mCycles | seq;
+
+        if (seq > mMaxSeq && mCycles >= kRTPSeqMod) {
+            // Sent before the sequence number last wrapped around.
+            extSeqNo -= kRTPSeqMod;
+        }
     }
 
     ++mReceived;
 
-    buffer->setInt32Data(mCycles | seq);
+    onPacketArrived(extSeqNo);
+
+    buffer->mExtSeqNo = extSeqNo;
     queuePacket(buffer);
 
     return true;
 }
 
-void RTPSink::Source::queuePacket(const sp<ABuffer> &buffer) {
-    sp<AMessage> msg = mQueueBufferMsg->dup();
-    msg->setBuffer("buffer", buffer);
-    msg->post();
+void RTPSink::Source::addMissingPackets(
+        uint32_t fromExtSeqNo, uint32_t toExtSeqNo) {
+    if (toExtSeqNo - fromExtSeqNo >= kMaxNumMissingPackets) {
+        // No point in asking for more than we could keep track of, the
+        // oldest ones wouldn't make it in time anyway.
+        fromExtSeqNo = toExtSeqNo - kMaxNumMissingPackets + 1;
+    }
+
+    int64_t nowUs = ALooper::GetNowUs();
+
+    MissingPacket missing;
+    missing.mDetectedUs = nowUs;
+    missing.mLastNACKUs = -1ll;
+    missing.mNumNACKs = 0;
+
+    for (uint32_t extSeqNo = fromExtSeqNo;; ++extSeqNo) {
+        mMissingPackets.add(extSeqNo, missing);
+        ++mNumNewLosses;
+
+        if (extSeqNo == toExtSeqNo) {
+            break;
+        }
+    }
+
+    while (mMissingPackets.size() > kMaxNumMissingPackets) {
+        if (mMissingPackets.valueAt(0).mNumNACKs == 0) {
+            --mNumNewLosses;
+        }
+        mMissingPackets.removeItemsAt(0);
+    }
+}
+
+void RTPSink::Source::onPacketArrived(uint32_t extSeqNo) {
+    ssize_t index = mMissingPackets.indexOfKey(extSeqNo);
+    if (index < 0) {
+        return;
+    }
+
+    const MissingPacket &missing = mMissingPackets.valueAt(index);
+
+    if (missing.mNumNACKs == 0) {
+        // Just reordered.
+        --mNumNewLosses;
+    } else if (missing.mNumNACKs == 1) {
+        // Only unambiguous samples are used, we can't tell which request a
+        // retransmission answers if there was more than one (Karn).
+        int64_t rttUs = ALooper::GetNowUs() - missing.mLastNACKUs;
+
+        if (mRTTUs < 0ll) {
+            mRTTUs = rttUs;
+        } else {
+            mRTTUs = (7 * mRTTUs + rttUs) / 8;
+        }
+
+        ALOGV("retransmission of %u arrived after %.2f ms (rtt %.2f ms)",
+              extSeqNo, rttUs / 1E3, mRTTUs / 1E3);
+    }
+
+    mMissingPackets.removeItemsAt(index);
+}
+
+bool RTPSink::Source::hasNewLosses() const {
+    return mNumNewLosses > 0;
+}
+
+int64_t RTPSink::Source::collectNACKs(
+        int64_t nowUs, Vector<uint32_t> *extSeqNos) {
+    int64_t retryIntervalUs =
+        (mRTTUs < 0ll) ? kDefaultRTTUs : (3 * mRTTUs) / 2;
+
+    if (retryIntervalUs < kMinNACKRetryIntervalUs) {
+        retryIntervalUs = kMinNACKRetryIntervalUs;
+    }
+
+    int64_t nextCheckUs = -1ll;
+
+    size_t i = 0;
+    while (i < mMissingPackets.size()) {
+        MissingPacket *missing = &mMissingPackets.editValueAt(i);
+
+        // The renderer won't wait for the packet beyond this point,
+        // requesting it any later would just waste bandwidth.
+        int64_t deadlineUs =
+            missing->mDetectedUs + TunnelRenderer::kPlayoutDelayUs;
+
+        if (nowUs >= deadlineUs) {
+            if (missing->mNumNACKs == 0) {
+                --mNumNewLosses;
+            }
+
+            ALOGV("giving up on %u after %d NACKs",
+                  mMissingPackets.keyAt(i), missing->mNumNACKs);
+
+            mMissingPackets.removeItemsAt(i);
+            continue;
+        }
+
+        if (missing->mNumNACKs == 0
+                || nowUs >= missing->mLastNACKUs + retryIntervalUs) {
+            if (missing->mNumNACKs == 0) {
+                --mNumNewLosses;
+            }
+
+            missing->mLastNACKUs = nowUs;
+            ++missing->mNumNACKs;
+
+            extSeqNos->push(mMissingPackets.keyAt(i));
+        }
+
+        int64_t whenUs = missing->mLastNACKUs + retryIntervalUs;
+        if (whenUs > deadlineUs) {
+            whenUs = deadlineUs;
+        }
+
+        if (nextCheckUs < 0ll || whenUs < nextCheckUs) {
+            nextCheckUs = whenUs;
+        }
+
+        ++i;
+    }
+
+    return nextCheckUs;
+}
+
+void RTPSink::Source::updateJitter(const sp<MediaPacket> &buffer) {
+    // Only called for packets in sequence, the timestamps of duplicates
+    // and late arrivals say nothing about the current network conditions.
+
+    // Both clocks run at 90kHz, only differences matter so wrapping
+    // around is fine.
+    uint32_t arrival = (uint32_t)((buffer->mArrivalTimeUs * 9ll) / 100ll);
+    int32_t transit = (int32_t)(arrival - buffer->mRTPTime);
+
+    if (!mHaveTransit) {
+        mHaveTransit = true;
+        mTransit = transit;
+        return;
+    }
+
+    int32_t d = transit - mTransit;
+    mTransit = transit;
+
+    if (d < 0) {
+        d = -d;
+    }
+
+    mJitter += d - ((mJitter + 8) >> 4);
+}
+
+void RTPSink::Source::onSenderReport(
+        uint64_t ntpTime, int64_t arrivalTimeUs) {
+    mLastSR = (ntpTime >> 16) & 0xffffffff;
+    mLastSRArrivalTimeUs = arrivalTimeUs;
+}
+
+void RTPSink::Source::queuePacket(const sp<MediaPacket> &buffer) {
+    mPendingPackets->push_back(buffer);
+
+    updateFrameState(buffer);
+}
+
+void RTPSink::Source::updateFrameState(const sp<MediaPacket> &buffer) {
+    int32_t extSeqNo = buffer->mExtSeqNo;
+    int64_t arrivalTimeUs = buffer->mArrivalTimeUs;
+
+    if (extSeqNo > mLastFrameEndExtSeqNo) {
+        if (mFrameStartUs < 0ll) {
+            mFrameStartUs = arrivalTimeUs;
+        }
+
+        if (buffer->mMarker) {
+            if (mIncompleteFrameEndExtSeqNo >= 0) {
+                // Still missing packets, don't hold up the next one.
+                ++mNumAbandonedFrames;
+            }
+
+            mIncompleteFrameStartUs = mFrameStartUs;
+            mIncompleteFrameEndExtSeqNo = extSeqNo;
+
+            mLastFrameEndExtSeqNo = extSeqNo;
+            mFrameStartUs = -1ll;
+        }
+    }
+
+    if (mIncompleteFrameEndExtSeqNo < 0
+            || (!mMissingPackets.isEmpty()
+                && mMissingPackets.keyAt(0)
+                    <= (uint32_t)mIncompleteFrameEndExtSeqNo)) {
+        return;
+    }
+
+    int64_t latencyUs = arrivalTimeUs - mIncompleteFrameStartUs;
+
+    ++mNumFrames;
+    mTotalFrameLatencyUs += latencyUs;
+    if (latencyUs > mMaxFrameLatencyUs) {
+        mMaxFrameLatencyUs = latencyUs;
+    }
+
+    mIncompleteFrameEndExtSeqNo = -1;
+    mFrameCompleted = true;
+}
+
+bool RTPSink::Source::checkFrameCompleted() {
+    bool completed = mFrameCompleted;
+    mFrameCompleted = false;
+
+    return completed;
+}
+
+void RTPSink::Source::logFrameStats(uint32_t ssrc) {
+    if (mNumFrames == 0) {
+        return;
+    }
+
+    ALOGV("SSRC 0x%08x: %d frames, latency avg %.2f ms, max %.2f ms, "
+          "%d abandoned",
+          ssrc,
+          mNumFrames,
+          mTotalFrameLatencyUs / (mNumFrames * 1E3),
+          mMaxFrameLatencyUs / 1E3,
+          mNumAbandonedFrames);
+
+    mNumFrames = 0;
+    mNumAbandonedFrames = 0;
+    mTotalFrameLatencyUs = 0ll;
+    mMaxFrameLatencyUs = 0ll;
+}
+
+void RTPSink::Source::collectLossStats(
+        uint32_t *numExpected, uint32_t *numLost) {
+    uint32_t expected = (mMaxSeq | mCycles) - mBaseSeq + 1;
+
+    *numExpected = expected - mExpectedPriorLossStats;
+    mExpectedPriorLossStats = expected;
+
+    uint32_t numReceived = mReceived - mReceivedPriorLossStats;
+    mReceivedPriorLossStats = mReceived;
+
+    // Duplicates may make up for losses.
+    *numLost = (*numExpected > numReceived) ? *numExpected - numReceived : 0;
 }
 
 void RTPSink::Source::addReportBlock(
@@ -216,38 +581,58 @@ void RTPSink::Source::addReportBlock(
     ptr[10] = (extMaxSeq >> 8) & 0xff;
     ptr[11] = extMaxSeq & 0xff;
 
-    // XXX TODO:
+    uint32_t jitter = mJitter >> 4;
 
-    ptr[12] = 0x00;  // interarrival jitter
-    ptr[13] = 0x00;
-    ptr[14] = 0x00;
-    ptr[15] = 0x00;
+    ptr[12] = jitter >> 24;  // interarrival jitter
+    ptr[13] = (jitter >> 16) & 0xff;
+    ptr[14] = (jitter >> 8) & 0xff;
+    ptr[15] = jitter & 0xff;
+
+    // In units of 1/65536 seconds, zero if we haven't seen an SR yet.
+    uint32_t delaySinceLastSR = 0;
+    if (mLastSRArrivalTimeUs >= 0ll) {
+        int64_t delayUs = ALooper::GetNowUs() - mLastSRArrivalTimeUs;
+        delaySinceLastSR = (uint32_t)((delayUs * 65536ll) / 1000000ll);
+    }
 
-    ptr[16] = 0x00;  // last SR
-    ptr[17] = 0x00;
-    ptr[18] = 0x00;
-    ptr[19] = 0x00;
+    ptr[16] = mLastSR >> 24;  // last SR
+    ptr[17] = (mLastSR >> 16) & 0xff;
+    ptr[18] = (mLastSR >> 8) & 0xff;
+    ptr[19] = mLastSR & 0xff;
 
-    ptr[20] = 0x00;  // delay since last SR
-    ptr[21] = 0x00;
-    ptr[22] = 0x00;
-    ptr[23] = 0x00;
+    ptr[20] = delaySinceLastSR >> 24;  // delay since last SR
+    ptr[21] = (delaySinceLastSR >> 16) & 0xff;
+    ptr[22] = (delaySinceLastSR >> 8) & 0xff;
+    ptr[23] = delaySinceLastSR & 0xff;
 }
 
 ////////////////////////////////////////////////////////////////////////////////
 
 RTPSink::RTPSink(
         const sp<ANetworkSession> &netSession,
-        const sp<ISurfaceTexture> &surfaceTex)
+        const sp<AMessage> &notify,
+        const sp<ISurfaceTexture> &surfaceTex,
+        bool headless)
     : mNetSession(netSession),
+      mNotify(notify),
       mSurfaceTex(surfaceTex),
+      mHeadless(headless),
       mRTPPort(0),
       mRTPSessionID(0),
       mRTCPSessionID(0),
-      mFirstArrivalTimeUs(-1ll),
       mNumPacketsReceived(0ll),
-      mRegression(1000),
+      mHaveRTPTime(false),
+      mLastRTPTime(0),
+      mExtRTPTime(0ll),
+      mDriftEstimator(
+              kDriftBucketSpan, kDriftHistorySize, kDriftMinOutlierDistance),
       mMaxDelayMs(-1ll),
+      mLastREMBBitrate(-1ll),
+      mFIRSeqNo(0),
+      mFlushPending(false),
+      mNACKCheckGeneration(0),
+      mNACKCheckPending(false),
+      mNextNACKCheckUs(-1ll),
       mIsConnectRemotePort(false) {
 }
 
@@ -306,6 +691,15 @@ int32_t RTPSink::getRTPPort() const {
     return mRTPPort;
 }
 
+void RTPSink::getAVSyncStats(AVSyncMonitor::Stats *stats) const {
+    if (mRenderer == NULL) {
+        stats->mValid = false;
+        return;
+    }
+
+    mRenderer->getAVSyncStats(stats);
+}
+
 void RTPSink::onMessageReceived(const sp<AMessage> &msg) {
     switch (msg->what()) {
         case kWhatRTPNotify:
@@ -361,9 +755,9 @@ void RTPSink::onMessageReceived(const sp<AMessage> &msg) {
 
                     status_t err;
                     if (msg->what() == kWhatRTPNotify) {
-                        err = parseRTP(data);
+                        err = parseRTP(MediaPacket::From(data));
                     } else {
-                        err = parseRTCP(data);
+                        err = parseRTCP(MediaPacket::From(data));
                     }
                     break;
                 }
@@ -380,9 +774,24 @@ void RTPSink::onMessageReceived(const sp<AMessage> &msg) {
             break;
         }
 
-        case kWhatPacketLost:
+        case kWhatSendREMB:
+        {
+            onSendREMB();
+            break;
+        }
+
+        case kWhatCheckNACKs:
         {
-            onPacketLost(msg);
+            int32_t generation;
+            CHECK(msg->findInt32("generation", &generation));
+
+            if (generation != mNACKCheckGeneration) {
+                // Superseded by an earlier check.
+                break;
+            }
+
+            mNACKCheckPending = false;
+            onCheckNACKs();
             break;
         }
 
@@ -391,33 +800,48 @@ void RTPSink::onMessageReceived(const sp<AMessage> &msg) {
             int32_t isRTP;
             CHECK(msg->findInt32("isRTP", &isRTP));
 
+            // Posted by injectPacket(), so a MediaPacket.
             sp<ABuffer> buffer;
-            CHECK(msg->findBuffer("buffer", &buffer));
+            CHECK(msg->findBuffer("packet", &buffer));
+
+            sp<MediaPacket> packet = MediaPacket::From(buffer);
 
             status_t err;
             if (isRTP) {
-                err = parseRTP(buffer);
+                err = parseRTP(packet);
             } else {
-                err = parseRTCP(buffer);
+                err = parseRTCP(packet);
             }
             break;
         }
 
+        case kWhatFlushPackets:
+        {
+            onFlushPackets();
+            break;
+        }
+
+        case kWhatRendererNotify:
+        {
+            onRendererNotify(msg);
+            break;
+        }
+
         default:
             TRESPASS();
     }
 }
 
-status_t RTPSink::injectPacket(bool isRTP, const sp<ABuffer> &buffer) {
+status_t RTPSink::injectPacket(bool isRTP, const sp<MediaPacket> &packet) {
     sp<AMessage> msg = new AMessage(kWhatInject, id());
     msg->setInt32("isRTP", isRTP);
-    msg->setBuffer("buffer", buffer);
+    msg->setBuffer("packet", packet);
     msg->post();
 
     return OK;
 }
 
-status_t RTPSink::parseRTP(const sp<ABuffer> &buffer) {
+status_t RTPSink::parseRTP(const sp<MediaPacket> &buffer) {
     size_t size = buffer->size();
     if (size < 12) {
         // Too short to be a valid RTP header.
@@ -480,30 +904,41 @@ status_t RTPSink::parseRTP(const sp<ABuffer> &buffer) {
     uint32_t rtpTime = U32_AT(&data[4]);
     uint16_t seqNo = U16_AT(&data[2]);
 
-    int64_t arrivalTimeUs;
-    CHECK(buffer->meta()->findInt64("arrivalTimeUs", &arrivalTimeUs));
+    int64_t arrivalTimeUs = buffer->mArrivalTimeUs;
 
-    if (mFirstArrivalTimeUs < 0ll) {
-        mFirstArrivalTimeUs = arrivalTimeUs;
+    if (!mHaveRTPTime) {
+        mHaveRTPTime = true;
+        mExtRTPTime = rtpTime;
+    } else {
+        mExtRTPTime += (int32_t)(rtpTime - mLastRTPTime);
     }
-    arrivalTimeUs -= mFirstArrivalTimeUs;
+    mLastRTPTime = rtpTime;
 
     int64_t arrivalTimeMedia = (arrivalTimeUs * 9ll) / 100ll;
 
     ALOGV("seqNo: %d, SSRC 0x%08x, diff %lld",
-            seqNo, srcId, rtpTime - arrivalTimeMedia);
+            seqNo, srcId, mExtRTPTime - arrivalTimeMedia);
+
+    mDriftEstimator.addSample(mExtRTPTime, arrivalTimeMedia);
 
-    mRegression.addPoint((float)rtpTime, (float)arrivalTimeMedia);
+    mBandwidthEstimator.onPacketReceived(
+            (mExtRTPTime * 100ll) / 9ll, arrivalTimeUs, size);
+
+    if (mLastREMBBitrate >= 0ll
+            && mBandwidthEstimator.estimatedBitrate()
+                    < mLastREMBBitrate * 97 / 100) {
+        // Don't keep the source waiting for bad news.
+        sendREMB();
+    }
 
     ++mNumPacketsReceived;
 
-    float n1, n2, b;
-    if (mRegression.approxLine(&n1, &n2, &b)) {
-        ALOGV("Line %lld: %.2f %.2f %.2f, slope %.2f",
-              mNumPacketsReceived, n1, n2, b, -n1 / n2);
+    if (mDriftEstimator.hasEstimate()) {
+        double expectedArrivalTimeMedia =
+            mDriftEstimator.expectedArrivalTime(mExtRTPTime);
 
-        float expectedArrivalTimeMedia = (b - n1 * (float)rtpTime) / n2;
-        float latenessMs = (arrivalTimeMedia - expectedArrivalTimeMedia) / 90.0;
+        double latenessMs =
+            (arrivalTimeMedia - expectedArrivalTimeMedia) / 90.0;
 
         if (mMaxDelayMs < 0ll || latenessMs > mMaxDelayMs) {
             mMaxDelayMs = latenessMs;
@@ -511,40 +946,121 @@ status_t RTPSink::parseRTP(const sp<ABuffer> &buffer) {
         }
     }
 
-    sp<AMessage> meta = buffer->meta();
-    meta->setInt32("ssrc", srcId);
-    meta->setInt32("rtp-time", rtpTime);
-    meta->setInt32("PT", data[1] & 0x7f);
-    meta->setInt32("M", data[1] >> 7);
+    buffer->mSeqNo = seqNo;
+    buffer->mSSRC = srcId;
+    buffer->mRTPTime = rtpTime;
+    buffer->mPayloadType = data[1] & 0x7f;
+    buffer->mMarker = (data[1] & 0x80) != 0;
+    buffer->mPayloadOffset = buffer->offset() + payloadOffset;
 
-    buffer->setRange(payloadOffset, size - payloadOffset);
+    buffer->setRange(buffer->mPayloadOffset, size - payloadOffset);
 
     ssize_t index = mSources.indexOfKey(srcId);
     if (index < 0) {
         if (mRenderer == NULL) {
-            sp<AMessage> notifyLost = new AMessage(kWhatPacketLost, id());
-            notifyLost->setInt32("ssrc", srcId);
+            sp<AMessage> notify = new AMessage(kWhatRendererNotify, id());
 
-            mRenderer = new TunnelRenderer(notifyLost, mSurfaceTex);
+            mRenderer = new TunnelRenderer(notify, mSurfaceTex, mHeadless);
             looper()->registerHandler(mRenderer);
         }
 
-        sp<AMessage> queueBufferMsg =
-            new AMessage(TunnelRenderer::kWhatQueueBuffer, mRenderer->id());
-
-        sp<Source> source = new Source(seqNo, buffer, queueBufferMsg);
+        sp<Source> source = new Source(seqNo, buffer, &mPendingPackets);
         mSources.add(srcId, source);
     } else {
-        mSources.valueAt(index)->updateSeq(seqNo, buffer);
+        const sp<Source> &source = mSources.valueAt(index);
+
+        source->updateSeq(seqNo, buffer);
+
+        if (source->hasNewLosses()) {
+            // Ask for the missing packets as soon as the datagrams that
+            // have already arrived have been processed.
+            scheduleNACKCheck(ALooper::GetNowUs());
+        }
+
+        if (source->checkFrameCompleted()) {
+            // Hand the access unit to the renderer right away instead of
+            // together with the start of the next one.
+            onFlushPackets();
+        }
+    }
+
+    if (!mPendingPackets.empty()) {
+        schedulePacketFlush();
     }
 
     return OK;
 }
 
-status_t RTPSink::parseRTCP(const sp<ABuffer> &buffer) {
+void RTPSink::schedulePacketFlush() {
+    if (mFlushPending) {
+        return;
+    }
+
+    // Any datagrams that were already read off the socket are queued ahead
+    // of this message, so they all end up in the same batch.
+    (new AMessage(kWhatFlushPackets, id()))->post();
+    mFlushPending = true;
+}
+
+void RTPSink::onFlushPackets() {
+    mFlushPending = false;
+
+    if (mPendingPackets.empty()) {
+        return;
+    }
+
+    sp<TunnelRenderer::PacketBatch> batch = new TunnelRenderer::PacketBatch;
+    for (List<sp<MediaPacket> >::iterator it = mPendingPackets.begin();
+            it != mPendingPackets.end(); ++it) {
+        batch->mPackets.push_back(*it);
+    }
+    mPendingPackets.clear();
+
+    sp<AMessage> msg =
+        new AMessage(TunnelRenderer::kWhatQueueBuffers, mRenderer->id());
+    msg->setObject("packets", batch);
+    msg->post();
+}
+
+void RTPSink::onRendererNotify(const sp<AMessage> &msg) {
+    int32_t what;
+    CHECK(msg->findInt32("what", &what));
+
+    switch (what) {
+        case TunnelRenderer::kWhatRequestIDR:
+        {
+            int32_t flushed;
+            CHECK(msg->findInt32("flushed", &flushed));
+
+            // The RTCP request takes the media path and usually gets there
+            // first, the RTSP one below is for sources that ignore it.
+            // Sources deduplicate IDR frame requests.
+            if (flushed) {
+                sendFIR();
+            } else {
+                sendPLI();
+            }
+
+            sp<AMessage> notify = mNotify->dup();
+            notify->setInt32("what", kWhatRequestIDR);
+            notify->post();
+            break;
+        }
+
+        default:
+            TRESPASS();
+    }
+}
+
+status_t RTPSink::parseRTCP(const sp<MediaPacket> &buffer) {
     const uint8_t *data = buffer->data();
     size_t size = buffer->size();
 
+    int64_t arrivalTimeUs = buffer->mArrivalTimeUs;
+    if (arrivalTimeUs < 0ll) {
+        arrivalTimeUs = ALooper::GetNowUs();
+    }
+
     while (size > 0) {
         if (size < 8) {
             // Too short to be a valid RTCP header
@@ -580,7 +1096,7 @@ status_t RTPSink::parseRTCP(const sp<ABuffer> &buffer) {
         switch (data[1]) {
             case 200:
             {
-                parseSR(data, headerLength);
+                parseSR(data, headerLength, arrivalTimeUs);
                 break;
             }
 
@@ -628,7 +1144,8 @@ status_t RTPSink::parseBYE(const uint8_t *data, size_t size) {
     return OK;
 }
 
-status_t RTPSink::parseSR(const uint8_t *data, size_t size) {
+status_t RTPSink::parseSR(
+        const uint8_t *data, size_t size, int64_t arrivalTimeUs) {
     size_t RC = data[0] & 0x1f;
 
     if (size < (7 + RC * 6) * 4) {
@@ -643,6 +1160,11 @@ status_t RTPSink::parseSR(const uint8_t *data, size_t size) {
     ALOGV("SR: ssrc 0x%08x, ntpTime 0x%016llx, rtpTime 0x%08x",
           id, ntpTime, rtpTime);
 
+    ssize_t index = mSources.indexOfKey(id);
+    if (index >= 0) {
+        mSources.valueAt(index)->onSenderReport(ntpTime, arrivalTimeUs);
+    }
+
     return OK;
 }
 
@@ -681,6 +1203,7 @@ status_t RTPSink::connect(
 #endif
 
     scheduleSendRR();
+    scheduleSendREMB();
 
     return OK;
 }
@@ -689,6 +1212,91 @@ void RTPSink::scheduleSendRR() {
     (new AMessage(kWhatSendRR, id()))->post(2000000ll);
 }
 
+void RTPSink::scheduleSendREMB() {
+    (new AMessage(kWhatSendREMB, id()))->post(kSendREMBIntervalUs);
+}
+
+void RTPSink::onSendREMB() {
+    int64_t nowUs = ALooper::GetNowUs();
+
+    for (size_t i = 0; i < mSources.size(); ++i) {
+        uint32_t numExpected, numLost;
+        mSources.valueAt(i)->collectLossStats(&numExpected, &numLost);
+
+        mBandwidthEstimator.onLossReport(numExpected, numLost, nowUs);
+    }
+
+    sendREMB();
+
+    scheduleSendREMB();
+}
+
+void RTPSink::sendREMB() {
+    if (mRTCPSessionID == 0
+            || mSources.isEmpty()
+            || !mBandwidthEstimator.hasEstimate()) {
+        return;
+    }
+
+    size_t numSSRCs = mSources.size();
+    if (numSSRCs > 255) {
+        numSSRCs = 255;
+    }
+
+    sp<ABuffer> buf = new ABuffer(20 + 4 * numSSRCs);
+
+    uint8_t *ptr = buf->data();
+    ptr[0] = 0x80 | 15;  // application layer feedback
+    ptr[1] = 206;  // PSFB
+
+    size_t numWords = (buf->size() / 4) - 1;
+    ptr[2] = numWords >> 8;
+    ptr[3] = numWords & 0xff;
+
+    ptr[4] = 0xde;  // sender SSRC
+    ptr[5] = 0xad;
+    ptr[6] = 0xbe;
+    ptr[7] = 0xef;
+
+    // The media source SSRC is unused, the SSRCs the estimate applies to
+    // follow below (draft-alvestrand-rmcat-remb).
+    ptr[8] = ptr[9] = ptr[10] = ptr[11] = 0;
+
+    ptr[12] = 'R';
+    ptr[13] = 'E';
+    ptr[14] = 'M';
+    ptr[15] = 'B';
+
+    int64_t bitrate = mBandwidthEstimator.estimatedBitrate();
+
+    uint32_t exponent = 0;
+    uint64_t mantissa = bitrate;
+    while (mantissa > 0x3ffff) {
+        mantissa >>= 1;
+        ++exponent;
+    }
+
+    ptr[16] = numSSRCs;
+    ptr[17] = (exponent << 2) | (mantissa >> 16);
+    ptr[18] = (mantissa >> 8) & 0xff;
+    ptr[19] = mantissa & 0xff;
+
+    for (size_t i = 0; i < numSSRCs; ++i) {
+        uint32_t ssrc = mSources.keyAt(i);
+
+        ptr[20 + 4 * i] = ssrc >> 24;
+        ptr[21 + 4 * i] = (ssrc >> 16) & 0xff;
+        ptr[22 + 4 * i] = (ssrc >> 8) & 0xff;
+        ptr[23 + 4 * i] = ssrc & 0xff;
+    }
+
+    ALOGV("sending REMB, %lld bps", bitrate);
+
+    mNetSession->sendRequest(mRTCPSessionID, buf->data(), buf->size());
+
+    mLastREMBBitrate = bitrate;
+}
+
 void RTPSink::addSDES(const sp<ABuffer> &buffer) {
     uint8_t *data = buffer->data() + buffer->size();
     data[0] = 0x80 | 1;
@@ -765,6 +1373,8 @@ void RTPSink::onSendRR() {
 
         source->addReportBlock(ssrc, buf);
         ++numReportBlocks;
+
+        source->logFrameStats(ssrc);
     }
 
     ptr[0] |= numReportBlocks;  // 5 bit
@@ -779,43 +1389,188 @@ void RTPSink::onSendRR() {
 
     mNetSession->sendRequest(mRTCPSessionID, buf->data(), buf->size());
 
+    if (mDriftEstimator.hasEstimate()) {
+        ALOGV("clock skew %.2f ppm, transit offset %.2f ms after %lld packets",
+              mDriftEstimator.skewPPM(),
+              mDriftEstimator.offset() / 90.0,
+              mNumPacketsReceived);
+    }
+
     scheduleSendRR();
 }
 
-void RTPSink::onPacketLost(const sp<AMessage> &msg) {
-    uint32_t srcId;
-    CHECK(msg->findInt32("ssrc", (int32_t *)&srcId));
+void RTPSink::scheduleNACKCheck(int64_t whenUs) {
+    if (mNACKCheckPending && mNextNACKCheckUs <= whenUs) {
+        return;
+    }
 
-    int32_t seqNo;
-    CHECK(msg->findInt32("seqNo", &seqNo));
+    int64_t delayUs = whenUs - ALooper::GetNowUs();
+    if (delayUs < 0ll) {
+        delayUs = 0ll;
+    }
 
-    int32_t blp = 0;
+    sp<AMessage> msg = new AMessage(kWhatCheckNACKs, id());
+    msg->setInt32("generation", ++mNACKCheckGeneration);
+    msg->post(delayUs);
 
-    sp<ABuffer> buf = new ABuffer(1500);
-    buf->setRange(0, 0);
+    mNACKCheckPending = true;
+    mNextNACKCheckUs = whenUs;
+}
+
+void RTPSink::onCheckNACKs() {
+    int64_t nowUs = ALooper::GetNowUs();
+    int64_t nextCheckUs = -1ll;
+
+    for (size_t i = 0; i < mSources.size(); ++i) {
+        Vector<uint32_t> extSeqNos;
+        int64_t whenUs =
+            mSources.valueAt(i)->collectNACKs(nowUs, &extSeqNos);
+
+        if (!extSeqNos.isEmpty()) {
+            sendNACK(mSources.keyAt(i), extSeqNos);
+        }
+
+        if (whenUs >= 0ll && (nextCheckUs < 0ll || whenUs < nextCheckUs)) {
+            nextCheckUs = whenUs;
+        }
+    }
+
+    if (nextCheckUs >= 0ll) {
+        scheduleNACKCheck(nextCheckUs);
+    }
+}
+
+void RTPSink::sendPLI() {
+    if (mRTCPSessionID == 0) {
+        return;
+    }
+
+    for (size_t i = 0; i < mSources.size(); ++i) {
+        uint32_t srcId = mSources.keyAt(i);
+
+        sp<ABuffer> buf = new ABuffer(12);
+
+        uint8_t *ptr = buf->data();
+        ptr[0] = 0x80 | 1;  // picture loss indication
+        ptr[1] = 206;  // PSFB
+        ptr[2] = 0;
+        ptr[3] = 2;
+        ptr[4] = 0xde;  // sender SSRC
+        ptr[5] = 0xad;
+        ptr[6] = 0xbe;
+        ptr[7] = 0xef;
+        ptr[8] = (srcId >> 24) & 0xff;
+        ptr[9] = (srcId >> 16) & 0xff;
+        ptr[10] = (srcId >> 8) & 0xff;
+        ptr[11] = (srcId & 0xff);
+
+        ALOGV("sending PLI for source 0x%08x", srcId);
+
+        mNetSession->sendRequest(mRTCPSessionID, buf->data(), buf->size());
+    }
+}
+
+void RTPSink::sendFIR() {
+    if (mRTCPSessionID == 0 || mSources.isEmpty()) {
+        return;
+    }
+
+    size_t numSources = mSources.size();
+
+    sp<ABuffer> buf = new ABuffer(12 + 8 * numSources);
 
     uint8_t *ptr = buf->data();
-    ptr[0] = 0x80 | 1;  // generic NACK
-    ptr[1] = 205;  // RTPFB
-    ptr[2] = 0;
-    ptr[3] = 3;
+    ptr[0] = 0x80 | 4;  // full intra request
+    ptr[1] = 206;  // PSFB
+
+    size_t numWords = (buf->size() / 4) - 1;
+    ptr[2] = numWords >> 8;
+    ptr[3] = numWords & 0xff;
+
     ptr[4] = 0xde;  // sender SSRC
     ptr[5] = 0xad;
     ptr[6] = 0xbe;
     ptr[7] = 0xef;
-    ptr[8] = (srcId >> 24) & 0xff;
-    ptr[9] = (srcId >> 16) & 0xff;
-    ptr[10] = (srcId >> 8) & 0xff;
-    ptr[11] = (srcId & 0xff);
-    ptr[12] = (seqNo >> 8) & 0xff;
-    ptr[13] = (seqNo & 0xff);
-    ptr[14] = (blp >> 8) & 0xff;
-    ptr[15] = (blp & 0xff);
 
-    buf->setRange(0, 16);
+    // The media source SSRC is unused, the FCI entries name the targets
+    // (RFC 5104 4.3.1).
+    ptr[8] = ptr[9] = ptr[10] = ptr[11] = 0;
+
+    // Retransmissions of a request would reuse the sequence number, this
+    // is always a new one.
+    ++mFIRSeqNo;
+
+    for (size_t i = 0; i < numSources; ++i) {
+        uint32_t srcId = mSources.keyAt(i);
+
+        uint8_t *fci = &ptr[12 + 8 * i];
+        fci[0] = (srcId >> 24) & 0xff;
+        fci[1] = (srcId >> 16) & 0xff;
+        fci[2] = (srcId >> 8) & 0xff;
+        fci[3] = (srcId & 0xff);
+        fci[4] = mFIRSeqNo;
+        fci[5] = fci[6] = fci[7] = 0;
+    }
+
+    ALOGV("sending FIR #%u", mFIRSeqNo);
 
     mNetSession->sendRequest(mRTCPSessionID, buf->data(), buf->size());
 }
 
+void RTPSink::sendNACK(uint32_t srcId, const Vector<uint32_t> &extSeqNos) {
+    if (mRTCPSessionID == 0) {
+        return;
+    }
+
+    size_t i = 0;
+    while (i < extSeqNos.size()) {
+        sp<ABuffer> buf = new ABuffer(1500);
+
+        uint8_t *ptr = buf->data();
+        ptr[0] = 0x80 | 1;  // generic NACK
+        ptr[1] = 205;  // RTPFB
+        ptr[4] = 0xde;  // sender SSRC
+        ptr[5] = 0xad;
+        ptr[6] = 0xbe;
+        ptr[7] = 0xef;
+        ptr[8] = (srcId >> 24) & 0xff;
+        ptr[9] = (srcId >> 16) & 0xff;
+        ptr[10] = (srcId >> 8) & 0xff;
+        ptr[11] = (srcId & 0xff);
+
+        size_t offset = 12;
+
+        // Each FCI covers the packet ID and a bitmask of the 16 following
+        // ones (RFC 4585 6.2.1).
+        while (i < extSeqNos.size() && offset + 4 <= buf->capacity()) {
+            uint32_t pid = extSeqNos[i++];
+
+            uint16_t blp = 0;
+            while (i < extSeqNos.size() && extSeqNos[i] - pid <= 16) {
+                blp |= 1 << (extSeqNos[i] - pid - 1);
+                ++i;
+            }
+
+            ptr[offset] = (pid >> 8) & 0xff;
+            ptr[offset + 1] = pid & 0xff;
+            ptr[offset + 2] = (blp >> 8) & 0xff;
+            ptr[offset + 3] = blp & 0xff;
+
+            offset += 4;
+        }
+
+        size_t numWords = (offset / 4) - 1;
+        ptr[2] = numWords >> 8;
+        ptr[3] = numWords & 0xff;
+
+        buf->setRange(0, offset);
+
+        ALOGV("sending NACK for %d packets starting at %u",
+              extSeqNos.size(), extSeqNos[0]);
+
+        mNetSession->sendRequest(mRTCPSessionID, buf->data(), buf->size());
+    }
+}
+
 }  // namespace android
 
@@ -19,8 +19,11 @@
 #define RTP_SINK_H_
 
 #include <media/stagefright/foundation/AHandler.h>
+#include <utils/Vector.h>
 
-#include "LinearRegression.h"
+#include "AVSyncMonitor.h"
+#include "BandwidthEstimator.h"
+#include "DriftEstimator.h"
 
 #include <gui/Surface.h>
 
@@ -28,14 +31,18 @@ namespace android {
 
 struct ABuffer;
 struct ANetworkSession;
+struct MediaPacket;
 struct TunnelRenderer;
 
 // Creates a pair of sockets for RTP/RTCP traffic, instantiates a renderer
 // for incoming transport stream data and occasionally sends statistics over
 // the RTCP channel.
 struct RTPSink : public AHandler {
+    // See TunnelRenderer for "headless".
     RTPSink(const sp<ANetworkSession> &netSession,
-            const sp<ISurfaceTexture> &surfaceTex);
+            const sp<AMessage> &notify,
+            const sp<ISurfaceTexture> &surfaceTex,
+            bool headless = false);
 
     // If TCP interleaving is used, no UDP sockets are created, instead
     // incoming RTP/RTCP packets (arriving on the RTSP control connection)
@@ -47,7 +54,19 @@ struct RTPSink : public AHandler {
 
     int32_t getRTPPort() const;
 
-    status_t injectPacket(bool isRTP, const sp<ABuffer> &buffer);
+    // Hands the sink a packet it didn't receive itself, e.g. the data of
+    // a kWhatBinaryData notification.
+    status_t injectPacket(bool isRTP, const sp<MediaPacket> &packet);
+
+    // A/V sync of the stream handed to the renderer so far, not valid
+    // before there is one.
+    void getAVSyncStats(AVSyncMonitor::Stats *stats) const;
+
+    // Values of the "what" field of notifications posted through "notify".
+    enum {
+        // The renderer discarded data, the source should send an IDR frame.
+        kWhatRequestIDR,
+    };
 
 protected:
     virtual void onMessageReceived(const sp<AMessage> &msg);
@@ -58,39 +77,84 @@ private:
         kWhatRTPNotify,
         kWhatRTCPNotify,
         kWhatSendRR,
-        kWhatPacketLost,
+        kWhatSendREMB,
+        kWhatCheckNACKs,
         kWhatInject,
+        kWhatFlushPackets,
+        kWhatRendererNotify,
     };
 
     struct Source;
     struct StreamSource;
 
+    // The drift estimator keeps the fastest packet of every 100ms of RTP
+    // time for the last 30 secs.
+    static const int64_t kDriftBucketSpan = 9000ll;
+    static const size_t kDriftHistorySize = 300;
+    static const int64_t kDriftMinOutlierDistance = 450ll;  // 5ms
+
+    static const int64_t kSendREMBIntervalUs = 1000000ll;
+
     sp<ANetworkSession> mNetSession;
+    sp<AMessage> mNotify;
     sp<ISurfaceTexture> mSurfaceTex;
+    bool mHeadless;
     KeyedVector<uint32_t, sp<Source> > mSources;
 
     int32_t mRTPPort;
     int32_t mRTPSessionID;
     int32_t mRTCPSessionID;
 
-    int64_t mFirstArrivalTimeUs;
     int64_t mNumPacketsReceived;
-    LinearRegression mRegression;
+
+    // The sender's RTP time extended to 64 bits, in 90kHz units.
+    bool mHaveRTPTime;
+    uint32_t mLastRTPTime;
+    int64_t mExtRTPTime;
+
+    DriftEstimator mDriftEstimator;
     int64_t mMaxDelayMs;
 
+    BandwidthEstimator mBandwidthEstimator;
+    int64_t mLastREMBBitrate;
+
+    // Command sequence number of the last full intra request sent.
+    uint8_t mFIRSeqNo;
+
     sp<TunnelRenderer> mRenderer;
 
+    // Packets accepted since the last flush, handed to the renderer in a
+    // single message once all datagrams of the current network wakeup have
+    // been parsed.
+    List<sp<MediaPacket> > mPendingPackets;
+    bool mFlushPending;
+
+    int32_t mNACKCheckGeneration;
+    bool mNACKCheckPending;
+    int64_t mNextNACKCheckUs;
+
     bool mIsConnectRemotePort;
 
-    status_t parseRTP(const sp<ABuffer> &buffer);
-    status_t parseRTCP(const sp<ABuffer> &buffer);
+    status_t parseRTP(const sp<MediaPacket> &buffer);
+    status_t parseRTCP(const sp<MediaPacket> &buffer);
     status_t parseBYE(const uint8_t *data, size_t size);
-    status_t parseSR(const uint8_t *data, size_t size);
+    status_t parseSR(
+            const uint8_t *data, size_t size, int64_t arrivalTimeUs);
 
     void addSDES(const sp<ABuffer> &buffer);
     void onSendRR();
-    void onPacketLost(const sp<AMessage> &msg);
+    void scheduleNACKCheck(int64_t whenUs);
+    void onCheckNACKs();
+    void sendNACK(uint32_t srcId, const Vector<uint32_t> &extSeqNos);
+    void schedulePacketFlush();
+    void onFlushPackets();
+    void onRendererNotify(const sp<AMessage> &msg);
     void scheduleSendRR();
+    void scheduleSendREMB();
+    void onSendREMB();
+    void sendREMB();
+    void sendPLI();
+    void sendFIR();
 
     DISALLOW_EVIL_CONSTRUCTORS(RTPSink);
 };
@@ -0,0 +1,232 @@
+/*
+ * Copyright 2012, The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+
+//#define LOG_NDEBUG 0
+#define LOG_TAG "TSValidator"
+#include <utils/Log.h>
+
+#include "TSValidator.h"
+
+namespace android {
+
+static const unsigned kNullPID = 0x1fff;
+
+static bool IsVideoStreamID(uint8_t streamID) {
+    return (streamID & 0xf0) == 0xe0;
+}
+
+static bool IsAudioStreamID(uint8_t streamID) {
+    return (streamID & 0xe0) == 0xc0 || streamID == 0xbd;
+}
+
+static const char *DescribeStreamID(uint8_t streamID) {
+    if (IsVideoStreamID(streamID)) {
+        return "video";
+    } else if (IsAudioStreamID(streamID)) {
+        return "audio";
+    } else if (streamID == 0) {
+        return "PSI";
+    }
+
+    return "other";
+}
+
+TSValidator::TSValidator() {
+    reset();
+}
+
+void TSValidator::reset() {
+    mPIDs.clear();
+    mLastPID = kNullPID;
+    mLastPIDIndex = -1;
+    mNumPackets = 0ll;
+    mNumSyncErrors = 0;
+}
+
+TSValidator::PIDInfo *TSValidator::getPIDInfo(unsigned PID) {
+    if (PID != mLastPID || mLastPIDIndex < 0) {
+        mLastPIDIndex = mPIDs.indexOfKey(PID);
+
+        if (mLastPIDIndex < 0) {
+            PIDInfo info;
+            info.mLastCC = -1;
+            info.mStreamID = 0;
+            info.mNumPackets = 0ll;
+            info.mNumCCErrors = 0;
+            info.mNumDuplicates = 0;
+            info.mNumUnitStarts = 0;
+            info.mNumCorruptUnits = 0;
+            info.mInUnit = false;
+            info.mUnitCorrupt = false;
+            info.mUnitBytes = 0;
+            info.mUnitExpectedBytes = 0;
+
+            mLastPIDIndex = mPIDs.add(PID, info);
+        }
+
+        mLastPID = PID;
+    }
+
+    return &mPIDs.editValueAt(mLastPIDIndex);
+}
+
+uint32_t TSValidator::validate(const uint8_t *data, size_t size) {
+    uint32_t flags = 0;
+
+    for (; size >= 188; data += 188, size -= 188) {
+        ++mNumPackets;
+
+        if (data[0] != 0x47) {
+            ++mNumSyncErrors;
+            continue;
+        }
+
+        unsigned PID = ((data[1] & 0x1f) << 8) | data[2];
+        if (PID == kNullPID) {
+            continue;
+        }
+
+        bool payload_unit_start_indicator = data[1] & 0x40;
+        unsigned adaptation_field_control = (data[3] >> 4) & 3;
+        unsigned continuity_counter = data[3] & 0x0f;
+
+        size_t offset = 4;
+        bool discontinuity_indicator = false;
+        if (adaptation_field_control & 2) {
+            unsigned adaptation_field_length = data[4];
+            if (adaptation_field_length > 0) {
+                discontinuity_indicator = data[5] & 0x80;
+            }
+            offset += 1 + adaptation_field_length;
+        }
+
+        PIDInfo *info = getPIDInfo(PID);
+        ++info->mNumPackets;
+
+        bool hasPayload = (adaptation_field_control & 1) && offset < 188;
+
+        // The counter only advances on packets carrying payload, a single
+        // duplicate of the previous packet is legal (ISO 13818-1 2.4.3.3).
+        if (info->mLastCC >= 0 && !discontinuity_indicator) {
+            unsigned expectedCC = hasPayload
+                ? ((info->mLastCC + 1) & 0x0f) : info->mLastCC;
+
+            if (continuity_counter != expectedCC) {
+                if (hasPayload && continuity_counter == (unsigned)info->mLastCC) {
+                    ++info->mNumDuplicates;
+                    continue;
+                }
+
+                ++info->mNumCCErrors;
+
+                ALOGV("PID 0x%04x: continuity_counter %u, expected %u",
+                      PID, continuity_counter, expectedCC);
+
+                if (info->mInUnit) {
+                    info->mUnitCorrupt = true;
+                }
+
+                if (IsVideoStreamID(info->mStreamID)) {
+                    flags |= kFlagVideoLoss;
+                } else if (IsAudioStreamID(info->mStreamID)) {
+                    flags |= kFlagAudioLoss;
+                }
+            }
+        }
+
+        info->mLastCC = continuity_counter;
+
+        if (!hasPayload) {
+            continue;
+        }
+
+        if (payload_unit_start_indicator) {
+            if (info->mInUnit) {
+                completeUnit(PID, info);
+            }
+
+            ++info->mNumUnitStarts;
+
+            info->mInUnit = true;
+            info->mUnitCorrupt = false;
+            info->mUnitBytes = 0;
+            info->mUnitExpectedBytes = 0;
+
+            const uint8_t *pes = &data[offset];
+            if (offset + 6 <= 188
+                    && pes[0] == 0x00 && pes[1] == 0x00 && pes[2] == 0x01) {
+                info->mStreamID = pes[3];
+
+                unsigned PES_packet_length = (pes[4] << 8) | pes[5];
+                if (PES_packet_length > 0) {
+                    info->mUnitExpectedBytes = 6 + PES_packet_length;
+                }
+            } else {
+                info->mStreamID = 0;
+            }
+        } else if (!info->mInUnit) {
+            // Joined in the middle of a unit, or lost its start.
+            continue;
+        }
+
+        info->mUnitBytes += 188 - offset;
+    }
+
+    return flags;
+}
+
+void TSValidator::completeUnit(unsigned PID, PIDInfo *info) {
+    if (info->mUnitExpectedBytes > 0
+            && info->mUnitBytes != info->mUnitExpectedBytes) {
+        info->mUnitCorrupt = true;
+    }
+
+    if (!info->mUnitCorrupt) {
+        return;
+    }
+
+    ++info->mNumCorruptUnits;
+
+    ALOGW("corrupt %s access unit on PID 0x%04x (%d bytes, expected %d), "
+          "%d so far",
+          DescribeStreamID(info->mStreamID),
+          PID,
+          info->mUnitBytes,
+          info->mUnitExpectedBytes,
+          info->mNumCorruptUnits);
+}
+
+void TSValidator::logStats() const {
+    ALOGI("%lld TS packets, %d sync errors",
+          mNumPackets, mNumSyncErrors);
+
+    for (size_t i = 0; i < mPIDs.size(); ++i) {
+        const PIDInfo &info = mPIDs.valueAt(i);
+
+        ALOGI("PID 0x%04x (%s): %lld packets, %d CC errors, %d duplicates, "
+              "%d units started, %d corrupt",
+              mPIDs.keyAt(i),
+              DescribeStreamID(info.mStreamID),
+              info.mNumPackets,
+              info.mNumCCErrors,
+              info.mNumDuplicates,
+              info.mNumUnitStarts,
+              info.mNumCorruptUnits);
+    }
+}
+
+}  // namespace android
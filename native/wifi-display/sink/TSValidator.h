@@ -0,0 +1,86 @@
+/*
+ * Copyright 2012, The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+
+#ifndef TS_VALIDATOR_H_
+
+#define TS_VALIDATOR_H_
+
+#include <sys/types.h>
+#include <stdint.h>
+#include <media/stagefright/foundation/ABase.h>
+#include <utils/KeyedVector.h>
+
+namespace android {
+
+// Checks the transport stream handed to the player packet by packet: sync
+// bytes, the continuity_counter of every PID and, for PES packets of known
+// length, that the payload adds up. A PES packet (i.e. an access unit, the
+// source never splits them) that lost data on the way is counted as
+// corrupt against its PID, no matter whether the loss happened before RTP
+// or was given up on by the renderer.
+struct TSValidator {
+    TSValidator();
+
+    void reset();
+
+    enum {
+        // Data preceding this chunk on a video or audio PID went missing.
+        kFlagVideoLoss = 1,
+        kFlagAudioLoss = 2,
+    };
+
+    // "size" must be a multiple of 188. Returns a combination of the flags
+    // above.
+    uint32_t validate(const uint8_t *data, size_t size);
+
+    void logStats() const;
+
+private:
+    struct PIDInfo {
+        int32_t mLastCC;
+        uint8_t mStreamID;  // of the last PES packet, 0 for PSI
+        uint64_t mNumPackets;
+        uint32_t mNumCCErrors;
+        uint32_t mNumDuplicates;
+        uint32_t mNumUnitStarts;
+        uint32_t mNumCorruptUnits;
+
+        // The PES packet or section in progress.
+        bool mInUnit;
+        bool mUnitCorrupt;
+        size_t mUnitBytes;
+        size_t mUnitExpectedBytes;  // 0 if unbounded
+    };
+
+    KeyedVector<unsigned, PIDInfo> mPIDs;
+
+    // Lookups are cheap for runs of packets on the same PID.
+    unsigned mLastPID;
+    ssize_t mLastPIDIndex;
+
+    uint64_t mNumPackets;
+    uint32_t mNumSyncErrors;
+
+    PIDInfo *getPIDInfo(unsigned PID);
+    void completeUnit(unsigned PID, PIDInfo *info);
+
+    DISALLOW_EVIL_CONSTRUCTORS(TSValidator);
+};
+
+}  // namespace android
+
+#endif  // TS_VALIDATOR_H_
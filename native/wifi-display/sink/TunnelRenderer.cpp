@@ -21,6 +21,9 @@
 #include "TunnelRenderer.h"
 
 #include "ATSParser.h"
+#include "ClockRecovery.h"
+#include "HeadlessRenderer.h"
+#include "TSValidator.h"
 
 #include <binder/IMemory.h>
 #include <binder/IServiceManager.h>
@@ -32,8 +35,90 @@
 #include <media/stagefright/foundation/AMessage.h>
 #include <ui/DisplayInfo.h>
 
+#include <cutils/properties.h>
+
 namespace android {
 
+static const int64_t kDefaultMaxBytesQueued = 4 * 1024 * 1024;
+static const int64_t kDefaultMaxQueueDurationMs = 2000ll;
+
+static const int64_t kLogTSStatsIntervalUs = 10000000ll;
+static const int64_t kLogAVSyncStatsIntervalUs = 10000000ll;
+
+static int64_t getQueueLimit(const char *propName, int64_t defaultValue) {
+    char val[PROPERTY_VALUE_MAX];
+    if (property_get(propName, val, NULL)) {
+        char *end;
+        unsigned long long x = strtoull(val, &end, 10);
+
+        if (*end == '\0' && end > val && x > 0) {
+            return x;
+        }
+    }
+
+    return defaultValue;
+}
+
+// Returns true iff the RTP payload contains the start of a video PES packet
+// whose elementary stream data begins an IDR frame, i.e. carries an IDR slice
+// or the SPS that the source prepends to every IDR frame.
+static bool StartsIDRFrame(const sp<ABuffer> &buffer) {
+    const uint8_t *data = buffer->data();
+    size_t size = buffer->size();
+
+    for (; size >= 188; data += 188, size -= 188) {
+        if (data[0] != 0x47) {
+            return false;
+        }
+
+        bool payload_unit_start_indicator = data[1] & 0x40;
+        unsigned adaptation_field_control = (data[3] >> 4) & 3;
+
+        if (!payload_unit_start_indicator
+                || !(adaptation_field_control & 1)) {
+            continue;
+        }
+
+        size_t offset = 4;
+        if (adaptation_field_control & 2) {
+            offset += 1 + data[4];
+        }
+
+        if (offset + 9 > 188) {
+            continue;
+        }
+
+        const uint8_t *pes = &data[offset];
+        if (pes[0] != 0x00 || pes[1] != 0x00 || pes[2] != 0x01
+                || (pes[3] & 0xf0) != 0xe0) {
+            // Not a video PES packet.
+            continue;
+        }
+
+        offset += 9 + pes[8];
+
+        while (offset + 4 <= 188) {
+            if (data[offset] == 0x00
+                    && data[offset + 1] == 0x00
+                    && data[offset + 2] == 0x01) {
+                unsigned nalType = data[offset + 3] & 0x1f;
+
+                if (nalType == 5 || nalType == 7) {
+                    return true;
+                } else if (nalType == 1) {
+                    return false;
+                }
+
+                offset += 3;
+            } else {
+                ++offset;
+            }
+        }
+    }
+
+    return false;
+}
+
 struct TunnelRenderer::PlayerClient : public BnMediaPlayerClient {
     PlayerClient() {}
 
@@ -75,6 +160,12 @@ private:
 
     size_t mNumDeqeued;
 
+    TSValidator mValidator;
+    int64_t mLastTSStatsLogUs;
+
+    // The player syncs to our clock only once, at the first buffer.
+    ClockRecovery mClockRecovery;
+
     DISALLOW_EVIL_CONSTRUCTORS(StreamSource);
 };
 
@@ -82,10 +173,12 @@ private:
 
 TunnelRenderer::StreamSource::StreamSource(TunnelRenderer *owner)
     : mOwner(owner),
-      mNumDeqeued(0) {
+      mNumDeqeued(0),
+      mLastTSStatsLogUs(-1ll) {
 }
 
 TunnelRenderer::StreamSource::~StreamSource() {
+    mValidator.logStats();
 }
 
 void TunnelRenderer::StreamSource::setListener(
@@ -117,13 +210,22 @@ void TunnelRenderer::StreamSource::doSomeWork() {
     Mutex::Autolock autoLock(mLock);
 
     while (!mIndicesAvailable.empty()) {
-        sp<ABuffer> srcBuffer = mOwner->dequeueBuffer();
+        bool discontinuity;
+        sp<ABuffer> srcBuffer = mOwner->dequeueBuffer(&discontinuity);
         if (srcBuffer == NULL) {
             break;
         }
 
         ++mNumDeqeued;
 
+        if (discontinuity && mNumDeqeued > 1) {
+            ALOGI("signalling discontinuity.");
+
+            mListener->issueCommand(
+                    IStreamListener::DISCONTINUITY,
+                    false /* synchronous */);
+        }
+
         if (mNumDeqeued == 1) {
             ALOGI("fixing real time now.");
 
@@ -143,6 +245,45 @@ void TunnelRenderer::StreamSource::doSomeWork() {
 
         ALOGV("dequeue TS packet of size %d", srcBuffer->size());
 
+        int64_t arrivalTimeUs = MediaPacket::From(srcBuffer)->mArrivalTimeUs;
+        if (arrivalTimeUs < 0ll) {
+            arrivalTimeUs = ALooper::GetNowUs();
+        }
+
+        mClockRecovery.process(
+                srcBuffer->data(), srcBuffer->size(), arrivalTimeUs);
+
+        // This is what the decoder gets to see, whatever got lost on the
+        // way shows up here.
+        uint32_t flags =
+            mValidator.validate(srcBuffer->data(), srcBuffer->size());
+
+        if (flags & TSValidator::kFlagVideoLoss) {
+            if (!discontinuity) {
+                // Have the decoder drop the incomplete access unit and
+                // resume at the next one instead of decoding garbage.
+                ALOGI("video data lost, signalling discontinuity.");
+
+                mListener->issueCommand(
+                        IStreamListener::DISCONTINUITY,
+                        false /* synchronous */);
+            }
+
+            mOwner->notifyVideoLoss();
+        }
+
+        int64_t nowUs = ALooper::GetNowUs();
+        if (mLastTSStatsLogUs < 0ll) {
+            mLastTSStatsLogUs = nowUs;
+        } else if (nowUs >= mLastTSStatsLogUs + kLogTSStatsIntervalUs) {
+            mValidator.logStats();
+            mLastTSStatsLogUs = nowUs;
+
+            if (mClockRecovery.isLocked()) {
+                ALOGI("source clock skew %.2f ppm", mClockRecovery.skewPPM());
+            }
+        }
+
         size_t index = *mIndicesAvailable.begin();
         mIndicesAvailable.erase(mIndicesAvailable.begin());
 
@@ -158,23 +299,75 @@ void TunnelRenderer::StreamSource::doSomeWork() {
 ////////////////////////////////////////////////////////////////////////////////
 
 TunnelRenderer::TunnelRenderer(
-        const sp<AMessage> &notifyLost,
-        const sp<ISurfaceTexture> &surfaceTex)
-    : mNotifyLost(notifyLost),
+        const sp<AMessage> &notify,
+        const sp<ISurfaceTexture> &surfaceTex,
+        bool headless)
+    : mNotify(notify),
       mSurfaceTex(surfaceTex),
       mTotalBytesQueued(0ll),
+      mMaxBytesQueued(
+              getQueueLimit(
+                  "media.wfd.sink.max-queue-bytes", kDefaultMaxBytesQueued)),
+      mMaxQueueDurationUs(
+              getQueueLimit(
+                  "media.wfd.sink.max-queue-ms",
+                  kDefaultMaxQueueDurationMs) * 1000ll),
+      mPeakBytesQueued(0ll),
+      mPeakQueueDurationUs(0ll),
+      mReportedPeakBytesQueued(0ll),
+      mReportedPeakQueueDurationUs(0ll),
+      mNumOverflows(0),
+      mWaitingForIDR(false),
+      mDiscontinuityPending(false),
       mLastDequeuedExtSeqNo(-1),
       mFirstFailedAttemptUs(-1ll),
-      mRequestedRetransmission(false) {
+      mLastIDRRequestUs(-1ll),
+      mNumSuppressedIDRRequests(0),
+      mHeadlessRenderer(headless ? new HeadlessRenderer : NULL),
+      mHeadlessDrainPending(false),
+      mLastAVSyncLogUs(-1ll) {
 }
 
 TunnelRenderer::~TunnelRenderer() {
-    destroyPlayer();
+    if (mHeadlessRenderer != NULL) {
+        delete mHeadlessRenderer;
+        mHeadlessRenderer = NULL;
+    } else {
+        destroyPlayer();
+    }
 }
 
-void TunnelRenderer::queueBuffer(const sp<ABuffer> &buffer) {
+void TunnelRenderer::queueBuffers(const List<sp<MediaPacket> > &buffers) {
     Mutex::Autolock autoLock(mLock);
 
+    for (List<sp<MediaPacket> >::const_iterator it = buffers.begin();
+            it != buffers.end(); ++it) {
+        queueBuffer_l(*it);
+    }
+
+    checkQueueLimits_l();
+}
+
+void TunnelRenderer::queueBuffer_l(const sp<MediaPacket> &buffer) {
+    if (mWaitingForIDR) {
+        int32_t extSeqNo = buffer->mExtSeqNo;
+
+        if (extSeqNo <= mLastDequeuedExtSeqNo) {
+            return;
+        }
+
+        if (!StartsIDRFrame(buffer)) {
+            // Nothing queued before the next IDR frame is decodable.
+            mLastDequeuedExtSeqNo = extSeqNo;
+            return;
+        }
+
+        ALOGI("resuming at IDR frame, extSeqNo %d", extSeqNo);
+
+        mWaitingForIDR = false;
+        mLastDequeuedExtSeqNo = extSeqNo - 1;
+    }
+
     mTotalBytesQueued += buffer->size();
 
     if (mPackets.empty()) {
@@ -182,12 +375,12 @@ void TunnelRenderer::queueBuffer(const sp<ABuffer> &buffer) {
         return;
     }
 
-    int32_t newExtendedSeqNo = buffer->int32Data();
+    int32_t newExtendedSeqNo = buffer->mExtSeqNo;
 
-    List<sp<ABuffer> >::iterator firstIt = mPackets.begin();
-    List<sp<ABuffer> >::iterator it = --mPackets.end();
+    List<sp<MediaPacket> >::iterator firstIt = mPackets.begin();
+    List<sp<MediaPacket> >::iterator it = --mPackets.end();
     for (;;) {
-        int32_t extendedSeqNo = (*it)->int32Data();
+        int32_t extendedSeqNo = (*it)->mExtSeqNo;
 
         if (extendedSeqNo == newExtendedSeqNo) {
             // Duplicate packet.
@@ -210,14 +403,135 @@ void TunnelRenderer::queueBuffer(const sp<ABuffer> &buffer) {
     }
 }
 
-sp<ABuffer> TunnelRenderer::dequeueBuffer() {
+int64_t TunnelRenderer::getQueueDurationUs_l() const {
+    if (mPackets.empty()) {
+        return 0ll;
+    }
+
+    return ALooper::GetNowUs() - (*mPackets.begin())->mArrivalTimeUs;
+}
+
+void TunnelRenderer::checkQueueLimits_l() {
+    int64_t durationUs = getQueueDurationUs_l();
+
+    if (mTotalBytesQueued > mPeakBytesQueued) {
+        mPeakBytesQueued = mTotalBytesQueued;
+    }
+
+    if (durationUs > mPeakQueueDurationUs) {
+        mPeakQueueDurationUs = durationUs;
+    }
+
+    // Only report high-water marks once they've grown by a quarter, the
+    // queue fills up a little at a time.
+    if (mPeakBytesQueued > mReportedPeakBytesQueued * 5 / 4
+            || mPeakQueueDurationUs > mReportedPeakQueueDurationUs * 5 / 4) {
+        ALOGI("queue high-water mark: %lld bytes, %.2f ms "
+              "(limits %lld bytes, %.2f ms)",
+              mPeakBytesQueued, mPeakQueueDurationUs / 1E3,
+              mMaxBytesQueued, mMaxQueueDurationUs / 1E3);
+
+        mReportedPeakBytesQueued = mPeakBytesQueued;
+        mReportedPeakQueueDurationUs = mPeakQueueDurationUs;
+    }
+
+    if (mTotalBytesQueued <= mMaxBytesQueued
+            && durationUs <= mMaxQueueDurationUs) {
+        return;
+    }
+
+    ALOGW("queue overflow #%d: %lld bytes, %.2f ms queued",
+          mNumOverflows + 1, mTotalBytesQueued, durationUs / 1E3);
+
+    ++mNumOverflows;
+
+    flushToNextIDR_l();
+}
+
+void TunnelRenderer::flushToNextIDR_l() {
+    // Always discard the head of the queue, even if it starts an IDR frame,
+    // we wouldn't make any progress otherwise.
+    size_t numDropped = 0;
+    while (!mPackets.empty()) {
+        const sp<MediaPacket> &buffer = *mPackets.begin();
+
+        if (numDropped > 0 && StartsIDRFrame(buffer)) {
+            break;
+        }
+
+        if (buffer->mExtSeqNo > mLastDequeuedExtSeqNo) {
+            mLastDequeuedExtSeqNo = buffer->mExtSeqNo;
+        }
+
+        mTotalBytesQueued -= buffer->size();
+        mPackets.erase(mPackets.begin());
+
+        ++numDropped;
+    }
+
+    if (mPackets.empty()) {
+        ALOGW("dropped %d packets, waiting for the next IDR frame.",
+              numDropped);
+
+        mWaitingForIDR = true;
+    } else {
+        ALOGW("dropped %d packets, resuming at queued IDR frame.",
+              numDropped);
+
+        mLastDequeuedExtSeqNo = (*mPackets.begin())->mExtSeqNo - 1;
+    }
+
+    mFirstFailedAttemptUs = -1ll;
+    mDiscontinuityPending = true;
+
+    // Timestamps and arrival times on the far side of the gap have nothing
+    // to do with those before it.
+    mAVSyncMonitor.reset();
+
+    // Nothing will be decoded until the IDR frame arrives, always ask.
+    requestIDR_l(true /* flushed */);
+}
+
+void TunnelRenderer::notifyVideoLoss() {
+    Mutex::Autolock autoLock(mLock);
+
+    int64_t nowUs = ALooper::GetNowUs();
+
+    if (mLastIDRRequestUs >= 0ll
+            && nowUs < mLastIDRRequestUs + kMinIDRRequestIntervalUs) {
+        ++mNumSuppressedIDRRequests;
+        return;
+    }
+
+    requestIDR_l(false /* flushed */);
+}
+
+void TunnelRenderer::requestIDR_l(bool flushed) {
+    if (mNumSuppressedIDRRequests > 0) {
+        ALOGV("suppressed %d IDR frame requests since the last one.",
+              mNumSuppressedIDRRequests);
+
+        mNumSuppressedIDRRequests = 0;
+    }
+
+    mLastIDRRequestUs = ALooper::GetNowUs();
+
+    sp<AMessage> notify = mNotify->dup();
+    notify->setInt32("what", kWhatRequestIDR);
+    notify->setInt32("flushed", flushed);
+    notify->post();
+}
+
+sp<ABuffer> TunnelRenderer::dequeueBuffer(bool *discontinuity) {
     Mutex::Autolock autoLock(mLock);
 
-    sp<ABuffer> buffer;
+    *discontinuity = false;
+
+    sp<MediaPacket> buffer;
     int32_t extSeqNo;
     while (!mPackets.empty()) {
         buffer = *mPackets.begin();
-        extSeqNo = buffer->int32Data();
+        extSeqNo = buffer->mExtSeqNo;
 
         if (mLastDequeuedExtSeqNo < 0 || extSeqNo > mLastDequeuedExtSeqNo) {
             break;
@@ -235,7 +549,6 @@ sp<ABuffer> TunnelRenderer::dequeueBuffer() {
     if (mPackets.empty()) {
         if (mFirstFailedAttemptUs < 0ll) {
             mFirstFailedAttemptUs = ALooper::GetNowUs();
-            mRequestedRetransmission = false;
         } else {
             ALOGV("no packets available for %.2f secs",
                     (ALooper::GetNowUs() - mFirstFailedAttemptUs) / 1E6);
@@ -245,19 +558,24 @@ sp<ABuffer> TunnelRenderer::dequeueBuffer() {
     }
 
     if (mLastDequeuedExtSeqNo < 0 || extSeqNo == mLastDequeuedExtSeqNo + 1) {
-        if (mRequestedRetransmission) {
-            ALOGI("Recovered after requesting retransmission of %d",
+        if (mFirstFailedAttemptUs >= 0ll) {
+            ALOGV("Recovered after waiting %.2f ms for extSeqNo %d",
+                  (ALooper::GetNowUs() - mFirstFailedAttemptUs) / 1E3,
                   extSeqNo);
         }
 
         mLastDequeuedExtSeqNo = extSeqNo;
         mFirstFailedAttemptUs = -1ll;
-        mRequestedRetransmission = false;
 
         mPackets.erase(mPackets.begin());
 
         mTotalBytesQueued -= buffer->size();
 
+        *discontinuity = mDiscontinuityPending;
+        mDiscontinuityPending = false;
+
+        onBufferDequeued_l(buffer);
+
         return buffer;
     }
 
@@ -268,21 +586,11 @@ sp<ABuffer> TunnelRenderer::dequeueBuffer() {
         return NULL;
     }
 
-    if (mFirstFailedAttemptUs + 50000ll > ALooper::GetNowUs()) {
-        // We're willing to wait a little while to get the right packet.
-
-        if (!mRequestedRetransmission) {
-            ALOGI("requesting retransmission of seqNo %d",
-                  (mLastDequeuedExtSeqNo + 1) & 0xffff);
-
-            sp<AMessage> notify = mNotifyLost->dup();
-            notify->setInt32("seqNo", (mLastDequeuedExtSeqNo + 1) & 0xffff);
-            notify->post();
+    if (mFirstFailedAttemptUs + kPlayoutDelayUs > ALooper::GetNowUs()) {
+        // We're willing to wait a little while to get the right packet,
+        // RTPSink has already requested its retransmission.
 
-            mRequestedRetransmission = true;
-        } else {
-            ALOGI("still waiting for the correct packet to arrive.");
-        }
+        ALOGV("still waiting for the correct packet to arrive.");
 
         return NULL;
     }
@@ -293,25 +601,55 @@ sp<ABuffer> TunnelRenderer::dequeueBuffer() {
     // Permanent failure, we never received the packet.
     mLastDequeuedExtSeqNo = extSeqNo;
     mFirstFailedAttemptUs = -1ll;
-    mRequestedRetransmission = false;
 
     mTotalBytesQueued -= buffer->size();
 
     mPackets.erase(mPackets.begin());
 
+    *discontinuity = mDiscontinuityPending;
+    mDiscontinuityPending = false;
+
+    onBufferDequeued_l(buffer);
+
     return buffer;
 }
 
+void TunnelRenderer::onBufferDequeued_l(const sp<MediaPacket> &buffer) {
+    int64_t nowUs = ALooper::GetNowUs();
+
+    int64_t arrivalTimeUs = buffer->mArrivalTimeUs;
+    if (arrivalTimeUs < 0ll) {
+        arrivalTimeUs = nowUs;
+    }
+
+    mAVSyncMonitor.process(buffer->data(), buffer->size(), arrivalTimeUs);
+
+    if (mLastAVSyncLogUs < 0ll) {
+        mLastAVSyncLogUs = nowUs;
+    } else if (nowUs >= mLastAVSyncLogUs + kLogAVSyncStatsIntervalUs) {
+        mAVSyncMonitor.logStats();
+        mLastAVSyncLogUs = nowUs;
+    }
+}
+
+void TunnelRenderer::getAVSyncStats(AVSyncMonitor::Stats *stats) const {
+    Mutex::Autolock autoLock(mLock);
+    mAVSyncMonitor.getStats(stats);
+}
+
 void TunnelRenderer::onMessageReceived(const sp<AMessage> &msg) {
     switch (msg->what()) {
-        case kWhatQueueBuffer:
+        case kWhatQueueBuffers:
         {
-            sp<ABuffer> buffer;
-            CHECK(msg->findBuffer("buffer", &buffer));
+            sp<RefBase> obj;
+            CHECK(msg->findObject("packets", &obj));
 
-            queueBuffer(buffer);
+            sp<PacketBatch> batch = static_cast<PacketBatch *>(obj.get());
+            queueBuffers(batch->mPackets);
 
-            if (mStreamSource == NULL) {
+            if (mHeadlessRenderer != NULL) {
+                drainHeadless();
+            } else if (mStreamSource == NULL) {
                 if (mTotalBytesQueued > 0ll) {
                     initPlayer();
                 } else {
@@ -323,11 +661,50 @@ void TunnelRenderer::onMessageReceived(const sp<AMessage> &msg) {
             break;
         }
 
+        case kWhatDrainHeadless:
+        {
+            mHeadlessDrainPending = false;
+            drainHeadless();
+            break;
+        }
+
         default:
             TRESPASS();
     }
 }
 
+void TunnelRenderer::drainHeadless() {
+    for (;;) {
+        bool discontinuity;
+        sp<ABuffer> buffer = dequeueBuffer(&discontinuity);
+
+        if (buffer == NULL) {
+            break;
+        }
+
+        uint32_t flags = mHeadlessRenderer->queueBuffer(buffer, discontinuity);
+
+        if (flags & TSValidator::kFlagVideoLoss) {
+            notifyVideoLoss();
+        }
+    }
+
+    bool havePackets;
+    {
+        Mutex::Autolock autoLock(mLock);
+        havePackets = !mPackets.empty();
+    }
+
+    // Nobody asks for more data, check back once the packet we're waiting
+    // for had a chance to arrive or was given up on.
+    if (havePackets && !mHeadlessDrainPending) {
+        (new AMessage(kWhatDrainHeadless, id()))->post(
+                kHeadlessDrainIntervalUs);
+
+        mHeadlessDrainPending = true;
+    }
+}
+
 void TunnelRenderer::initPlayer() {
     if (mSurfaceTex == NULL) {
         mComposerClient = new SurfaceComposerClient;
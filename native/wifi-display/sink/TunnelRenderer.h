@@ -21,9 +21,13 @@
 #include <gui/Surface.h>
 #include <media/stagefright/foundation/AHandler.h>
 
+#include "AVSyncMonitor.h"
+#include "MediaPacket.h"
+
 namespace android {
 
 struct ABuffer;
+struct HeadlessRenderer;
 struct SurfaceComposerClient;
 struct SurfaceControl;
 struct Surface;
@@ -32,16 +36,60 @@ struct IStreamListener;
 
 // This class reassembles incoming RTP packets into the correct order
 // and sends the resulting transport stream to a mediaplayer instance
-// for playback.
+// for playback. If "headless" is set, there's no mediaplayer, the stream
+// is consumed by a HeadlessRenderer instead.
 struct TunnelRenderer : public AHandler {
     TunnelRenderer(
-            const sp<AMessage> &notifyLost,
-            const sp<ISurfaceTexture> &surfaceTex);
+            const sp<AMessage> &notify,
+            const sp<ISurfaceTexture> &surfaceTex,
+            bool headless = false);
+
+    // "discontinuity" is set if data preceding the returned buffer had to
+    // be discarded.
+    sp<ABuffer> dequeueBuffer(bool *discontinuity);
+
+    // Video data was lost for good, the decoder's reference frames are
+    // unusable until the next IDR frame.
+    void notifyVideoLoss();
 
-    sp<ABuffer> dequeueBuffer();
+    void getAVSyncStats(AVSyncMonitor::Stats *stats) const;
 
     enum {
-        kWhatQueueBuffer,
+        kWhatQueueBuffers,
+        kWhatDrainHeadless,
+    };
+
+    // How long we're willing to wait for a missing packet before skipping
+    // over it, retransmissions arriving any later are useless.
+    static const int64_t kPlayoutDelayUs = 50000ll;
+
+    // How often a headless renderer checks on packets it's waiting for.
+    static const int64_t kHeadlessDrainIntervalUs = 10000ll;
+
+    // Losses within this long of an IDR frame request don't trigger
+    // another one, the frame is likely on its way already.
+    static const int64_t kMinIDRRequestIntervalUs = 1000000ll;
+
+    // Values of the "what" field of notifications posted through "notify".
+    enum {
+        // Queued data was discarded, decoding can only resume at the next
+        // IDR frame. "flushed" is set if nothing at all will be decoded
+        // until then, as opposed to decoding with damaged references.
+        kWhatRequestIDR,
+    };
+
+    // A run of packets handed over in a single kWhatQueueBuffers message,
+    // stored under "packets".
+    struct PacketBatch : public RefBase {
+        PacketBatch() {}
+
+        List<sp<MediaPacket> > mPackets;
+
+    protected:
+        virtual ~PacketBatch() {}
+
+    private:
+        DISALLOW_EVIL_CONSTRUCTORS(PacketBatch);
     };
 
 protected:
@@ -54,12 +102,27 @@ private:
 
     mutable Mutex mLock;
 
-    sp<AMessage> mNotifyLost;
+    sp<AMessage> mNotify;
     sp<ISurfaceTexture> mSurfaceTex;
 
-    List<sp<ABuffer> > mPackets;
+    List<sp<MediaPacket> > mPackets;
     int64_t mTotalBytesQueued;
 
+    // Upper bounds on the amount of queued data, configurable through
+    // "media.wfd.sink.max-queue-bytes" and "media.wfd.sink.max-queue-ms".
+    int64_t mMaxBytesQueued;
+    int64_t mMaxQueueDurationUs;
+
+    // High-water marks.
+    int64_t mPeakBytesQueued;
+    int64_t mPeakQueueDurationUs;
+    int64_t mReportedPeakBytesQueued;
+    int64_t mReportedPeakQueueDurationUs;
+
+    size_t mNumOverflows;
+    bool mWaitingForIDR;
+    bool mDiscontinuityPending;
+
     sp<SurfaceComposerClient> mComposerClient;
     sp<SurfaceControl> mSurfaceControl;
     sp<Surface> mSurface;
@@ -69,12 +132,28 @@ private:
 
     int32_t mLastDequeuedExtSeqNo;
     int64_t mFirstFailedAttemptUs;
-    bool mRequestedRetransmission;
+
+    int64_t mLastIDRRequestUs;
+    size_t mNumSuppressedIDRRequests;
+
+    HeadlessRenderer *mHeadlessRenderer;
+    bool mHeadlessDrainPending;
+
+    AVSyncMonitor mAVSyncMonitor;
+    int64_t mLastAVSyncLogUs;
 
     void initPlayer();
+    void drainHeadless();
     void destroyPlayer();
 
-    void queueBuffer(const sp<ABuffer> &buffer);
+    void queueBuffers(const List<sp<MediaPacket> > &buffers);
+    void queueBuffer_l(const sp<MediaPacket> &buffer);
+    void onBufferDequeued_l(const sp<MediaPacket> &buffer);
+
+    int64_t getQueueDurationUs_l() const;
+    void checkQueueLimits_l();
+    void flushToNextIDR_l();
+    void requestIDR_l(bool flushed);
 
     DISALLOW_EVIL_CONSTRUCTORS(TunnelRenderer);
 };
@@ -19,6 +19,7 @@
 #include <utils/Log.h>
 
 #include "WifiDisplaySink.h"
+#include "MediaPacket.h"
 #include "ParsedMessage.h"
 #include "RTPSink.h"
 
@@ -31,12 +32,15 @@ namespace android {
 
 WifiDisplaySink::WifiDisplaySink(
         const sp<ANetworkSession> &netSession,
-        const sp<ISurfaceTexture> &surfaceTex)
+        const sp<ISurfaceTexture> &surfaceTex,
+        bool headless)
     : mState(UNDEFINED),
       mNetSession(netSession),
       mSurfaceTex(surfaceTex),
+      mHeadless(headless),
       mSessionID(0),
-      mNextCSeq(1) {
+      mNextCSeq(1),
+      mIDRFrameRequestPending(false) {
 }
 
 WifiDisplaySink::~WifiDisplaySink() {
@@ -211,7 +215,8 @@ void WifiDisplaySink::onMessageReceived(const sp<AMessage> &msg) {
                     sp<ABuffer> data;
                     CHECK(msg->findBuffer("data", &data));
 
-                    mRTPSink->injectPacket(channel == 0 /* isRTP */, data);
+                    mRTPSink->injectPacket(
+                            channel == 0 /* isRTP */, MediaPacket::From(data));
                     break;
                 }
 
@@ -227,6 +232,29 @@ void WifiDisplaySink::onMessageReceived(const sp<AMessage> &msg) {
             break;
         }
 
+        case kWhatRTPSinkNotify:
+        {
+            int32_t what;
+            CHECK(msg->findInt32("what", &what));
+
+            if (what == RTPSink::kWhatRequestIDR) {
+                if (mState != PLAYING || mSessionID == 0) {
+                    ALOGW("Not requesting IDR frame, not playing.");
+                } else if (mIDRFrameRequestPending) {
+                    ALOGV("IDR frame request already pending.");
+                } else {
+                    status_t err = sendIDRFrameRequest(mSessionID);
+
+                    if (err != OK) {
+                        ALOGE("Failed to request IDR frame (err %d).", err);
+                    }
+                }
+            } else {
+                TRESPASS();
+            }
+            break;
+        }
+
         default:
             TRESPASS();
     }
@@ -564,7 +592,8 @@ status_t WifiDisplaySink::sendDescribe(int32_t sessionID, const char *uri) {
 status_t WifiDisplaySink::sendSetup(int32_t sessionID, const char *uri) {
     ALOGD("sendSetup");
 
-    mRTPSink = new RTPSink(mNetSession, mSurfaceTex);
+    sp<AMessage> notify = new AMessage(kWhatRTPSinkNotify, id());
+    mRTPSink = new RTPSink(mNetSession, notify, mSurfaceTex, mHeadless);
     looper()->registerHandler(mRTPSink);
 
     status_t err = mRTPSink->init(sUseTCPInterleaving);
@@ -632,6 +661,57 @@ status_t WifiDisplaySink::sendPlay(int32_t sessionID, const char *uri) {
     return OK;
 }
 
+// M13
+status_t WifiDisplaySink::sendIDRFrameRequest(int32_t sessionID) {
+    ALOGD("sendIDRFrameRequest");
+    CHECK(!mIDRFrameRequestPending);
+
+    AString request = "SET_PARAMETER rtsp://localhost/wfd1.0 RTSP/1.0\r\n";
+
+    AppendCommonResponse(&request, mNextCSeq);
+
+    AString content = "wfd_idr_request\r\n";
+
+    request.append(StringPrintf("Session: %s\r\n", mPlaybackSessionID.c_str()));
+    request.append("Content-Type: text/parameters\r\n");
+    request.append(StringPrintf("Content-Length: %d\r\n", content.size()));
+    request.append("\r\n");
+    request.append(content);
+
+    status_t err =
+        mNetSession->sendRequest(sessionID, request.c_str(), request.size());
+
+    if (err != OK) {
+        return err;
+    }
+
+    registerResponseHandler(
+            sessionID,
+            mNextCSeq,
+            &WifiDisplaySink::onReceiveIDRFrameRequestResponse);
+
+    ++mNextCSeq;
+
+    mIDRFrameRequestPending = true;
+
+    return OK;
+}
+
+status_t WifiDisplaySink::onReceiveIDRFrameRequestResponse(
+        int32_t sessionID, const sp<ParsedMessage> &msg) {
+    ALOGD("onReceiveIDRFrameRequestResponse");
+    CHECK(mIDRFrameRequestPending);
+    mIDRFrameRequestPending = false;
+
+    int32_t statusCode;
+    if (!msg->getStatusCode(&statusCode) || statusCode != 200) {
+        // Not fatal, the source will eventually send an IDR frame anyway.
+        ALOGW("IDR frame request was rejected.");
+    }
+
+    return OK;
+}
+
 // on receive M4, M5.
 void WifiDisplaySink::onSetParameterRequest(
         int32_t sessionID,
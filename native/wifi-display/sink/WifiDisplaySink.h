@@ -30,11 +30,13 @@ struct RTPSink;
 
 // Represents the RTSP client acting as a wifi display sink.
 // Connects to a wifi display source and renders the incoming
-// transport stream using a MediaPlayer instance.
+// transport stream using a MediaPlayer instance, or only collects
+// statistics about it if "headless" is set.
 struct WifiDisplaySink : public AHandler {
     WifiDisplaySink(
             const sp<ANetworkSession> &netSession,
-            const sp<ISurfaceTexture> &surfaceTex = NULL);
+            const sp<ISurfaceTexture> &surfaceTex = NULL,
+            bool headless = false);
 
     void start(const char *sourceHost, int32_t sourcePort);
     void start(const char *uri);
@@ -56,6 +58,7 @@ private:
         kWhatStart,
         kWhatRTSPNotify,
         kWhatStop,
+        kWhatRTPSinkNotify,
     };
 
     struct ResponseID {
@@ -77,6 +80,7 @@ private:
     State mState;
     sp<ANetworkSession> mNetSession;
     sp<ISurfaceTexture> mSurfaceTex;
+    bool mHeadless;
     AString mSetupURI;
     AString mRTSPHost;
     int32_t mSessionID;
@@ -91,10 +95,13 @@ private:
     AString mPlaybackSessionID;
     int32_t mPlaybackSessionTimeoutSecs;
 
+    bool mIDRFrameRequestPending;
+
     status_t sendM2(int32_t sessionID);
     status_t sendDescribe(int32_t sessionID, const char *uri);
     status_t sendSetup(int32_t sessionID, const char *uri);
     status_t sendPlay(int32_t sessionID, const char *uri);
+    status_t sendIDRFrameRequest(int32_t sessionID);
 
     status_t onReceiveM2Response(
             int32_t sessionID, const sp<ParsedMessage> &msg);
@@ -110,6 +117,9 @@ private:
     status_t onReceivePlayResponse(
             int32_t sessionID, const sp<ParsedMessage> &msg);
 
+    status_t onReceiveIDRFrameRequestResponse(
+            int32_t sessionID, const sp<ParsedMessage> &msg);
+
     void registerResponseHandler(
             int32_t sessionID, int32_t cseq, HandleRTSPResponseFunc func);
 
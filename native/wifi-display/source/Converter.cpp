@@ -21,6 +21,7 @@
 #include "Converter.h"
 
 #include "MediaPuller.h"
+#include "TSPacketizer.h"
 
 #include <cutils/properties.h>
 #include <gui/SurfaceTextureClient.h>
@@ -41,13 +42,15 @@ Converter::Converter(
         const sp<AMessage> &notify,
         const sp<ALooper> &codecLooper,
         const sp<AMessage> &format,
-        bool usePCMAudio)
+        bool usePCMAudio,
+        bool useHEVC)
     : mInitCheck(NO_INIT),
       mNotify(notify),
       mCodecLooper(codecLooper),
       mInputFormat(format),
       mIsVideo(false),
       mIsPCMAudio(usePCMAudio),
+      mIsHEVC(useHEVC),
       mNeedToManuallyPrependSPSPPS(false),
       mDoMoreWorkPending(false)
 #if ENABLE_SILENCE_DETECTION
@@ -63,6 +66,7 @@ Converter::Converter(
     }
 
     CHECK(!usePCMAudio || !mIsVideo);
+    CHECK(!useHEVC || mIsVideo);
 
     mInitCheck = initEncoder();
 
@@ -127,7 +131,11 @@ status_t Converter::initEncoder() {
         }
         isAudio = true;
     } else if (!strcasecmp(inputMIME.c_str(), MEDIA_MIMETYPE_VIDEO_RAW)) {
-        outputMIME = MEDIA_MIMETYPE_VIDEO_AVC;
+        if (mIsHEVC) {
+            outputMIME = TSPacketizer::kMIMETypeVideoHEVC;
+        } else {
+            outputMIME = MEDIA_MIMETYPE_VIDEO_AVC;
+        }
     } else {
         TRESPASS();
     }
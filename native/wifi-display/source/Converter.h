@@ -31,13 +31,15 @@ struct MediaCodec;
 
 // Utility class that receives media access units and converts them into
 // media access unit of a different format.
-// Right now this'll convert raw video into H.264 and raw audio into AAC.
+// Right now this'll convert raw video into H.264 (or HEVC) and raw audio into
+// AAC.
 struct Converter : public AHandler {
     Converter(
             const sp<AMessage> &notify,
             const sp<ALooper> &codecLooper,
             const sp<AMessage> &format,
-            bool usePCMAudio);
+            bool usePCMAudio,
+            bool useHEVC = false);
 
     status_t initCheck() const;
 
@@ -78,6 +80,7 @@ private:
     sp<AMessage> mInputFormat;
     bool mIsVideo;
     bool mIsPCMAudio;
+    bool mIsHEVC;
     sp<AMessage> mOutputFormat;
     bool mNeedToManuallyPrependSPSPPS;
 
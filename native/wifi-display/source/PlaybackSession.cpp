@@ -29,6 +29,7 @@
 #include "WifiDisplaySource.h"
 
 #include <binder/IServiceManager.h>
+#include <cutils/properties.h>
 #include <gui/ISurfaceComposer.h>
 #include <gui/SurfaceComposerClient.h>
 #include <media/IHDCP.h>
@@ -328,14 +329,18 @@ WifiDisplaySource::PlaybackSession::PlaybackSession(
       mLastLifesignUs(),
       mVideoTrackIndex(-1),
       mPrevTimeUs(-1ll),
-      mAllTracksHavePacketizerIndex(false) {
+      mAllTracksHavePacketizerIndex(false),
+      mIDRFrameRequestPending(false),
+      mIDRFrameRequestTimeUs(-1ll),
+      mMinParallelAccessUnitSize(0) {
 }
 
 status_t WifiDisplaySource::PlaybackSession::init(
         const char *clientIP, int32_t clientRtp, int32_t clientRtcp,
         Sender::TransportMode transportMode,
-        bool usePCMAudio) {
-    status_t err = setupPacketizer(usePCMAudio);
+        bool usePCMAudio,
+        bool useHEVC) {
+    status_t err = setupPacketizer(usePCMAudio, useHEVC);
 
     if (err != OK) {
         return err;
@@ -521,6 +526,13 @@ void WifiDisplaySource::PlaybackSession::onMessageReceived(
                 onFinishPlay2();
             } else if (what == Sender::kWhatSessionDead) {
                 notifySessionDead();
+            } else if (what == Sender::kWhatRequestIDRFrame) {
+                requestIDRFrame();
+            } else if (what == Sender::kWhatBitrateFeedback) {
+                int64_t bitrate;
+                CHECK(msg->findInt64("bitrate", &bitrate));
+
+                ALOGV("sink can take up to %lld bps", bitrate);
             } else {
                 TRESPASS();
             }
@@ -595,10 +607,74 @@ void WifiDisplaySource::PlaybackSession::onMessageReceived(
     }
 }
 
-status_t WifiDisplaySource::PlaybackSession::setupPacketizer(bool usePCMAudio) {
+// PCRs go out on the video PID at least this often unless a separate PCR
+// PID is asked for.
+static const int64_t kVideoPCRIntervalUs = 40000ll;
+
+static int64_t getVideoPCRIntervalUs() {
+    char val[PROPERTY_VALUE_MAX];
+    if (property_get("media.wfd.separate-pcr-pid", val, NULL)
+            && (!strcasecmp("true", val) || !strcmp("1", val))) {
+        return -1ll;
+    }
+
+    if (property_get("media.wfd.pcr-interval-ms", val, NULL)) {
+        char *end;
+        unsigned long x = strtoul(val, &end, 10);
+
+        if (*end == '\0' && end > val && x > 0) {
+            return x * 1000ll;
+        }
+    }
+
+    return kVideoPCRIntervalUs;
+}
+
+// Access units this large, i.e. IDR frames at high resolutions, are
+// packetized on as many threads as media.wfd.packetizer-threads asks for,
+// at most kMaxNumPacketizerThreads. Off by default, it has yet to be shown
+// to pay off on a real device.
+static const size_t kMinParallelAccessUnitSize = 128 * 1024;
+static const size_t kMaxNumPacketizerThreads = 4;
+
+static size_t getNumPacketizerThreads() {
+    char val[PROPERTY_VALUE_MAX];
+    if (property_get("media.wfd.packetizer-threads", val, NULL)) {
+        char *end;
+        unsigned long x = strtoul(val, &end, 10);
+
+        if (*end == '\0' && end > val) {
+            return x > kMaxNumPacketizerThreads
+                ? kMaxNumPacketizerThreads : x;
+        }
+    }
+
+    return 1;
+}
+
+status_t WifiDisplaySource::PlaybackSession::setupPacketizer(
+        bool usePCMAudio, bool useHEVC) {
     mPacketizer = new TSPacketizer;
 
-    status_t err = addVideoSource();
+    size_t numPacketizerThreads = getNumPacketizerThreads();
+    if (numPacketizerThreads > 1) {
+        ALOGI("Packetizing large access units on %d threads.",
+              numPacketizerThreads);
+
+        mPacketizer->enableParallelPacketization(
+                numPacketizerThreads, kMinParallelAccessUnitSize);
+
+        mMinParallelAccessUnitSize = kMinParallelAccessUnitSize;
+    }
+
+    int64_t videoPCRIntervalUs = getVideoPCRIntervalUs();
+    if (videoPCRIntervalUs > 0ll) {
+        mPacketizer->enableVideoPCR(videoPCRIntervalUs);
+    } else {
+        ALOGI("Sending PCRs on a separate PID.");
+    }
+
+    status_t err = addVideoSource(useHEVC);
 
     if (err != OK) {
         return err;
@@ -609,8 +685,9 @@ status_t WifiDisplaySource::PlaybackSession::setupPacketizer(bool usePCMAudio) {
 
 status_t WifiDisplaySource::PlaybackSession::addSource(
         bool isVideo, const sp<MediaSource> &source, bool isRepeaterSource,
-        bool usePCMAudio, size_t *numInputBuffers) {
+        bool usePCMAudio, bool useHEVC, size_t *numInputBuffers) {
     CHECK(!usePCMAudio || !isVideo);
+    CHECK(!useHEVC || isVideo);
     CHECK(!isRepeaterSource || isVideo);
 
     sp<ALooper> pullLooper = new ALooper;
@@ -650,7 +727,7 @@ status_t WifiDisplaySource::PlaybackSession::addSource(
     notify->setSize("trackIndex", trackIndex);
 
     sp<Converter> converter =
-        new Converter(notify, codecLooper, format, usePCMAudio);
+        new Converter(notify, codecLooper, format, usePCMAudio, useHEVC);
 
     err = converter->initCheck();
     if (err != OK) {
@@ -691,7 +768,7 @@ status_t WifiDisplaySource::PlaybackSession::addSource(
     return OK;
 }
 
-status_t WifiDisplaySource::PlaybackSession::addVideoSource() {
+status_t WifiDisplaySource::PlaybackSession::addVideoSource(bool useHEVC) {
     sp<SurfaceMediaSource> source = new SurfaceMediaSource(width(), height());
 
     source->setUseAbsoluteTimestamps();
@@ -705,12 +782,12 @@ status_t WifiDisplaySource::PlaybackSession::addVideoSource() {
     size_t numInputBuffers;
     status_t err = addSource(
             true /* isVideo */, videoSource, true /* isRepeaterSource */,
-            false /* usePCMAudio */, &numInputBuffers);
+            false /* usePCMAudio */, useHEVC, &numInputBuffers);
 #else
     size_t numInputBuffers;
     status_t err = addSource(
             true /* isVideo */, source, false /* isRepeaterSource */,
-            false /* usePCMAudio */, &numInputBuffers);
+            false /* usePCMAudio */, useHEVC, &numInputBuffers);
 #endif
 
     if (err != OK) {
@@ -734,7 +811,7 @@ status_t WifiDisplaySource::PlaybackSession::addAudioSource(bool usePCMAudio) {
     if (audioSource->initCheck() == OK) {
         return addSource(
                 false /* isVideo */, audioSource, false /* isRepeaterSource */,
-                usePCMAudio, NULL /* numInputBuffers */);
+                usePCMAudio, false /* useHEVC */, NULL /* numInputBuffers */);
     }
 
     ALOGW("Unable to instantiate audio source");
@@ -763,6 +840,17 @@ int32_t WifiDisplaySource::PlaybackSession::height() const {
 }
 
 void WifiDisplaySource::PlaybackSession::requestIDRFrame() {
+    int64_t nowUs = ALooper::GetNowUs();
+
+    if (mIDRFrameRequestPending
+            && nowUs < mIDRFrameRequestTimeUs + kIDRFrameRequestTimeoutUs) {
+        ALOGV("IDR frame already requested.");
+        return;
+    }
+
+    mIDRFrameRequestPending = true;
+    mIDRFrameRequestTimeUs = nowUs;
+
     for (size_t i = 0; i < mTracks.size(); ++i) {
         const sp<Track> &track = mTracks.valueAt(i);
 
@@ -787,8 +875,7 @@ bool WifiDisplaySource::PlaybackSession::allTracksHavePacketizerIndex() {
 }
 
 status_t WifiDisplaySource::PlaybackSession::packetizeAccessUnit(
-        size_t trackIndex, sp<ABuffer> accessUnit,
-        sp<ABuffer> *packets) {
+        size_t trackIndex, sp<ABuffer> accessUnit) {
     const sp<Track> &track = mTracks.valueFor(trackIndex);
 
     uint32_t flags = 0;
@@ -797,10 +884,22 @@ status_t WifiDisplaySource::PlaybackSession::packetizeAccessUnit(
     uint64_t inputCTR;
     uint8_t HDCP_private_data[16];
 
-    bool manuallyPrependSPSPPS =
+    // IDR frames for H.264, IRAP pictures for HEVC.
+    bool isRandomAccessPoint =
         !track->isAudio()
-        && track->converter()->needToManuallyPrependSPSPPS()
-        && IsIDR(accessUnit);
+        && mPacketizer->isRandomAccessPoint(
+                track->packetizerTrackIndex(), accessUnit);
+
+    bool manuallyPrependSPSPPS =
+        isRandomAccessPoint
+        && track->converter()->needToManuallyPrependSPSPPS();
+
+    if (mIDRFrameRequestPending && isRandomAccessPoint) {
+        ALOGV("requested IDR frame arrived after %.2f ms",
+              (ALooper::GetNowUs() - mIDRFrameRequestTimeUs) / 1E3);
+
+        mIDRFrameRequestPending = false;
+    }
 
     if (mHDCP != NULL && !track->isAudio()) {
         isHDCPEncrypted = true;
@@ -893,6 +992,9 @@ status_t WifiDisplaySource::PlaybackSession::packetizeAccessUnit(
         flags |= TSPacketizer::PREPEND_SPS_PPS_TO_IDR_FRAMES;
     }
 
+    // Ready to be sent as is.
+    flags |= TSPacketizer::EMIT_RTP_SLOTS;
+
     int64_t timeUs = ALooper::GetNowUs();
     if (mPrevTimeUs < 0ll || mPrevTimeUs + 100000ll <= timeUs) {
         flags |= TSPacketizer::EMIT_PCR;
@@ -901,13 +1003,11 @@ status_t WifiDisplaySource::PlaybackSession::packetizeAccessUnit(
         mPrevTimeUs = timeUs;
     }
 
-    mPacketizer->packetize(
-            track->packetizerTrackIndex(), accessUnit, packets, flags,
+    return mPacketizer->startAccessUnit(
+            track->packetizerTrackIndex(), accessUnit, flags,
             !isHDCPEncrypted ? NULL : HDCP_private_data,
             !isHDCPEncrypted ? 0 : sizeof(HDCP_private_data),
             track->isAudio() ? 2 : 0 /* numStuffingBytes */);
-
-    return OK;
 }
 
 status_t WifiDisplaySource::PlaybackSession::packetizeQueuedAccessUnits() {
@@ -987,18 +1087,42 @@ bool WifiDisplaySource::PlaybackSession::drainAccessUnit() {
     const sp<Track> &track = mTracks.valueFor(minTrackIndex);
     sp<ABuffer> accessUnit = track->dequeueOutputBuffer();
 
-    sp<ABuffer> packets;
-    status_t err = packetizeAccessUnit(minTrackIndex, accessUnit, &packets);
+    size_t numRTPPacketsPerChunk = kNumRTPPacketsPerChunk;
+    if (mMinParallelAccessUnitSize > 0
+            && accessUnit->size() >= mMinParallelAccessUnitSize) {
+        // The sender paces large frames anyway, the first packets going
+        // out a little later doesn't matter.
+        numRTPPacketsPerChunk = kNumRTPPacketsPerParallelChunk;
+    }
+
+    status_t err = packetizeAccessUnit(minTrackIndex, accessUnit);
 
     if (err != OK) {
         notifySessionDead();
         return false;
     }
 
-    if ((ssize_t)minTrackIndex == mVideoTrackIndex) {
-        packets->meta()->setInt32("isVideo", 1);
+    // Rather than muxing all of a large frame before sending any of it,
+    // the sender gets to work on the first packets right away.
+    for (;;) {
+        sp<ABuffer> packets = mPacketizer->dequeuePackets(
+                numRTPPacketsPerChunk
+                    * TSPacketizer::kNumTSPacketsPerRTPPacket);
+
+        if (packets == NULL) {
+            break;
+        }
+
+        if ((ssize_t)minTrackIndex == mVideoTrackIndex) {
+            packets->meta()->setInt32("isVideo", 1);
+        } else if (mPacketizer->carriesVideoPID()) {
+            packets->meta()->setInt32("carriesVideoPID", 1);
+        }
+
+        mSender->queuePackets(
+                minTimeUs, packets,
+                mPacketizer->countPacketsLeft() == 0 /* endOfAccessUnit */);
     }
-    mSender->queuePackets(minTimeUs, packets);
 
 #if 0
     if (minTrackIndex == mVideoTrackIndex) {
@@ -43,7 +43,8 @@ struct WifiDisplaySource::PlaybackSession : public AHandler {
     status_t init(
             const char *clientIP, int32_t clientRtp, int32_t clientRtcp,
             Sender::TransportMode transportMode,
-            bool usePCMAudio);
+            bool usePCMAudio,
+            bool useHEVC);
 
     void destroyAsync();
 
@@ -106,16 +107,33 @@ private:
 
     bool mAllTracksHavePacketizerIndex;
 
-    status_t setupPacketizer(bool usePCMAudio);
+    // Requests for an IDR frame arrive through RTSP and RTCP, often both
+    // for the same loss. Only the first one is passed on to the encoder
+    // until the IDR frame shows up or the request times out.
+    static const int64_t kIDRFrameRequestTimeoutUs = 1000000ll;
+    bool mIDRFrameRequestPending;
+    int64_t mIDRFrameRequestTimeUs;
+
+    // Access units are handed to the sender this many RTP packets at a
+    // time. Those packetized on several threads go in larger chunks, each
+    // enough to keep all of them busy.
+    static const size_t kNumRTPPacketsPerChunk = 4;
+    static const size_t kNumRTPPacketsPerParallelChunk = 32;
+
+    // 0 if access units are packetized on the calling thread only.
+    size_t mMinParallelAccessUnitSize;
+
+    status_t setupPacketizer(bool usePCMAudio, bool useHEVC);
 
     status_t addSource(
             bool isVideo,
             const sp<MediaSource> &source,
             bool isRepeaterSource,
             bool usePCMAudio,
+            bool useHEVC,
             size_t *numInputBuffers);
 
-    status_t addVideoSource();
+    status_t addVideoSource(bool useHEVC);
     status_t addAudioSource(bool usePCMAudio);
 
     ssize_t appendTSData(
@@ -126,9 +144,9 @@ private:
 
     bool allTracksHavePacketizerIndex();
 
-    status_t packetizeAccessUnit(
-            size_t trackIndex, sp<ABuffer> accessUnit,
-            sp<ABuffer> *packets);
+    // Hands the access unit to the packetizer, its packets are then
+    // dequeued and sent a few at a time by drainAccessUnit.
+    status_t packetizeAccessUnit(size_t trackIndex, sp<ABuffer> accessUnit);
 
     status_t packetizeQueuedAccessUnits();
 
@@ -21,8 +21,11 @@
 #include "Sender.h"
 
 #include "ANetworkSession.h"
+#include "MediaPacket.h"
 #include "TimeSeries.h"
+#include "TSPacketizer.h"
 
+#include <cutils/properties.h>
 #include <media/stagefright/foundation/ABuffer.h>
 #include <media/stagefright/foundation/ADebug.h>
 #include <media/stagefright/foundation/AMessage.h>
@@ -32,8 +35,27 @@
 
 namespace android {
 
-static size_t kMaxRTPPacketSize = 1500;
-static size_t kMaxNumTSPacketsPerRTPPacket = (kMaxRTPPacketSize - 12) / 188;
+static const size_t kMaxNumTSPacketsPerRTPPacket =
+    TSPacketizer::kNumTSPacketsPerRTPPacket;
+
+static const size_t kFullRTPPacketSize =
+    TSPacketizer::kRTPHeaderSize + 188 * kMaxNumTSPacketsPerRTPPacket;
+
+// Returns false if the property isn't set to a number.
+static bool GetUnsignedProperty(const char *key, unsigned long *value) {
+    char val[PROPERTY_VALUE_MAX];
+    if (property_get(key, val, NULL)) {
+        char *end;
+        unsigned long x = strtoul(val, &end, 10);
+
+        if (*end == '\0' && end > val) {
+            *value = x;
+            return true;
+        }
+    }
+
+    return false;
+}
 
 Sender::Sender(
         const sp<ANetworkSession> &netSession,
@@ -60,15 +82,35 @@ Sender::Sender(
 #if ENABLE_RETRANSMISSION && RETRANSMISSION_ACCORDING_TO_RFC_XXXX
       mRTPRetransmissionSeqNo(0),
 #endif
-      mLastNTPTime(0),
-      mLastRTPTime(0),
       mNumRTPSent(0),
       mNumRTPOctetsSent(0),
       mNumSRsSent(0),
-      mSendSRPending(false)
+      mSendSRPending(false),
+      mRTTUs(-1ll),
+      mSmoothedRTTUs(-1ll),
+      mJitterUs(-1ll),
+      mLastFIRSeqNo(-1)
 #if ENABLE_RETRANSMISSION
       ,mHistoryLength(0)
+      ,mHistoryLastSeqNo(0)
+      ,mHistoryBytes(0)
+      ,mHistoryDurationUs(kDefaultHistoryDurationUs)
+      ,mMaxHistoryBytes(0)
 #endif
+      ,mPacingPercent(kDefaultPacingPercent)
+      ,mPacingRate(kDefaultPacingRate)
+      ,mPacedBytes(0)
+      ,mNumHeldBackPackets(0)
+      ,mPacePending(false)
+      ,mPacingDeadlineUs(-1ll)
+      ,mNextPacedSendTimeUs(-1ll)
+      ,mPacingNewFrame(true)
+      ,mLastPacedFrameTimeUs(-1ll)
+      ,mFrameIntervalUs(kDefaultFrameIntervalUs)
+      ,mNumPacketsPaced(0)
+      ,mTotalPacingDelayUs(0ll)
+      ,mMaxPacingDelayUs(0ll)
+      ,mLastPacingReportUs(-1ll)
 #if TRACK_BANDWIDTH
       ,mFirstPacketTimeUs(-1ll)
       ,mTotalBytesSent(0ll)
@@ -77,6 +119,39 @@ Sender::Sender(
     ,mLogFile(NULL)
 #endif
 {
+#if ENABLE_RETRANSMISSION
+    HistoryEntry entry;
+    entry.mSentTimeUs = -1ll;
+    entry.mLastRetransmissionTimeUs = -1ll;
+    mHistory.insertAt(entry, 0, kHistoryRingSize);
+
+    unsigned long historyMs;
+    if (GetUnsignedProperty("media.wfd.retransmission-history-ms", &historyMs)
+            && historyMs > 0) {
+        mHistoryDurationUs = historyMs * 1000ll;
+    }
+
+    unsigned long historyKB;
+    if (GetUnsignedProperty(
+                "media.wfd.retransmission-history-kb", &historyKB)) {
+        mMaxHistoryBytes = historyKB * 1024;
+    }
+#endif
+
+    unsigned long pacingPercent;
+    if (GetUnsignedProperty("media.wfd.pacing-percent", &pacingPercent)) {
+        mPacingPercent = (pacingPercent > 100) ? 100 : pacingPercent;
+    }
+
+    unsigned long pacingRateKbps;
+    if (GetUnsignedProperty("media.wfd.pacing-rate-kbps", &pacingRateKbps)
+            && pacingRateKbps > 0) {
+        mPacingRate = pacingRateKbps * 1000ll;
+    }
+
+    ALOGI("pacing video over %u%% of the frame interval at >= %lld kbps",
+          mPacingPercent, mPacingRate / 1000ll);
+
 #if LOG_TRANSPORT_STREAM
     mLogFile = fopen("/system/etc/log.ts", "wb");
 #endif
@@ -285,58 +360,53 @@ int32_t Sender::getRTPPort() const {
 }
 
 void Sender::queuePackets(
-        int64_t timeUs, const sp<ABuffer> &tsPackets) {
-    const size_t numTSPackets = tsPackets->size() / 188;
-
+        int64_t timeUs, const sp<ABuffer> &tsPackets, bool endOfAccessUnit) {
     const size_t numRTPPackets =
-        (numTSPackets + kMaxNumTSPacketsPerRTPPacket - 1)
-            / kMaxNumTSPacketsPerRTPPacket;
-
-    sp<ABuffer> udpPackets = new ABuffer(
-            numRTPPackets * (12 + kMaxNumTSPacketsPerRTPPacket * 188));
-
-    udpPackets->meta()->setInt64("timeUs", timeUs);
-
-    size_t dstOffset = 0;
-    for (size_t i = 0; i < numTSPackets; ++i) {
-        if ((i % kMaxNumTSPacketsPerRTPPacket) == 0) {
-            static const bool kMarkerBit = false;
-
-            uint8_t *rtp = udpPackets->data() + dstOffset;
-            rtp[0] = 0x80;
-            rtp[1] = 33 | (kMarkerBit ? (1 << 7) : 0);  // M-bit
-            rtp[2] = (mRTPSeqNo >> 8) & 0xff;
-            rtp[3] = mRTPSeqNo & 0xff;
-            rtp[4] = 0x00;  // rtp time to be filled in later.
-            rtp[5] = 0x00;
-            rtp[6] = 0x00;
-            rtp[7] = 0x00;
-            rtp[8] = kSourceID >> 24;
-            rtp[9] = (kSourceID >> 16) & 0xff;
-            rtp[10] = (kSourceID >> 8) & 0xff;
-            rtp[11] = kSourceID & 0xff;
-
-            ++mRTPSeqNo;
-
-            dstOffset += 12;
-        }
-
-        memcpy(udpPackets->data() + dstOffset,
-               tsPackets->data() + 188 * i,
-               188);
-
-        dstOffset += 188;
+        (tsPackets->size() + kFullRTPPacketSize - 1) / kFullRTPPacketSize;
+
+    CHECK(((tsPackets->size() - 12 * numRTPPackets) % 188) == 0);
+
+    // The TS packets already sit in their RTP packets, only the headers
+    // are missing. Sequence numbers are assigned once the packets are
+    // actually sent, audio may overtake paced video.
+    for (size_t i = 0; i < numRTPPackets; ++i) {
+        // The last packet of the access unit carries the marker.
+        bool marker = endOfAccessUnit && (i + 1 == numRTPPackets);
+
+        uint8_t *rtp = tsPackets->data() + i * kFullRTPPacketSize;
+        rtp[0] = 0x80;
+        rtp[1] = 33 | (marker ? (1 << 7) : 0);  // M-bit
+        rtp[2] = 0x00;  // seq no and rtp time to be filled in later.
+        rtp[3] = 0x00;
+        rtp[4] = 0x00;
+        rtp[5] = 0x00;
+        rtp[6] = 0x00;
+        rtp[7] = 0x00;
+        rtp[8] = kSourceID >> 24;
+        rtp[9] = (kSourceID >> 16) & 0xff;
+        rtp[10] = (kSourceID >> 8) & 0xff;
+        rtp[11] = kSourceID & 0xff;
     }
 
-    udpPackets->setRange(0, dstOffset);
+    tsPackets->meta()->setInt64("timeUs", timeUs);
 
     sp<AMessage> msg = new AMessage(kWhatDrainQueue, id());
-    msg->setBuffer("udpPackets", udpPackets);
+    msg->setBuffer("udpPackets", tsPackets);
+    msg->setInt32("endOfAccessUnit", endOfAccessUnit);
     msg->post();
 
 #if LOG_TRANSPORT_STREAM
     if (mLogFile != NULL) {
-        fwrite(tsPackets->data(), 1, tsPackets->size(), mLogFile);
+        for (size_t i = 0; i < numRTPPackets; ++i) {
+            size_t offset = i * kFullRTPPacketSize;
+
+            size_t size = tsPackets->size() - offset;
+            if (size > kFullRTPPacketSize) {
+                size = kFullRTPPacketSize;
+            }
+
+            fwrite(tsPackets->data() + offset + 12, 1, size - 12, mLogFile);
+        }
     }
 #endif
 }
@@ -462,7 +532,18 @@ void Sender::onMessageReceived(const sp<AMessage> &msg) {
             sp<ABuffer> udpPackets;
             CHECK(msg->findBuffer("udpPackets", &udpPackets));
 
-            onDrainQueue(udpPackets);
+            int32_t endOfAccessUnit;
+            CHECK(msg->findInt32("endOfAccessUnit", &endOfAccessUnit));
+
+            onDrainQueue(udpPackets, endOfAccessUnit);
+            break;
+        }
+
+        case kWhatPace:
+        {
+            mPacePending = false;
+
+            onPace();
             break;
         }
 
@@ -505,19 +586,25 @@ void Sender::addSR(const sp<ABuffer> &buffer) {
     data[6] = (kSourceID >> 8) & 0xff;
     data[7] = kSourceID & 0xff;
 
-    data[8] = mLastNTPTime >> (64 - 8);
-    data[9] = (mLastNTPTime >> (64 - 16)) & 0xff;
-    data[10] = (mLastNTPTime >> (64 - 24)) & 0xff;
-    data[11] = (mLastNTPTime >> 32) & 0xff;
-    data[12] = (mLastNTPTime >> 24) & 0xff;
-    data[13] = (mLastNTPTime >> 16) & 0xff;
-    data[14] = (mLastNTPTime >> 8) & 0xff;
-    data[15] = mLastNTPTime & 0xff;
-
-    data[16] = (mLastRTPTime >> 24) & 0xff;
-    data[17] = (mLastRTPTime >> 16) & 0xff;
-    data[18] = (mLastRTPTime >> 8) & 0xff;
-    data[19] = mLastRTPTime & 0xff;
+    // The receiver echoes the NTP timestamp back to us in its receiver
+    // reports, it has to reflect the time this SR is sent for the round
+    // trip time to be accurate. The RTP clock is wallclock based as well.
+    uint64_t ntpTime = GetNowNTP();
+    uint32_t rtpTime = (ALooper::GetNowUs() * 9ll) / 100ll;
+
+    data[8] = ntpTime >> (64 - 8);
+    data[9] = (ntpTime >> (64 - 16)) & 0xff;
+    data[10] = (ntpTime >> (64 - 24)) & 0xff;
+    data[11] = (ntpTime >> 32) & 0xff;
+    data[12] = (ntpTime >> 24) & 0xff;
+    data[13] = (ntpTime >> 16) & 0xff;
+    data[14] = (ntpTime >> 8) & 0xff;
+    data[15] = ntpTime & 0xff;
+
+    data[16] = (rtpTime >> 24) & 0xff;
+    data[17] = (rtpTime >> 16) & 0xff;
+    data[18] = (rtpTime >> 8) & 0xff;
+    data[19] = rtpTime & 0xff;
 
     data[20] = mNumRTPSent >> 24;
     data[21] = (mNumRTPSent >> 16) & 0xff;
@@ -624,72 +711,80 @@ status_t Sender::parseTSFB(
         return ERROR_MALFORMED;
     }
 
-    for (size_t i = 12; i < size; i += 4) {
+    int64_t nowUs = ALooper::GetNowUs();
+    size_t numUnavailable = 0;
+
+    for (size_t i = 12; i + 4 <= size; i += 4) {
         uint16_t seqNo = U16_AT(&data[i]);
         uint16_t blp = U16_AT(&data[i + 2]);
 
-        List<sp<ABuffer> >::iterator it = mHistory.begin();
-        bool foundSeqNo = false;
-        while (it != mHistory.end()) {
-            const sp<ABuffer> &buffer = *it;
-
-            uint16_t bufferSeqNo = buffer->int32Data() & 0xffff;
-
-            bool retransmit = false;
-            if (bufferSeqNo == seqNo) {
-                retransmit = true;
-            } else if (blp != 0) {
-                for (size_t i = 0; i < 16; ++i) {
-                    if ((blp & (1 << i))
-                        && (bufferSeqNo == ((seqNo + i + 1) & 0xffff))) {
-                        blp &= ~(1 << i);
-                        retransmit = true;
-                    }
-                }
+        if (!retransmit(seqNo, nowUs)) {
+            ++numUnavailable;
+        }
+
+        for (size_t j = 0; j < 16; ++j) {
+            if ((blp & (1 << j)) && !retransmit(seqNo + j + 1, nowUs)) {
+                ++numUnavailable;
             }
+        }
+    }
 
-            if (retransmit) {
-                ALOGI("retransmitting seqNo %d", bufferSeqNo);
+    if (numUnavailable > 0) {
+        ALOGI("%d sequence numbers were no longer available for "
+              "retransmission", numUnavailable);
+    }
 
-#if RETRANSMISSION_ACCORDING_TO_RFC_XXXX
-                sp<ABuffer> retransRTP = new ABuffer(2 + buffer->size());
-                uint8_t *rtp = retransRTP->data();
-                memcpy(rtp, buffer->data(), 12);
-                rtp[2] = (mRTPRetransmissionSeqNo >> 8) & 0xff;
-                rtp[3] = mRTPRetransmissionSeqNo & 0xff;
-                rtp[12] = (bufferSeqNo >> 8) & 0xff;
-                rtp[13] = bufferSeqNo & 0xff;
-                memcpy(&rtp[14], buffer->data() + 12, buffer->size() - 12);
-
-                ++mRTPRetransmissionSeqNo;
-
-                sendPacket(
-                        mRTPRetransmissionSessionID,
-                        retransRTP->data(), retransRTP->size());
-#else
-                sendPacket(
-                        mRTPSessionID, buffer->data(), buffer->size());
-#endif
+    return OK;
+}
 
-                if (bufferSeqNo == seqNo) {
-                    foundSeqNo = true;
-                }
+bool Sender::retransmit(uint16_t seqNo, int64_t nowUs) {
+    uint16_t age = mHistoryLastSeqNo - seqNo;
+    if (age >= mHistoryLength) {
+        return false;
+    }
 
-                if (foundSeqNo && blp == 0) {
-                    break;
-                }
-            }
+    HistoryEntry *entry =
+        &mHistory.editItemAt(seqNo & (kHistoryRingSize - 1));
 
-            ++it;
-        }
+    if (nowUs - entry->mSentTimeUs > mHistoryDurationUs) {
+        return false;
+    }
 
-        if (!foundSeqNo || blp != 0) {
-            ALOGI("Some sequence numbers were no longer available for "
-                  "retransmission");
-        }
+    int64_t rttUs = (mSmoothedRTTUs >= 0ll) ? mSmoothedRTTUs : kDefaultRTTUs;
+
+    if (entry->mLastRetransmissionTimeUs >= 0ll
+            && nowUs - entry->mLastRetransmissionTimeUs < rttUs) {
+        // Repeated NACK, sent before the last retransmission could arrive.
+        ALOGV("not retransmitting seqNo %d again yet", seqNo);
+        return true;
     }
 
-    return OK;
+    entry->mLastRetransmissionTimeUs = nowUs;
+
+    const sp<MediaPacket> &buffer = entry->mPacket;
+
+    ALOGI("retransmitting seqNo %d", seqNo);
+
+#if RETRANSMISSION_ACCORDING_TO_RFC_XXXX
+    sp<ABuffer> retransRTP = new ABuffer(2 + buffer->size());
+    uint8_t *rtp = retransRTP->data();
+    memcpy(rtp, buffer->data(), 12);
+    rtp[2] = (mRTPRetransmissionSeqNo >> 8) & 0xff;
+    rtp[3] = mRTPRetransmissionSeqNo & 0xff;
+    rtp[12] = (seqNo >> 8) & 0xff;
+    rtp[13] = seqNo & 0xff;
+    memcpy(&rtp[14], buffer->data() + 12, buffer->size() - 12);
+
+    ++mRTPRetransmissionSeqNo;
+
+    sendPacket(
+            mRTPRetransmissionSessionID,
+            retransRTP->data(), retransRTP->size());
+#else
+    mNetSession->sendDatagram(mRTPSessionID, buffer);
+#endif
+
+    return true;
 }
 #endif
 
@@ -731,8 +826,11 @@ status_t Sender::parseRTCP(
         }
 
         switch (data[1]) {
-            case 200:
             case 201:  // RR
+                parseRR(data, headerLength);
+                break;
+
+            case 200:
             case 202:  // SDES
             case 203:
             case 204:  // APP
@@ -745,7 +843,7 @@ status_t Sender::parseRTCP(
 #endif
 
             case 206:  // PSFB (payload specific feedback)
-                hexdump(data, headerLength);
+                parsePSFB(data, headerLength);
                 break;
 
             default:
@@ -763,6 +861,157 @@ status_t Sender::parseRTCP(
     return OK;
 }
 
+status_t Sender::parseRR(const uint8_t *data, size_t size) {
+    size_t RC = data[0] & 0x1f;
+
+    if (size < (2 + RC * 6) * 4) {
+        // Packet too short for the report blocks it claims to contain.
+        return ERROR_MALFORMED;
+    }
+
+    for (size_t i = 0; i < RC; ++i) {
+        const uint8_t *block = &data[8 + i * 24];
+
+        if (U32_AT(block) != kSourceID) {
+            continue;
+        }
+
+        uint32_t jitter = U32_AT(&block[12]);
+        uint32_t lastSR = U32_AT(&block[16]);
+        uint32_t delaySinceLastSR = U32_AT(&block[20]);
+
+        // 90kHz time scale
+        mJitterUs = (jitter * 100ll) / 9ll;
+
+        if (lastSR == 0) {
+            // The receiver hasn't seen any of our SRs yet.
+            continue;
+        }
+
+        // All in units of 1/65536 seconds (RFC 3550 6.4.1).
+        uint32_t now = (GetNowNTP() >> 16) & 0xffffffff;
+        int32_t rtt = (int32_t)(now - lastSR - delaySinceLastSR);
+
+        if (rtt < 0) {
+            // Clock granularity.
+            rtt = 0;
+        }
+
+        mRTTUs = (rtt * 1000000ll) >> 16;
+
+        if (mSmoothedRTTUs < 0ll) {
+            mSmoothedRTTUs = mRTTUs;
+        } else {
+            mSmoothedRTTUs = (7 * mSmoothedRTTUs + mRTTUs) / 8;
+        }
+
+        ALOGV("RR: fraction lost %u, rtt %.2f ms (smoothed %.2f ms), "
+              "jitter %.2f ms",
+              block[4],
+              mRTTUs / 1E3,
+              mSmoothedRTTUs / 1E3,
+              mJitterUs / 1E3);
+    }
+
+    return OK;
+}
+
+status_t Sender::parsePSFB(const uint8_t *data, size_t size) {
+    if (size < 12) {
+        return ERROR_MALFORMED;
+    }
+
+    switch (data[0] & 0x1f) {
+        case 1:  // PLI
+        {
+            if (U32_AT(&data[8]) != kSourceID) {
+                return ERROR_MALFORMED;
+            }
+
+            ALOGV("received picture loss indication");
+
+            notifyRequestIDRFrame();
+            return OK;
+        }
+
+        case 4:  // FIR
+            return parseFIR(data, size);
+
+        case 15:  // application layer feedback
+            return parseREMB(data, size);
+
+        default:
+            break;
+    }
+
+    hexdump(data, size);
+    return ERROR_UNSUPPORTED;
+}
+
+status_t Sender::parseFIR(const uint8_t *data, size_t size) {
+    // One FCI entry per media sender, SSRC and command sequence number
+    // (RFC 5104 4.3.1).
+    for (size_t offset = 12; offset + 8 <= size; offset += 8) {
+        if (U32_AT(&data[offset]) != kSourceID) {
+            continue;
+        }
+
+        int32_t seqNo = data[offset + 4];
+        if (seqNo == mLastFIRSeqNo) {
+            // A repetition of a request we've already acted on.
+            return OK;
+        }
+
+        mLastFIRSeqNo = seqNo;
+
+        ALOGV("received full intra request #%d", seqNo);
+
+        notifyRequestIDRFrame();
+        return OK;
+    }
+
+    return OK;
+}
+
+status_t Sender::parseREMB(const uint8_t *data, size_t size) {
+    if (size < 20 || memcmp(&data[12], "REMB", 4)) {
+        hexdump(data, size);
+        return ERROR_UNSUPPORTED;
+    }
+
+    size_t numSSRCs = data[16];
+    if (size < 20 + 4 * numSSRCs) {
+        return ERROR_MALFORMED;
+    }
+
+    bool found = false;
+    for (size_t i = 0; i < numSSRCs; ++i) {
+        if (U32_AT(&data[20 + 4 * i]) == kSourceID) {
+            found = true;
+            break;
+        }
+    }
+
+    if (!found) {
+        return OK;
+    }
+
+    uint32_t exponent = data[17] >> 2;
+    uint64_t mantissa =
+        ((data[17] & 3) << 16) | (data[18] << 8) | data[19];
+
+    int64_t bitrate = (int64_t)(mantissa << exponent);
+
+    ALOGV("receiver estimates a maximum bitrate of %lld bps", bitrate);
+
+    sp<AMessage> notify = mNotify->dup();
+    notify->setInt32("what", kWhatBitrateFeedback);
+    notify->setInt64("bitrate", bitrate);
+    notify->post();
+
+    return OK;
+}
+
 status_t Sender::sendPacket(
         int32_t sessionID, const void *data, size_t size) {
     return mNetSession->sendRequest(sessionID, data, size);
@@ -774,95 +1023,307 @@ void Sender::notifyInitDone() {
     notify->post();
 }
 
+void Sender::notifyRequestIDRFrame() {
+    sp<AMessage> notify = mNotify->dup();
+    notify->setInt32("what", kWhatRequestIDRFrame);
+    notify->post();
+}
+
 void Sender::notifySessionDead() {
     sp<AMessage> notify = mNotify->dup();
     notify->setInt32("what", kWhatSessionDead);
     notify->post();
 }
 
-void Sender::onDrainQueue(const sp<ABuffer> &udpPackets) {
-    static const size_t kFullRTPPacketSize =
-        12 + 188 * kMaxNumTSPacketsPerRTPPacket;
+void Sender::onDrainQueue(
+        const sp<ABuffer> &udpPackets, bool endOfAccessUnit) {
+    int32_t isVideo;
+    if (!udpPackets->meta()->findInt32("isVideo", &isVideo)) {
+        isVideo = false;
+    }
+
+    int32_t carriesVideoPID;
+    if (!udpPackets->meta()->findInt32("carriesVideoPID", &carriesVideoPID)) {
+        carriesVideoPID = false;
+    }
+
+    // Over TCP the transport does its own flow control.
+    bool pace = isVideo && mPacingPercent > 0
+        && mTransportMode == TRANSPORT_UDP;
+
+    // A PCR packet on the video PID sent ahead of paced video would look
+    // like lost video to the sink, its continuity_counter being that of
+    // the last video packet queued. So it, and whatever of its track
+    // follows, goes out behind the video instead.
+    bool holdBack = !isVideo && !mPacedPackets.empty()
+        && (carriesVideoPID || mNumHeldBackPackets > 0);
+
+    int64_t nowUs = ALooper::GetNowUs();
+
+    if (pace && mPacingNewFrame) {
+        int64_t timeUs;
+        CHECK(udpPackets->meta()->findInt64("timeUs", &timeUs));
+
+        if (mLastPacedFrameTimeUs >= 0ll) {
+            int64_t intervalUs = timeUs - mLastPacedFrameTimeUs;
+
+            // Repeated or dropped frames are no measure.
+            if (intervalUs >= 5000ll && intervalUs <= 100000ll) {
+                mFrameIntervalUs = intervalUs;
+            }
+        }
+        mLastPacedFrameTimeUs = timeUs;
+
+        // Whatever is left of the previous frame counts towards this one.
+        mPacingDeadlineUs = nowUs + mFrameIntervalUs * mPacingPercent / 100;
+        mPacingNewFrame = false;
+    }
 
     size_t srcOffset = 0;
     while (srcOffset < udpPackets->size()) {
-        uint8_t *rtp = udpPackets->data() + srcOffset;
-
         size_t rtpPacketSize = udpPackets->size() - srcOffset;
         if (rtpPacketSize > kFullRTPPacketSize) {
             rtpPacketSize = kFullRTPPacketSize;
         }
 
-        int64_t nowUs = ALooper::GetNowUs();
-        mLastNTPTime = GetNowNTP();
+        // Everything from here on refers to the packetizer's buffer.
+        sp<MediaPacket> packet =
+            new MediaPacket(udpPackets, srcOffset, rtpPacketSize);
 
-        // 90kHz time scale
-        uint32_t rtpTime = (nowUs * 9ll) / 100ll;
+        if (pace || holdBack) {
+            queuePacedPacket(packet, nowUs, isVideo);
+        } else {
+            sendRTPPacket(packet, ALooper::GetNowUs());
+        }
+
+        srcOffset += rtpPacketSize;
+    }
+
+    if (pace) {
+        if (endOfAccessUnit) {
+            mPacingNewFrame = true;
+        }
+
+        onPace();
+    }
 
-        rtp[4] = rtpTime >> 24;
-        rtp[5] = (rtpTime >> 16) & 0xff;
-        rtp[6] = (rtpTime >> 8) & 0xff;
-        rtp[7] = rtpTime & 0xff;
+#if 0
+    int64_t timeUs;
+    CHECK(udpPackets->meta()->findInt64("timeUs", &timeUs));
 
-        ++mNumRTPSent;
-        mNumRTPOctetsSent += rtpPacketSize - 12;
+    ALOGI("dTimeUs = %lld us", ALooper::GetNowUs() - timeUs);
+#endif
+}
 
-        mLastRTPTime = rtpTime;
+void Sender::sendRTPPacket(const sp<MediaPacket> &packet, int64_t nowUs) {
+    uint8_t *rtp = packet->data();
 
-        if (mTransportMode == TRANSPORT_TCP_INTERLEAVED) {
-            sp<AMessage> notify = mNotify->dup();
-            notify->setInt32("what", kWhatBinaryData);
+    rtp[2] = (mRTPSeqNo >> 8) & 0xff;
+    rtp[3] = mRTPSeqNo & 0xff;
+    ++mRTPSeqNo;
 
-            sp<ABuffer> data = new ABuffer(rtpPacketSize);
-            memcpy(data->data(), rtp, rtpPacketSize);
+    // 90kHz time scale
+    uint32_t rtpTime = (nowUs * 9ll) / 100ll;
 
-            notify->setInt32("channel", mRTPChannel);
-            notify->setBuffer("data", data);
-            notify->post();
-        } else {
-            sendPacket(mRTPSessionID, rtp, rtpPacketSize);
+    rtp[4] = rtpTime >> 24;
+    rtp[5] = (rtpTime >> 16) & 0xff;
+    rtp[6] = (rtpTime >> 8) & 0xff;
+    rtp[7] = rtpTime & 0xff;
+
+    ++mNumRTPSent;
+    mNumRTPOctetsSent += packet->size() - 12;
+
+#if ENABLE_RETRANSMISSION
+    // Parse the header before the network thread gets to rewrite the
+    // RTP time.
+    addToHistory(packet, nowUs);
+#endif
+
+    if (mTransportMode == TRANSPORT_TCP_INTERLEAVED) {
+        sp<AMessage> notify = mNotify->dup();
+        notify->setInt32("what", kWhatBinaryData);
+        notify->setInt32("channel", mRTPChannel);
+        notify->setBuffer("data", packet);
+        notify->post();
+    } else {
+        mNetSession->sendDatagram(mRTPSessionID, packet);
 
 #if TRACK_BANDWIDTH
-            mTotalBytesSent += rtpPacketSize->size();
-            int64_t delayUs = ALooper::GetNowUs() - mFirstPacketTimeUs;
+        mTotalBytesSent += packet->size();
+        int64_t delayUs = ALooper::GetNowUs() - mFirstPacketTimeUs;
 
-            if (delayUs > 0ll) {
-                ALOGI("approx. net bandwidth used: %.2f Mbit/sec",
-                        mTotalBytesSent * 8.0 / delayUs);
-            }
+        if (delayUs > 0ll) {
+            ALOGI("approx. net bandwidth used: %.2f Mbit/sec",
+                    mTotalBytesSent * 8.0 / delayUs);
+        }
 #endif
+    }
+}
+
+void Sender::queuePacedPacket(
+        const sp<MediaPacket> &packet, int64_t nowUs, bool isVideo) {
+    if (mPacedPackets.empty() && mNextPacedSendTimeUs < nowUs) {
+        mNextPacedSendTimeUs = nowUs;
+    }
+
+    PacedPacket paced;
+    paced.mPacket = packet;
+    paced.mQueuedTimeUs = nowUs;
+    paced.mIsVideo = isVideo;
+    mPacedPackets.push_back(paced);
+
+    mPacedBytes += packet->size();
+
+    if (!isVideo) {
+        ++mNumHeldBackPackets;
+    }
+}
+
+void Sender::schedulePace(int64_t delayUs) {
+    if (mPacePending) {
+        return;
+    }
+
+    mPacePending = true;
+    (new AMessage(kWhatPace, id()))->post(delayUs);
+}
+
+void Sender::onPace() {
+    int64_t nowUs = ALooper::GetNowUs();
+
+    // Don't make up for time lost to the looper in one go.
+    if (mNextPacedSendTimeUs < nowUs - kMaxPacingLagUs) {
+        mNextPacedSendTimeUs = nowUs - kMaxPacingLagUs;
+    }
+
+    while (!mPacedPackets.empty()) {
+        if (mNextPacedSendTimeUs > nowUs) {
+            schedulePace(mNextPacedSendTimeUs - nowUs);
+            break;
         }
 
-#if ENABLE_RETRANSMISSION
-        addToHistory(rtp, rtpPacketSize);
-#endif
+        List<PacedPacket>::iterator it = mPacedPackets.begin();
+        sp<MediaPacket> packet = it->mPacket;
+        int64_t queuedTimeUs = it->mQueuedTimeUs;
+        if (!it->mIsVideo) {
+            --mNumHeldBackPackets;
+        }
+        mPacedPackets.erase(it);
 
-        srcOffset += rtpPacketSize;
+        // Fast enough to get everything queued out by the deadline, once
+        // it has passed there's no point in holding anything back.
+        int64_t intervalUs = 0ll;
+        if (mPacingDeadlineUs > nowUs) {
+            int64_t rate =
+                mPacedBytes * 8000000ll / (mPacingDeadlineUs - nowUs);
+
+            if (rate < mPacingRate) {
+                rate = mPacingRate;
+            }
+
+            intervalUs = packet->size() * 8000000ll / rate;
+        }
+
+        mPacedBytes -= packet->size();
+        mNextPacedSendTimeUs += intervalUs;
+
+        sendRTPPacket(packet, nowUs);
+
+        int64_t delayUs = nowUs - queuedTimeUs;
+
+        ++mNumPacketsPaced;
+        mTotalPacingDelayUs += delayUs;
+        if (delayUs > mMaxPacingDelayUs) {
+            mMaxPacingDelayUs = delayUs;
+        }
     }
 
-#if 0
-    int64_t timeUs;
-    CHECK(udpPackets->meta()->findInt64("timeUs", &timeUs));
+    reportPacingDelay(nowUs);
+}
 
-    ALOGI("dTimeUs = %lld us", ALooper::GetNowUs() - timeUs);
-#endif
+void Sender::reportPacingDelay(int64_t nowUs) {
+    if (mLastPacingReportUs < 0ll) {
+        mLastPacingReportUs = nowUs;
+        return;
+    }
+
+    if (nowUs - mLastPacingReportUs < kPacingReportIntervalUs
+            || mNumPacketsPaced == 0) {
+        return;
+    }
+
+    ALOGI("paced %d packets, queue delay avg %.2f ms, max %.2f ms, "
+          "frame interval %.2f ms",
+          mNumPacketsPaced,
+          mTotalPacingDelayUs / 1E3 / mNumPacketsPaced,
+          mMaxPacingDelayUs / 1E3,
+          mFrameIntervalUs / 1E3);
+
+    mNumPacketsPaced = 0;
+    mTotalPacingDelayUs = 0ll;
+    mMaxPacingDelayUs = 0ll;
+    mLastPacingReportUs = nowUs;
 }
 
 #if ENABLE_RETRANSMISSION
-void Sender::addToHistory(const uint8_t *rtp, size_t rtpPacketSize) {
-    sp<ABuffer> packet = new ABuffer(rtpPacketSize);
-    memcpy(packet->data(), rtp, rtpPacketSize);
+void Sender::addToHistory(const sp<MediaPacket> &packet, int64_t nowUs) {
+    const uint8_t *rtp = packet->data();
+
+    packet->mSeqNo = U16_AT(&rtp[2]);
+    packet->mSSRC = U32_AT(&rtp[8]);
+    packet->mRTPTime = U32_AT(&rtp[4]);
+    packet->mPayloadType = rtp[1] & 0x7f;
+    packet->mMarker = (rtp[1] & 0x80) != 0;
+    packet->mPayloadOffset = 12;
+
+    if (mHistoryLength > 0
+            && packet->mSeqNo != (uint16_t)(mHistoryLastSeqNo + 1)) {
+        // Can't happen, the ring relies on consecutive sequence numbers.
+        while (mHistoryLength > 0) {
+            dropOldestFromHistory();
+        }
+    }
 
-    unsigned rtpSeqNo = U16_AT(&rtp[2]);
-    packet->setInt32Data(rtpSeqNo);
+    while (mHistoryLength > 0) {
+        uint16_t oldestSeqNo = mHistoryLastSeqNo - (mHistoryLength - 1);
 
-    mHistory.push_back(packet);
-    ++mHistoryLength;
+        const HistoryEntry &oldest =
+            mHistory.itemAt(oldestSeqNo & (kHistoryRingSize - 1));
+
+        if (mHistoryLength < kHistoryRingSize
+                && nowUs - oldest.mSentTimeUs <= mHistoryDurationUs
+                && (mMaxHistoryBytes == 0
+                    || mHistoryBytes + packet->size() <= mMaxHistoryBytes)) {
+            break;
+        }
 
-    if (mHistoryLength > kMaxHistoryLength) {
-        mHistory.erase(mHistory.begin());
-        --mHistoryLength;
+        dropOldestFromHistory();
     }
+
+    HistoryEntry *entry =
+        &mHistory.editItemAt(packet->mSeqNo & (kHistoryRingSize - 1));
+
+    entry->mPacket = packet;
+    entry->mSentTimeUs = nowUs;
+    entry->mLastRetransmissionTimeUs = -1ll;
+
+    mHistoryLastSeqNo = packet->mSeqNo;
+    ++mHistoryLength;
+    mHistoryBytes += packet->size();
+}
+
+void Sender::dropOldestFromHistory() {
+    CHECK_GT(mHistoryLength, 0u);
+
+    uint16_t oldestSeqNo = mHistoryLastSeqNo - (mHistoryLength - 1);
+
+    HistoryEntry *entry =
+        &mHistory.editItemAt(oldestSeqNo & (kHistoryRingSize - 1));
+
+    mHistoryBytes -= entry->mPacket->size();
+    entry->mPacket.clear();
+
+    --mHistoryLength;
 }
 #endif
 
@@ -19,6 +19,8 @@
 #define SENDER_H_
 
 #include <media/stagefright/foundation/AHandler.h>
+#include <utils/List.h>
+#include <utils/Vector.h>
 
 namespace android {
 
@@ -36,6 +38,7 @@ namespace android {
 
 struct ABuffer;
 struct ANetworkSession;
+struct MediaPacket;
 
 struct Sender : public AHandler {
     Sender(const sp<ANetworkSession> &netSession, const sp<AMessage> &notify);
@@ -44,6 +47,8 @@ struct Sender : public AHandler {
         kWhatInitDone,
         kWhatSessionDead,
         kWhatBinaryData,
+        kWhatBitrateFeedback,
+        kWhatRequestIDRFrame,
     };
 
     enum TransportMode {
@@ -59,7 +64,16 @@ struct Sender : public AHandler {
 
     int32_t getRTPPort() const;
 
-    void queuePackets(int64_t timeUs, const sp<ABuffer> &tsPackets);
+    // "tsPackets" must have been packetized with
+    // TSPacketizer::EMIT_RTP_SLOTS, it is sent without being copied. An
+    // access unit may be queued in several pieces, the last one has
+    // "endOfAccessUnit" set. Video is marked by "isVideo" in the buffer's
+    // meta data, only video is paced. Packets marked "carriesVideoPID"
+    // instead, see TSPacketizer::carriesVideoPID(), wait for the paced
+    // video queued before them.
+    void queuePackets(
+            int64_t timeUs, const sp<ABuffer> &tsPackets,
+            bool endOfAccessUnit = true);
     void scheduleSendSR();
 
 protected:
@@ -69,6 +83,7 @@ protected:
 private:
     enum {
         kWhatDrainQueue,
+        kWhatPace,
         kWhatSendSR,
         kWhatRTPNotify,
         kWhatRTCPNotify,
@@ -81,12 +96,39 @@ private:
     static const int64_t kSendSRIntervalUs = 10000000ll;
 
     static const uint32_t kSourceID = 0xdeadbeef;
-    static const size_t kMaxHistoryLength = 128;
+
+    // Sent packets are kept around for retransmission this long unless
+    // media.wfd.retransmission-history-ms says otherwise, and no more
+    // bytes of them than media.wfd.retransmission-history-kb if set.
+    static const int64_t kDefaultHistoryDurationUs = 500000ll;
+
+    // Must be a power of 2, enough for the duration above at 50 Mbit/s.
+    static const size_t kHistoryRingSize = 4096;
+
+    // Stands in for the round trip time until the receiver reports one.
+    static const int64_t kDefaultRTTUs = 20000ll;
 
 #if ENABLE_RETRANSMISSION && RETRANSMISSION_ACCORDING_TO_RFC_XXXX
     static const size_t kRetransmissionPortOffset = 120;
 #endif
 
+    // Over UDP the packets of a video frame are spread across this
+    // percentage of the frame interval rather than sent in one burst,
+    // at no less than the pacing rate. Overridden by
+    // media.wfd.pacing-percent (0 disables pacing) and
+    // media.wfd.pacing-rate-kbps.
+    static const uint32_t kDefaultPacingPercent = 50;
+    static const int64_t kDefaultPacingRate = 20000000ll;
+
+    // Until two frames have been seen.
+    static const int64_t kDefaultFrameIntervalUs = 33333ll;
+
+    // The looper's timing is coarse, a pacer that fell behind may catch
+    // up by this much in a burst.
+    static const int64_t kMaxPacingLagUs = 2000ll;
+
+    static const int64_t kPacingReportIntervalUs = 5000000ll;
+
     sp<ANetworkSession> mNetSession;
     sp<AMessage> mNotify;
 
@@ -120,19 +162,75 @@ private:
     uint32_t mRTPRetransmissionSeqNo;
 #endif
 
-    uint64_t mLastNTPTime;
-    uint32_t mLastRTPTime;
     uint32_t mNumRTPSent;
     uint32_t mNumRTPOctetsSent;
     uint32_t mNumSRsSent;
 
     bool mSendSRPending;
 
+    // Round trip time and interarrival jitter as reported by the receiver,
+    // -1 until the first receiver report referring to one of our SRs.
+    int64_t mRTTUs;
+    int64_t mSmoothedRTTUs;
+    int64_t mJitterUs;
+
+    // Command sequence number of the last full intra request honoured,
+    // -1 if none.
+    int32_t mLastFIRSeqNo;
+
 #if ENABLE_RETRANSMISSION
-    List<sp<ABuffer> > mHistory;
+    struct HistoryEntry {
+        sp<MediaPacket> mPacket;
+        int64_t mSentTimeUs;
+
+        // -1 if it hasn't been retransmitted yet.
+        int64_t mLastRetransmissionTimeUs;
+    };
+
+    // Sent packets by mSeqNo & (kHistoryRingSize - 1), the mHistoryLength
+    // ones up to and including mHistoryLastSeqNo are valid.
+    Vector<HistoryEntry> mHistory;
     size_t mHistoryLength;
+    uint16_t mHistoryLastSeqNo;
+    size_t mHistoryBytes;
+
+    int64_t mHistoryDurationUs;
+    size_t mMaxHistoryBytes;  // 0 for no limit
 #endif
 
+    struct PacedPacket {
+        sp<MediaPacket> mPacket;
+        int64_t mQueuedTimeUs;
+        bool mIsVideo;
+    };
+
+    uint32_t mPacingPercent;  // 0 if not pacing
+    int64_t mPacingRate;
+
+    List<PacedPacket> mPacedPackets;
+    size_t mPacedBytes;
+
+    // Those of mPacedPackets held back behind video rather than paced,
+    // packets of their tracks queued later mustn't overtake them.
+    size_t mNumHeldBackPackets;
+    bool mPacePending;
+
+    // Time the queued packets should all have been sent by, and the
+    // earliest the next one may go out.
+    int64_t mPacingDeadlineUs;
+    int64_t mNextPacedSendTimeUs;
+
+    // The next video packets queued start a new frame.
+    bool mPacingNewFrame;
+    int64_t mLastPacedFrameTimeUs;
+    int64_t mFrameIntervalUs;
+
+    // Queue delay of the packets paced since mLastPacingReportUs.
+    size_t mNumPacketsPaced;
+    int64_t mTotalPacingDelayUs;
+    int64_t mMaxPacingDelayUs;
+    int64_t mLastPacingReportUs;
+
 #if TRACK_BANDWIDTH
     int64_t mFirstPacketTimeUs;
     uint64_t mTotalBytesSent;
@@ -149,17 +247,35 @@ private:
 
 #if ENABLE_RETRANSMISSION
     status_t parseTSFB(const uint8_t *data, size_t size);
-    void addToHistory(const uint8_t *rtp, size_t rtpPacketSize);
+    void addToHistory(const sp<MediaPacket> &packet, int64_t nowUs);
+    void dropOldestFromHistory();
+
+    // Returns false if the packet is no longer available.
+    bool retransmit(uint16_t seqNo, int64_t nowUs);
 #endif
 
     status_t parseRTCP(const sp<ABuffer> &buffer);
+    status_t parseRR(const uint8_t *data, size_t size);
+    status_t parsePSFB(const uint8_t *data, size_t size);
+    status_t parseFIR(const uint8_t *data, size_t size);
+    status_t parseREMB(const uint8_t *data, size_t size);
+    void notifyRequestIDRFrame();
 
     status_t sendPacket(int32_t sessionID, const void *data, size_t size);
 
     void notifyInitDone();
     void notifySessionDead();
 
-    void onDrainQueue(const sp<ABuffer> &udpPackets);
+    void onDrainQueue(const sp<ABuffer> &udpPackets, bool endOfAccessUnit);
+    void queuePacedPacket(
+            const sp<MediaPacket> &packet, int64_t nowUs, bool isVideo);
+    void schedulePace(int64_t delayUs);
+    void onPace();
+    void reportPacingDelay(int64_t nowUs);
+
+    // Assigns the sequence number and RTP time and hands the packet to
+    // the network.
+    void sendRTPPacket(const sp<MediaPacket> &packet, int64_t nowUs);
 
     DISALLOW_EVIL_CONSTRUCTORS(Sender);
 };
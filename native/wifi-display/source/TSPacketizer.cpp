@@ -23,15 +23,95 @@
 
 #include <media/stagefright/foundation/ABuffer.h>
 #include <media/stagefright/foundation/ADebug.h>
+#include <media/stagefright/foundation/ALooper.h>
 #include <media/stagefright/foundation/AMessage.h>
 #include <media/stagefright/foundation/hexdump.h>
 #include <media/stagefright/MediaDefs.h>
 #include <media/stagefright/MediaErrors.h>
+#include <utils/threads.h>
 
 #include <arpa/inet.h>
+#include <stdlib.h>
 
 namespace android {
 
+// Up to and including the PTS.
+static const size_t kPESHeaderSize = 14;
+
+// With enableVideoPCR() the PCR runs this far behind the PTS of the access
+// unit it's sent with, the time the sink has to buffer and decode it
+// before presentation. Covers a frame interval plus encoder and network
+// delay.
+static const int64_t kPCRToPTSOffsetUs = 100000ll;
+
+// PCR values wrap around with the 33 bit program_clock_reference_base.
+static const int64_t kPCRWrap = (1ll << 33) * 300ll;
+
+// Not among the MEDIA_MIMETYPE_*s of this release.
+const char *const TSPacketizer::kMIMETypeVideoHEVC = "video/hevc";
+
+static bool IsHEVCIRAP(const sp<ABuffer> &accessUnit) {
+    const uint8_t *data = accessUnit->data();
+    size_t size = accessUnit->size();
+
+    const uint8_t *nalStart;
+    size_t nalSize;
+    while (getNextNALUnit(&data, &size, &nalStart, &nalSize, true) == OK) {
+        if (nalSize == 0) {
+            continue;
+        }
+
+        // BLA, IDR and CRA pictures and the reserved IRAP types.
+        unsigned nalType = (nalStart[0] >> 1) & 0x3f;
+        if (nalType >= 16 && nalType <= 23) {
+            return true;
+        }
+    }
+
+    return false;
+}
+
+// Extracts the 12 bytes of general profile, tier and level information at
+// the start of the SPS in "csd", as laid out in the HEVC video descriptor.
+static bool GetHEVCProfileTierLevel(
+        const sp<ABuffer> &csd, uint8_t *profileTierLevel) {
+    const uint8_t *data = csd->data();
+    size_t size = csd->size();
+
+    const uint8_t *nalStart;
+    size_t nalSize;
+    while (getNextNALUnit(&data, &size, &nalStart, &nalSize, true) == OK) {
+        if (nalSize == 0 || ((nalStart[0] >> 1) & 0x3f) != 33) {
+            continue;
+        }
+
+        // Skip the 2 byte NAL unit header and sps_video_parameter_set_id,
+        // sps_max_sub_layers_minus1 and sps_temporal_id_nesting_flag,
+        // dropping emulation prevention bytes.
+        size_t numRBSPBytes = 0;
+        size_t numZeroes = 0;
+        for (size_t i = 0; i < nalSize && numRBSPBytes < 3 + 12; ++i) {
+            uint8_t x = nalStart[i];
+
+            if (numZeroes >= 2 && x == 0x03) {
+                numZeroes = 0;
+                continue;
+            }
+
+            numZeroes = (x == 0x00) ? numZeroes + 1 : 0;
+
+            if (numRBSPBytes >= 3) {
+                profileTierLevel[numRBSPBytes - 3] = x;
+            }
+            ++numRBSPBytes;
+        }
+
+        return numRBSPBytes == 3 + 12;
+    }
+
+    return false;
+}
+
 struct TSPacketizer::Track : public RefBase {
     Track(const sp<AMessage> &format,
           unsigned PID, unsigned streamType, unsigned streamID);
@@ -43,20 +123,49 @@ struct TSPacketizer::Track : public RefBase {
     // Returns the previous value.
     unsigned incrementContinuityCounter();
 
+    // Same as calling incrementContinuityCounter() "n" times, returns the
+    // value before the first.
+    unsigned advanceContinuityCounter(size_t n);
+
+    // The value of the last packet carrying payload, for packets that
+    // don't increment it.
+    unsigned lastContinuityCounter() const;
+
     bool isAudio() const;
     bool isVideo() const;
 
     bool isH264() const;
+    bool isHEVC() const;
     bool isAAC() const;
     bool lacksADTSHeader() const;
     bool isPCMAudio() const;
 
+    // An IDR frame for H.264, an IRAP picture for HEVC.
+    bool isRandomAccessPoint(const sp<ABuffer> &accessUnit) const;
+
     sp<ABuffer> prependCSD(const sp<ABuffer> &accessUnit) const;
-    sp<ABuffer> prependADTSHeader(const sp<ABuffer> &accessUnit) const;
+
+    // Adds the codec specific data to the fragments to go in front of an
+    // access unit.
+    void appendCSD(Vector<sp<ABuffer> > *fragments) const;
+
+    // The ADTS header to go in front of an access unit of the given size,
+    // valid until the next call.
+    sp<ABuffer> ADTSHeader(size_t accessUnitSize);
 
     size_t countDescriptors() const;
     sp<ABuffer> descriptorAt(size_t index) const;
 
+    // The 4 byte TS packet header for this track's PID with a
+    // continuity_counter of 0, for the first packet of a PES packet or
+    // the ones after it, with or without an adaptation field. Only valid
+    // once finalized.
+    const uint8_t *TSHeader(bool payloadUnitStart, bool adaptationField) const;
+
+    // PES header up to and including the PTS, a PES_packet_length and PTS
+    // of 0, no PES_private_data and no stuffing.
+    const uint8_t *PESHeader() const;
+
     void finalize();
 
 protected:
@@ -76,8 +185,16 @@ private:
     Vector<sp<ABuffer> > mDescriptors;
 
     bool mAudioLacksATDSHeaders;
+    sp<ABuffer> mADTSHeader;
+
+    // See TSHeader() and PESHeader().
+    uint8_t mTSHeaders[4][4];
+    uint8_t mPESHeader[kPESHeaderSize];
+
     bool mFinalized;
 
+    void buildHeaders();
+
     DISALLOW_EVIL_CONSTRUCTORS(Track);
 };
 
@@ -94,6 +211,7 @@ TSPacketizer::Track::Track(
     CHECK(format->findString("mime", &mMIME));
 
     if (!strcasecmp(mMIME.c_str(), MEDIA_MIMETYPE_VIDEO_AVC)
+            || !strcasecmp(mMIME.c_str(), kMIMETypeVideoHEVC)
             || !strcasecmp(mMIME.c_str(), MEDIA_MIMETYPE_AUDIO_AAC)) {
         for (size_t i = 0;; ++i) {
             sp<ABuffer> csd;
@@ -138,6 +256,18 @@ unsigned TSPacketizer::Track::incrementContinuityCounter() {
     return prevCounter;
 }
 
+unsigned TSPacketizer::Track::advanceContinuityCounter(size_t n) {
+    unsigned prevCounter = mContinuityCounter;
+
+    mContinuityCounter = (mContinuityCounter + n) % 16;
+
+    return prevCounter;
+}
+
+unsigned TSPacketizer::Track::lastContinuityCounter() const {
+    return (mContinuityCounter + 15) % 16;
+}
+
 bool TSPacketizer::Track::isAudio() const {
     return !strncasecmp("audio/", mMIME.c_str(), 6);
 }
@@ -150,6 +280,10 @@ bool TSPacketizer::Track::isH264() const {
     return !strcasecmp(mMIME.c_str(), MEDIA_MIMETYPE_VIDEO_AVC);
 }
 
+bool TSPacketizer::Track::isHEVC() const {
+    return !strcasecmp(mMIME.c_str(), kMIMETypeVideoHEVC);
+}
+
 bool TSPacketizer::Track::isAAC() const {
     return !strcasecmp(mMIME.c_str(), MEDIA_MIMETYPE_AUDIO_AAC);
 }
@@ -162,6 +296,17 @@ bool TSPacketizer::Track::lacksADTSHeader() const {
     return mAudioLacksATDSHeaders;
 }
 
+bool TSPacketizer::Track::isRandomAccessPoint(
+        const sp<ABuffer> &accessUnit) const {
+    if (isH264()) {
+        return IsIDR(accessUnit);
+    } else if (isHEVC()) {
+        return IsHEVCIRAP(accessUnit);
+    }
+
+    return false;
+}
+
 sp<ABuffer> TSPacketizer::Track::prependCSD(
         const sp<ABuffer> &accessUnit) const {
     size_t size = 0;
@@ -183,15 +328,22 @@ sp<ABuffer> TSPacketizer::Track::prependCSD(
     return dup;
 }
 
-sp<ABuffer> TSPacketizer::Track::prependADTSHeader(
-        const sp<ABuffer> &accessUnit) const {
+void TSPacketizer::Track::appendCSD(Vector<sp<ABuffer> > *fragments) const {
+    for (size_t i = 0; i < mCSD.size(); ++i) {
+        fragments->push_back(mCSD.itemAt(i));
+    }
+}
+
+sp<ABuffer> TSPacketizer::Track::ADTSHeader(size_t accessUnitSize) {
     CHECK_EQ(mCSD.size(), 1u);
 
     const uint8_t *codec_specific_data = mCSD.itemAt(0)->data();
 
-    const uint32_t aac_frame_length = accessUnit->size() + 7;
+    const uint32_t aac_frame_length = accessUnitSize + 7;
 
-    sp<ABuffer> dup = new ABuffer(aac_frame_length);
+    if (mADTSHeader == NULL) {
+        mADTSHeader = new ABuffer(7);
+    }
 
     unsigned profile = (codec_specific_data[0] >> 3) - 1;
 
@@ -202,7 +354,7 @@ sp<ABuffer> TSPacketizer::Track::prependADTSHeader(
     unsigned channel_configuration =
         (codec_specific_data[1] >> 3) & 0x0f;
 
-    uint8_t *ptr = dup->data();
+    uint8_t *ptr = mADTSHeader->data();
 
     *ptr++ = 0xff;
     *ptr++ = 0xf1;  // b11110001, ID=0, layer=0, protection_absent=1
@@ -222,9 +374,7 @@ sp<ABuffer> TSPacketizer::Track::prependADTSHeader(
     // adts_buffer_fullness=0, number_of_raw_data_blocks_in_frame=0
     *ptr++ = 0;
 
-    memcpy(ptr, accessUnit->data(), accessUnit->size());
-
-    return dup;
+    return mADTSHeader;
 }
 
 size_t TSPacketizer::Track::countDescriptors() const {
@@ -236,11 +386,45 @@ sp<ABuffer> TSPacketizer::Track::descriptorAt(size_t index) const {
     return mDescriptors.itemAt(index);
 }
 
+const uint8_t *TSPacketizer::Track::TSHeader(
+        bool payloadUnitStart, bool adaptationField) const {
+    return mTSHeaders[(payloadUnitStart ? 2 : 0) | (adaptationField ? 1 : 0)];
+}
+
+const uint8_t *TSPacketizer::Track::PESHeader() const {
+    return mPESHeader;
+}
+
+void TSPacketizer::Track::buildHeaders() {
+    // See startAccessUnit() for the layout of both.
+    for (size_t i = 0; i < 4; ++i) {
+        bool payloadUnitStart = (i & 2) != 0;
+        bool adaptationField = (i & 1) != 0;
+
+        uint8_t *header = mTSHeaders[i];
+        header[0] = 0x47;
+        header[1] = (payloadUnitStart ? 0x40 : 0x00) | (mPID >> 8);
+        header[2] = mPID & 0xff;
+        header[3] = adaptationField ? 0x30 : 0x10;
+    }
+
+    // PES_packet_length = 0, PTS = 0 with the marker bits set.
+    static const uint8_t kPESHeader[kPESHeaderSize] = {
+        0x00, 0x00, 0x01, 0x00, 0x00, 0x00, 0x84, 0x80, 0x05,
+        0x21, 0x00, 0x01, 0x00, 0x01,
+    };
+
+    memcpy(mPESHeader, kPESHeader, sizeof(kPESHeader));
+    mPESHeader[3] = mStreamID;
+}
+
 void TSPacketizer::Track::finalize() {
     if (mFinalized) {
         return;
     }
 
+    buildHeaders();
+
     if (isH264()) {
         {
             // AVC video descriptor (40)
@@ -285,6 +469,33 @@ void TSPacketizer::Track::finalize() {
 
             mDescriptors.push_back(descriptor);
         }
+    } else if (isHEVC()) {
+        // HEVC video descriptor (56)
+
+        uint8_t profileTierLevel[12];
+        CHECK_EQ(mCSD.size(), 1u);
+        CHECK(GetHEVCProfileTierLevel(mCSD.itemAt(0), profileTierLevel));
+
+        sp<ABuffer> descriptor = new ABuffer(15);
+        uint8_t *data = descriptor->data();
+        data[0] = 56;  // descriptor_tag
+        data[1] = 13;  // descriptor_length
+
+        // profile_space, tier_flag, profile_idc,
+        // profile_compatibility_indication, progressive_source_flag,
+        // interlaced_source_flag, non_packed_constraint_flag,
+        // frame_only_constraint_flag, copied_44bits, level_idc
+        memcpy(&data[2], profileTierLevel, sizeof(profileTierLevel));
+
+        // temporal_layer_subset_flag = 0
+        // HEVC_still_present_flag = 0
+        // HEVC_24hr_picture_present_flag = 0
+        // sub_pic_hrd_params_not_present_flag = 1
+        // reserved = 11b
+        // HDR_WCG_idc = 11b (no indication)
+        data[14] = 0x1f;
+
+        mDescriptors.push_back(descriptor);
     } else if (isPCMAudio()) {
         // LPCM audio stream descriptor (0x83)
 
@@ -338,13 +549,195 @@ void TSPacketizer::Track::finalize() {
 
 ////////////////////////////////////////////////////////////////////////////////
 
+struct TSPacketizer::Worker : public Thread {
+    Worker(TSPacketizer *packetizer);
+
+protected:
+    virtual ~Worker();
+
+private:
+    TSPacketizer *mPacketizer;
+
+    virtual bool threadLoop();
+
+    DISALLOW_EVIL_CONSTRUCTORS(Worker);
+};
+
+TSPacketizer::Worker::Worker(TSPacketizer *packetizer)
+    : mPacketizer(packetizer) {
+}
+
+TSPacketizer::Worker::~Worker() {
+}
+
+bool TSPacketizer::Worker::threadLoop() {
+    return mPacketizer->workerLoop();
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+// Free blocks by size in full RTP packets, kept out of the way of whoever
+// holds on to the buffers made from them, i.e. the sender, its
+// retransmission history and the network thread.
+struct TSPacketizer::BufferPool : public RefBase {
+    BufferPool();
+
+    // Returns NULL if "size" is too large to be pooled.
+    sp<ABuffer> acquire(size_t size);
+
+protected:
+    virtual ~BufferPool();
+
+private:
+    struct PooledBuffer;
+
+    enum {
+        kBlockUnitSize = kRTPHeaderSize + 188 * kNumTSPacketsPerRTPPacket,
+    };
+
+    Mutex mLock;
+    Vector<void *> mFreeBlocks[kMaxNumRTPPacketsPerPooledBuffer];
+    size_t mFreeBytes;
+
+    void release(void *block, size_t numUnits);
+
+    DISALLOW_EVIL_CONSTRUCTORS(BufferPool);
+};
+
+struct TSPacketizer::BufferPool::PooledBuffer : public ABuffer {
+    PooledBuffer(
+            const sp<BufferPool> &pool,
+            void *block, size_t numUnits, size_t size)
+        : ABuffer(block, numUnits * kBlockUnitSize),
+          mPool(pool),
+          mBlock(block),
+          mNumUnits(numUnits) {
+        setRange(0, size);
+    }
+
+protected:
+    virtual ~PooledBuffer() {
+        mPool->release(mBlock, mNumUnits);
+    }
+
+private:
+    sp<BufferPool> mPool;
+    void *mBlock;
+    size_t mNumUnits;
+
+    DISALLOW_EVIL_CONSTRUCTORS(PooledBuffer);
+};
+
+TSPacketizer::BufferPool::BufferPool()
+    : mFreeBytes(0) {
+}
+
+TSPacketizer::BufferPool::~BufferPool() {
+    for (size_t i = 0; i < kMaxNumRTPPacketsPerPooledBuffer; ++i) {
+        for (size_t j = 0; j < mFreeBlocks[i].size(); ++j) {
+            free(mFreeBlocks[i].itemAt(j));
+        }
+    }
+}
+
+sp<ABuffer> TSPacketizer::BufferPool::acquire(size_t size) {
+    size_t numUnits = (size + kBlockUnitSize - 1) / kBlockUnitSize;
+
+    if (numUnits == 0 || numUnits > kMaxNumRTPPacketsPerPooledBuffer) {
+        return NULL;
+    }
+
+    void *block = NULL;
+
+    {
+        Mutex::Autolock autoLock(mLock);
+
+        Vector<void *> *freeBlocks = &mFreeBlocks[numUnits - 1];
+        if (!freeBlocks->isEmpty()) {
+            block = freeBlocks->itemAt(freeBlocks->size() - 1);
+            freeBlocks->removeAt(freeBlocks->size() - 1);
+
+            mFreeBytes -= numUnits * kBlockUnitSize;
+        }
+    }
+
+    if (block == NULL) {
+        block = malloc(numUnits * kBlockUnitSize);
+        CHECK(block != NULL);
+    }
+
+    return new PooledBuffer(this, block, numUnits, size);
+}
+
+void TSPacketizer::BufferPool::release(void *block, size_t numUnits) {
+    size_t blockSize = numUnits * kBlockUnitSize;
+
+    {
+        Mutex::Autolock autoLock(mLock);
+
+        if (mFreeBytes + blockSize <= kMaxBufferPoolBytes) {
+            mFreeBlocks[numUnits - 1].push_back(block);
+            mFreeBytes += blockSize;
+            return;
+        }
+    }
+
+    free(block);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
 TSPacketizer::TSPacketizer()
     : mPATContinuityCounter(0),
-      mPMTContinuityCounter(0) {
+      mPMTContinuityCounter(0),
+      mTablePacketsValid(false),
+      mVideoTrackIndex(-1),
+      mVideoPCRIntervalUs(-1ll),
+      mLastPCRTimeUs(-1ll),
+      mPayloadSize(0),
+      mPayloadOffset(0),
+      mRTPSlots(false),
+      mCarriesVideoPID(false),
+      mNumHeadPackets(0),
+      mNextHeadPacket(0),
+      mNumPacketsLeft(0),
+      mBufferPool(new BufferPool),
+      mMinParallelPayloadSize(0),
+      mNumRangesInProgress(0),
+      mWorkersExiting(false) {
     initCrcTable();
 }
 
 TSPacketizer::~TSPacketizer() {
+    {
+        Mutex::Autolock autoLock(mWorkLock);
+        mWorkersExiting = true;
+        mWorkCondition.broadcast();
+    }
+
+    for (size_t i = 0; i < mWorkers.size(); ++i) {
+        mWorkers.itemAt(i)->requestExitAndWait();
+    }
+}
+
+void TSPacketizer::enableParallelPacketization(
+        size_t numThreads, size_t minAccessUnitSize) {
+    CHECK(mWorkers.isEmpty());
+    CHECK_GE(numThreads, 2u);
+
+    mMinParallelPayloadSize = minAccessUnitSize;
+
+    for (size_t i = 1; i < numThreads; ++i) {
+        sp<Worker> worker = new Worker(this);
+
+        status_t err = worker->run("TSPacketizer", ANDROID_PRIORITY_NORMAL);
+        if (err != OK) {
+            ALOGW("unable to start packetizer thread (err %d)", err);
+            break;
+        }
+
+        mWorkers.push_back(worker);
+    }
 }
 
 ssize_t TSPacketizer::addTrack(const sp<AMessage> &format) {
@@ -371,6 +764,10 @@ ssize_t TSPacketizer::addTrack(const sp<AMessage> &format) {
         streamType = 0x1b;
         streamIDStart = 0xe0;
         streamIDStop = 0xef;
+    } else if (!strcasecmp(mime.c_str(), kMIMETypeVideoHEVC)) {
+        streamType = 0x24;
+        streamIDStart = 0xe0;
+        streamIDStop = 0xef;
     } else if (!strcasecmp(mime.c_str(), MEDIA_MIMETYPE_AUDIO_AAC)) {
         streamType = 0x0f;
         streamIDStart = 0xc0;
@@ -404,36 +801,175 @@ ssize_t TSPacketizer::addTrack(const sp<AMessage> &format) {
     }
 
     sp<Track> track = new Track(format, PID, streamType, streamID);
-    return mTracks.add(track);
+
+    // The PMT needs to list the new track.
+    mTablePacketsValid = false;
+
+    ssize_t trackIndex = mTracks.add(track);
+
+    if (isVideo && mVideoTrackIndex < 0) {
+        mVideoTrackIndex = trackIndex;
+    }
+
+    return trackIndex;
 }
 
-status_t TSPacketizer::packetize(
+void TSPacketizer::enableVideoPCR(int64_t intervalUs) {
+    CHECK_GT(intervalUs, 0ll);
+
+    mVideoPCRIntervalUs = intervalUs;
+
+    // The PMT's PCR_PID changes.
+    mTablePacketsValid = false;
+}
+
+bool TSPacketizer::usesVideoPCR() const {
+    return mVideoPCRIntervalUs > 0ll && mVideoTrackIndex >= 0;
+}
+
+// Writes program_clock_reference_base and _extension, returns the end.
+static uint8_t *WritePCR(uint8_t *ptr, uint64_t PCR) {
+    uint64_t PCR_base = PCR / 300;
+    uint32_t PCR_ext = PCR % 300;
+
+    *ptr++ = (PCR_base >> 25) & 0xff;
+    *ptr++ = (PCR_base >> 17) & 0xff;
+    *ptr++ = (PCR_base >> 9) & 0xff;
+    *ptr++ = (PCR_base >> 1) & 0xff;
+    *ptr++ = ((PCR_base & 1) << 7) | 0x7e | ((PCR_ext >> 8) & 1);
+    *ptr++ = (PCR_ext & 0xff);
+
+    return ptr;
+}
+
+// Writes the PES header of the first packet of a PES packet based on the
+// track's template, instantiated for each combination of optional fields.
+template <bool kHasPrivateData, bool kHasStuffing>
+static uint8_t *WritePESHeader(
+        uint8_t *ptr, const uint8_t *PESHeader,
+        size_t PES_packet_length, uint64_t PTS,
+        const uint8_t *PES_private_data, size_t PES_private_data_len,
+        size_t numStuffingBytes) {
+    memcpy(ptr, PESHeader, kPESHeaderSize);
+
+    ptr[4] = PES_packet_length >> 8;
+    ptr[5] = PES_packet_length & 0xff;
+
+    if (kHasPrivateData) {
+        ptr[7] = 0x81;  // PES_extension_flag
+    }
+
+    if (kHasPrivateData || kHasStuffing) {
+        size_t headerLength = 0x05 + numStuffingBytes;
+        if (kHasPrivateData) {
+            headerLength += 1 + PES_private_data_len;
+        }
+
+        ptr[8] = headerLength;
+    }
+
+    ptr[9] = 0x20 | (((PTS >> 30) & 7) << 1) | 1;
+    ptr[10] = (PTS >> 22) & 0xff;
+    ptr[11] = (((PTS >> 15) & 0x7f) << 1) | 1;
+    ptr[12] = (PTS >> 7) & 0xff;
+    ptr[13] = ((PTS & 0x7f) << 1) | 1;
+
+    ptr += kPESHeaderSize;
+
+    if (kHasPrivateData) {
+        *ptr++ = 0x8e;  // PES_private_data_flag, reserved.
+        memcpy(ptr, PES_private_data, PES_private_data_len);
+        ptr += PES_private_data_len;
+    }
+
+    if (kHasStuffing) {
+        memset(ptr, 0xff, numStuffingBytes);
+        ptr += numStuffingBytes;
+    }
+
+    return ptr;
+}
+
+status_t TSPacketizer::startAccessUnit(
         size_t trackIndex,
-        const sp<ABuffer> &_accessUnit,
-        sp<ABuffer> *packets,
+        const sp<ABuffer> &accessUnit,
         uint32_t flags,
         const uint8_t *PES_private_data, size_t PES_private_data_len,
         size_t numStuffingBytes) {
-    sp<ABuffer> accessUnit = _accessUnit;
+    CHECK(mFragments.isEmpty());
 
     int64_t timeUs;
     CHECK(accessUnit->meta()->findInt64("timeUs", &timeUs));
 
-    packets->clear();
-
     if (trackIndex >= mTracks.size()) {
         return -ERANGE;
     }
 
     const sp<Track> &track = mTracks.itemAt(trackIndex);
 
-    if (track->isH264() && (flags & PREPEND_SPS_PPS_TO_IDR_FRAMES)
-            && IsIDR(accessUnit)) {
-        // prepend codec specific data, i.e. SPS and PPS.
-        accessUnit = track->prependCSD(accessUnit);
+    // Its header templates are needed even if no PMT was ever sent.
+    track->finalize();
+
+    // Headers are muxed in front of the access unit straight from where
+    // they are, rather than copied into one buffer along with it.
+    if ((flags & PREPEND_SPS_PPS_TO_IDR_FRAMES)
+            && track->isRandomAccessPoint(accessUnit)) {
+        // prepend codec specific data, i.e. (VPS,) SPS and PPS.
+        track->appendCSD(&mFragments);
     } else if (track->isAAC() && track->lacksADTSHeader()) {
         CHECK(!(flags & IS_ENCRYPTED));
-        accessUnit = track->prependADTSHeader(accessUnit);
+        mFragments.push_back(track->ADTSHeader(accessUnit->size()));
+    }
+
+    mFragments.push_back(accessUnit);
+
+    size_t payloadSize = 0;
+    for (size_t i = 0; i < mFragments.size(); ++i) {
+        payloadSize += mFragments.itemAt(i)->size();
+    }
+
+    mPayloadSize = payloadSize;
+
+    // PCRs are sampled from the same clock as the PTS, on a PID of their
+    // own when asked to, or else scheduled here on the video PID.
+    unsigned PCR_PID = kPID_PCR;
+    bool PCRInAdaptationField = false;
+
+    if (usesVideoPCR()) {
+        const sp<Track> &videoTrack = mTracks.itemAt(mVideoTrackIndex);
+        PCR_PID = videoTrack->PID();
+
+        flags &= ~EMIT_PCR;
+
+        if (mLastPCRTimeUs < 0ll) {
+            PCRInAdaptationField = (track == videoTrack);
+        } else if (timeUs > mLastPCRTimeUs) {
+            int64_t elapsedUs = timeUs - mLastPCRTimeUs;
+
+            // Video frames usually come often enough, the next one
+            // mightn't make it in time if this one is skipped though.
+            // Otherwise a packet of its own goes in front of other
+            // tracks' data.
+            if (track == videoTrack) {
+                PCRInAdaptationField = (elapsedUs >= mVideoPCRIntervalUs / 2);
+            } else if (elapsedUs >= mVideoPCRIntervalUs) {
+                flags |= EMIT_PCR;
+            }
+        }
+
+        if (PCRInAdaptationField || (flags & EMIT_PCR)) {
+            mLastPCRTimeUs = timeUs;
+        }
+    }
+
+    mCarriesVideoPID = usesVideoPCR() && (flags & EMIT_PCR);
+
+    // PCR based on a 27MHz clock
+    int64_t PCRTimeUs = usesVideoPCR() ? timeUs - kPCRToPTSOffsetUs : timeUs;
+
+    uint64_t PCR = (PCRTimeUs * 27ll) % kPCRWrap;
+    if (PCRTimeUs < 0ll) {
+        PCR += kPCRWrap;
     }
 
     // 0x47
@@ -471,16 +1007,24 @@ status_t TSPacketizer::packetize(
     // reserved = b1
     // the first fragment of "buffer" follows
 
-    size_t PES_packet_length = accessUnit->size() + 8 + numStuffingBytes;
+    size_t PES_packet_length = payloadSize + 8 + numStuffingBytes;
     if (PES_private_data_len > 0) {
         PES_packet_length += PES_private_data_len + 1;
     }
 
+    // That's after the 4 bytes of TS header and the 6 bytes of PES packet
+    // header preceding PES_packet_length, and a PCR if there's one.
+    size_t firstPacketPESSize = 188 - 10;
+    if (PCRInAdaptationField) {
+        firstPacketPESSize -= 8;
+    }
+
     size_t numTSPackets;
-    if (PES_packet_length <= 178) {
+    if (PES_packet_length <= firstPacketPESSize) {
         numTSPackets = 1;
     } else {
-        numTSPackets = 1 + ((PES_packet_length - 178) + 183) / 184;
+        numTSPackets =
+            1 + ((PES_packet_length - firstPacketPESSize) + 183) / 184;
     }
 
     if (flags & EMIT_PAT_AND_PMT) {
@@ -491,171 +1035,30 @@ status_t TSPacketizer::packetize(
         ++numTSPackets;
     }
 
-    sp<ABuffer> buffer = new ABuffer(numTSPackets * 188);
-    uint8_t *packetDataStart = buffer->data();
+    // Everything up to and including the start of the PES packet goes
+    // here, the rest is muxed as it is dequeued.
+    uint8_t *packetDataStart = mHeadPackets;
 
     if (flags & EMIT_PAT_AND_PMT) {
-        // Program Association Table (PAT):
-        // 0x47
-        // transport_error_indicator = b0
-        // payload_unit_start_indicator = b1
-        // transport_priority = b0
-        // PID = b0000000000000 (13 bits)
-        // transport_scrambling_control = b00
-        // adaptation_field_control = b01 (no adaptation field, payload only)
-        // continuity_counter = b????
-        // skip = 0x00
-        // --- payload follows
-        // table_id = 0x00
-        // section_syntax_indicator = b1
-        // must_be_zero = b0
-        // reserved = b11
-        // section_length = 0x00d
-        // transport_stream_id = 0x0000
-        // reserved = b11
-        // version_number = b00001
-        // current_next_indicator = b1
-        // section_number = 0x00
-        // last_section_number = 0x00
-        //   one program follows:
-        //   program_number = 0x0001
-        //   reserved = b111
-        //   program_map_PID = kPID_PMT (13 bits!)
-        // CRC = 0x????????
+        if (!mTablePacketsValid) {
+            buildTables();
+        }
 
         if (++mPATContinuityCounter == 16) {
             mPATContinuityCounter = 0;
         }
 
-        uint8_t *ptr = packetDataStart;
-        *ptr++ = 0x47;
-        *ptr++ = 0x40;
-        *ptr++ = 0x00;
-        *ptr++ = 0x10 | mPATContinuityCounter;
-        *ptr++ = 0x00;
-
-        uint8_t *crcDataStart = ptr;
-        *ptr++ = 0x00;
-        *ptr++ = 0xb0;
-        *ptr++ = 0x0d;
-        *ptr++ = 0x00;
-        *ptr++ = 0x00;
-        *ptr++ = 0xc3;
-        *ptr++ = 0x00;
-        *ptr++ = 0x00;
-        *ptr++ = 0x00;
-        *ptr++ = 0x01;
-        *ptr++ = 0xe0 | (kPID_PMT >> 8);
-        *ptr++ = kPID_PMT & 0xff;
-
-        CHECK_EQ(ptr - crcDataStart, 12);
-        uint32_t crc = htonl(crc32(crcDataStart, ptr - crcDataStart));
-        memcpy(ptr, &crc, 4);
-        ptr += 4;
-
-        size_t sizeLeft = packetDataStart + 188 - ptr;
-        memset(ptr, 0xff, sizeLeft);
+        memcpy(packetDataStart, mTablePackets, 188);
+        packetDataStart[3] = 0x10 | mPATContinuityCounter;
 
         packetDataStart += 188;
 
-        // Program Map (PMT):
-        // 0x47
-        // transport_error_indicator = b0
-        // payload_unit_start_indicator = b1
-        // transport_priority = b0
-        // PID = kPID_PMT (13 bits)
-        // transport_scrambling_control = b00
-        // adaptation_field_control = b01 (no adaptation field, payload only)
-        // continuity_counter = b????
-        // skip = 0x00
-        // -- payload follows
-        // table_id = 0x02
-        // section_syntax_indicator = b1
-        // must_be_zero = b0
-        // reserved = b11
-        // section_length = 0x???
-        // program_number = 0x0001
-        // reserved = b11
-        // version_number = b00001
-        // current_next_indicator = b1
-        // section_number = 0x00
-        // last_section_number = 0x00
-        // reserved = b111
-        // PCR_PID = kPCR_PID (13 bits)
-        // reserved = b1111
-        // program_info_length = 0x000
-        //   one or more elementary stream descriptions follow:
-        //   stream_type = 0x??
-        //   reserved = b111
-        //   elementary_PID = b? ???? ???? ???? (13 bits)
-        //   reserved = b1111
-        //   ES_info_length = 0x000
-        // CRC = 0x????????
-
         if (++mPMTContinuityCounter == 16) {
             mPMTContinuityCounter = 0;
         }
 
-        ptr = packetDataStart;
-        *ptr++ = 0x47;
-        *ptr++ = 0x40 | (kPID_PMT >> 8);
-        *ptr++ = kPID_PMT & 0xff;
-        *ptr++ = 0x10 | mPMTContinuityCounter;
-        *ptr++ = 0x00;
-
-        crcDataStart = ptr;
-        *ptr++ = 0x02;
-
-        *ptr++ = 0x00;  // section_length to be filled in below.
-        *ptr++ = 0x00;
-
-        *ptr++ = 0x00;
-        *ptr++ = 0x01;
-        *ptr++ = 0xc3;
-        *ptr++ = 0x00;
-        *ptr++ = 0x00;
-        *ptr++ = 0xe0 | (kPID_PCR >> 8);
-        *ptr++ = kPID_PCR & 0xff;
-        *ptr++ = 0xf0;
-        *ptr++ = 0x00;
-
-        for (size_t i = 0; i < mTracks.size(); ++i) {
-            const sp<Track> &track = mTracks.itemAt(i);
-
-            // Make sure all the decriptors have been added.
-            track->finalize();
-
-            *ptr++ = track->streamType();
-            *ptr++ = 0xe0 | (track->PID() >> 8);
-            *ptr++ = track->PID() & 0xff;
-
-            size_t ES_info_length = 0;
-            for (size_t i = 0; i < track->countDescriptors(); ++i) {
-                ES_info_length += track->descriptorAt(i)->size();
-            }
-            CHECK_LE(ES_info_length, 0xfff);
-
-            *ptr++ = 0xf0 | (ES_info_length >> 8);
-            *ptr++ = (ES_info_length & 0xff);
-
-            for (size_t i = 0; i < track->countDescriptors(); ++i) {
-                const sp<ABuffer> &descriptor = track->descriptorAt(i);
-                memcpy(ptr, descriptor->data(), descriptor->size());
-                ptr += descriptor->size();
-            }
-        }
-
-        size_t section_length = ptr - (crcDataStart + 3) + 4 /* CRC */;
-
-        crcDataStart[1] = 0xb0 | (section_length >> 8);
-        crcDataStart[2] = section_length & 0xff;
-
-        crc = htonl(crc32(crcDataStart, ptr - crcDataStart));
-        memcpy(ptr, &crc, 4);
-        ptr += 4;
-
-        sizeLeft = packetDataStart + 188 - ptr;
-        memset(ptr, 0xff, sizeLeft);
+        memcpy(packetDataStart, mTablePackets + 188, 188);
+        packetDataStart[3] = 0x10 | mPMTContinuityCounter;
 
         packetDataStart += 188;
     }
@@ -664,12 +1067,12 @@ status_t TSPacketizer::packetize(
         // PCR stream
         // 0x47
         // transport_error_indicator = b0
-        // payload_unit_start_indicator = b1
+        // payload_unit_start_indicator = b0 (no payload)
         // transport_priority = b0
-        // PID = kPCR_PID (13 bits)
+        // PID = PCR_PID (13 bits)
         // transport_scrambling_control = b00
         // adaptation_field_control = b10 (adaptation field only, no payload)
-        // continuity_counter = b0000 (does not increment)
+        // continuity_counter = b???? (does not increment)
         // adaptation_field_length = 183
         // discontinuity_indicator = b0
         // random_access_indicator = b0
@@ -683,24 +1086,23 @@ status_t TSPacketizer::packetize(
         // reserved = b111111
         // program_clock_reference_extension = b?????????
 
-        int64_t nowUs = ALooper::GetNowUs();
-
-        uint64_t PCR = nowUs * 27;  // PCR based on a 27MHz clock
-        uint64_t PCR_base = PCR / 300;
-        uint32_t PCR_ext = PCR % 300;
+        unsigned continuityCounter = 0;
+        if (usesVideoPCR()) {
+            continuityCounter =
+                mTracks.itemAt(mVideoTrackIndex)->lastContinuityCounter();
+        } else {
+            // Time of emission, as it has always been on this PID.
+            PCR = ALooper::GetNowUs() * 27ll;
+        }
 
         uint8_t *ptr = packetDataStart;
         *ptr++ = 0x47;
-        *ptr++ = 0x40 | (kPID_PCR >> 8);
-        *ptr++ = kPID_PCR & 0xff;
-        *ptr++ = 0x20;
+        *ptr++ = PCR_PID >> 8;
+        *ptr++ = PCR_PID & 0xff;
+        *ptr++ = 0x20 | continuityCounter;
         *ptr++ = 0xb7;  // adaptation_field_length
         *ptr++ = 0x10;
-        *ptr++ = (PCR_base >> 25) & 0xff;
-        *ptr++ = (PCR_base >> 17) & 0xff;
-        *ptr++ = (PCR_base >> 9) & 0xff;
-        *ptr++ = ((PCR_base & 1) << 7) | 0x7e | ((PCR_ext >> 8) & 1);
-        *ptr++ = (PCR_ext & 0xff);
+        ptr = WritePCR(ptr, PCR);
 
         size_t sizeLeft = packetDataStart + 188 - ptr;
         memset(ptr, 0xff, sizeLeft);
@@ -710,7 +1112,13 @@ status_t TSPacketizer::packetize(
 
     uint64_t PTS = (timeUs * 9ll) / 100ll;
 
-    bool padding = (PES_packet_length < (188 - 10));
+    // Including adaptation_field_length.
+    size_t adaptationFieldSize = 0;
+    if (PES_packet_length < firstPacketPESSize) {
+        adaptationFieldSize = 188 - 10 - PES_packet_length;
+    } else if (PCRInAdaptationField) {
+        adaptationFieldSize = 8;
+    }
 
     if (PES_packet_length >= 65536) {
         // This really should only happen for video.
@@ -721,153 +1129,585 @@ status_t TSPacketizer::packetize(
     }
 
     uint8_t *ptr = packetDataStart;
-    *ptr++ = 0x47;
-    *ptr++ = 0x40 | (track->PID() >> 8);
-    *ptr++ = track->PID() & 0xff;
-    *ptr++ = (padding ? 0x30 : 0x10) | track->incrementContinuityCounter();
+    memcpy(ptr, track->TSHeader(true, adaptationFieldSize > 0), 4);
+    ptr[3] |= track->incrementContinuityCounter();
+    ptr += 4;
 
-    if (padding) {
-        size_t paddingSize = 188 - 10 - PES_packet_length;
-        *ptr++ = paddingSize - 1;
-        if (paddingSize >= 2) {
-            *ptr++ = 0x00;
-            memset(ptr, 0xff, paddingSize - 2);
-            ptr += paddingSize - 2;
+    if (adaptationFieldSize > 0) {
+        uint8_t *adaptationFieldEnd = ptr + adaptationFieldSize;
+
+        *ptr++ = adaptationFieldSize - 1;
+        if (adaptationFieldSize >= 2) {
+            *ptr++ = PCRInAdaptationField ? 0x10 : 0x00;  // PCR_flag
+
+            if (PCRInAdaptationField) {
+                ptr = WritePCR(ptr, PCR);
+            }
+
+            memset(ptr, 0xff, adaptationFieldEnd - ptr);
+            ptr = adaptationFieldEnd;
         }
     }
 
-    *ptr++ = 0x00;
-    *ptr++ = 0x00;
-    *ptr++ = 0x01;
-    *ptr++ = track->streamID();
-    *ptr++ = PES_packet_length >> 8;
-    *ptr++ = PES_packet_length & 0xff;
-    *ptr++ = 0x84;
-    *ptr++ = (PES_private_data_len > 0) ? 0x81 : 0x80;
+    const uint8_t *PESHeader = track->PESHeader();
 
-    size_t headerLength = 0x05 + numStuffingBytes;
     if (PES_private_data_len > 0) {
-        headerLength += 1 + PES_private_data_len;
+        if (numStuffingBytes > 0) {
+            ptr = WritePESHeader<true, true>(
+                    ptr, PESHeader, PES_packet_length, PTS,
+                    PES_private_data, PES_private_data_len, numStuffingBytes);
+        } else {
+            ptr = WritePESHeader<true, false>(
+                    ptr, PESHeader, PES_packet_length, PTS,
+                    PES_private_data, PES_private_data_len, 0);
+        }
+    } else if (numStuffingBytes > 0) {
+        ptr = WritePESHeader<false, true>(
+                ptr, PESHeader, PES_packet_length, PTS,
+                NULL, 0, numStuffingBytes);
+    } else {
+        ptr = WritePESHeader<false, false>(
+                ptr, PESHeader, PES_packet_length, PTS, NULL, 0, 0);
+    }
+
+    // 18 bytes of TS/PES header leave 188 - 18 = 170 bytes for the payload
+
+    size_t sizeLeft = packetDataStart + 188 - ptr;
+    size_t copy = payloadSize;
+    if (copy > sizeLeft) {
+        copy = sizeLeft;
     }
 
-    *ptr++ = headerLength;
+    copyPayload(ptr, 0, copy);
+    ptr += copy;
+    CHECK_EQ(sizeLeft, copy);
+    memset(ptr, 0xff, sizeLeft - copy);
 
-    *ptr++ = 0x20 | (((PTS >> 30) & 7) << 1) | 1;
-    *ptr++ = (PTS >> 22) & 0xff;
-    *ptr++ = (((PTS >> 15) & 0x7f) << 1) | 1;
-    *ptr++ = (PTS >> 7) & 0xff;
-    *ptr++ = ((PTS & 0x7f) << 1) | 1;
+    packetDataStart += 188;
 
-    if (PES_private_data_len > 0) {
-        *ptr++ = 0x8e;  // PES_private_data_flag, reserved.
-        memcpy(ptr, PES_private_data, PES_private_data_len);
-        ptr += PES_private_data_len;
+    mPayloadOffset = copy;
+
+    mTrack = track;
+    mRTPSlots = (flags & EMIT_RTP_SLOTS) != 0;
+    mNumHeadPackets = (packetDataStart - mHeadPackets) / 188;
+    mNextHeadPacket = 0;
+    mNumPacketsLeft = numTSPackets;
+
+    return OK;
+}
+
+sp<ABuffer> TSPacketizer::dequeuePackets(size_t maxNumPackets) {
+    size_t numTSPackets = mNumPacketsLeft;
+    if (numTSPackets > maxNumPackets) {
+        numTSPackets = maxNumPackets;
     }
 
-    for (size_t i = 0; i < numStuffingBytes; ++i) {
-        *ptr++ = 0xff;
+    if (numTSPackets == 0) {
+        return NULL;
     }
 
-    // 18 bytes of TS/PES header leave 188 - 18 = 170 bytes for the payload
+    size_t bufferSize = numTSPackets * 188;
+    if (mRTPSlots) {
+        bufferSize += kRTPHeaderSize
+            * ((numTSPackets + kNumTSPacketsPerRTPPacket - 1)
+                    / kNumTSPacketsPerRTPPacket);
+    }
+
+    sp<ABuffer> buffer = acquireBuffer(bufferSize);
+
+    size_t index = 0;
+    while (index < numTSPackets && mNextHeadPacket < mNumHeadPackets) {
+        memcpy(packetAt(buffer->data(), index, mRTPSlots),
+               &mHeadPackets[188 * mNextHeadPacket],
+               188);
+
+        ++mNextHeadPacket;
+        ++index;
+    }
+
+    size_t numPayloadPackets = numTSPackets - index;
+
+    // Every payload packet but the last carries exactly 184 bytes of it,
+    // so where each one starts and its continuity_counter are known up
+    // front and ranges of them can be filled independently.
+    unsigned continuityCounter =
+        mTrack->advanceContinuityCounter(numPayloadPackets);
+
+    PacketRange range;
+    range.mData = buffer->data();
+    range.mFirstIndex = index;
+    range.mNumPackets = numPayloadPackets;
+    range.mContinuityCounter = continuityCounter;
+    range.mPayloadOffset = mPayloadOffset;
+
+    if (mWorkers.size() > 0
+            && mPayloadSize >= mMinParallelPayloadSize
+            && numPayloadPackets >= 2 * kMinNumPacketsPerRange) {
+        writePacketRangeInParallel(range);
+    } else {
+        writePacketRange(range);
+    }
+
+    mPayloadOffset += numPayloadPackets * 184;
+    if (mPayloadOffset > mPayloadSize) {
+        mPayloadOffset = mPayloadSize;
+    }
+
+    mNumPacketsLeft -= numTSPackets;
+
+    if (mNumPacketsLeft == 0) {
+        CHECK_EQ(mPayloadOffset, mPayloadSize);
+
+        mTrack.clear();
+        mFragments.clear();
+    }
+
+    return buffer;
+}
+
+size_t TSPacketizer::countPacketsLeft() const {
+    return mNumPacketsLeft;
+}
+
+bool TSPacketizer::carriesVideoPID() const {
+    return mCarriesVideoPID;
+}
+
+void TSPacketizer::writePacketRange(const PacketRange &range) const {
+    for (size_t i = 0; i < range.mNumPackets; ++i) {
+        writePayloadPacket(
+                packetAt(range.mData, range.mFirstIndex + i, mRTPSlots),
+                (range.mContinuityCounter + i) % 16,
+                range.mPayloadOffset + i * 184);
+    }
+}
+
+void TSPacketizer::writePacketRangeInParallel(const PacketRange &range) {
+    // The calling thread takes a share of its own.
+    size_t numRanges = mWorkers.size() + 1;
+    if (numRanges > range.mNumPackets / kMinNumPacketsPerRange) {
+        numRanges = range.mNumPackets / kMinNumPacketsPerRange;
+    }
+
+    size_t numPacketsPerRange = (range.mNumPackets + numRanges - 1) / numRanges;
+
+    PacketRange ownRange;
+
+    {
+        Mutex::Autolock autoLock(mWorkLock);
+
+        size_t offset = 0;
+        for (size_t i = 0; i < numRanges; ++i) {
+            PacketRange subRange;
+            subRange.mData = range.mData;
+            subRange.mFirstIndex = range.mFirstIndex + offset;
+            subRange.mNumPackets = range.mNumPackets - offset;
+            if (subRange.mNumPackets > numPacketsPerRange) {
+                subRange.mNumPackets = numPacketsPerRange;
+            }
+            subRange.mContinuityCounter =
+                (range.mContinuityCounter + offset) % 16;
+            subRange.mPayloadOffset = range.mPayloadOffset + offset * 184;
+
+            offset += subRange.mNumPackets;
+
+            if (i == 0) {
+                ownRange = subRange;
+            } else {
+                mPendingRanges.push_back(subRange);
+            }
+        }
+
+        mNumRangesInProgress = mPendingRanges.size();
+        mWorkCondition.broadcast();
+    }
+
+    writePacketRange(ownRange);
+
+    Mutex::Autolock autoLock(mWorkLock);
+    while (mNumRangesInProgress > 0) {
+        mDoneCondition.wait(mWorkLock);
+    }
+}
+
+bool TSPacketizer::workerLoop() {
+    PacketRange range;
+
+    {
+        Mutex::Autolock autoLock(mWorkLock);
+
+        while (mPendingRanges.empty() && !mWorkersExiting) {
+            mWorkCondition.wait(mWorkLock);
+        }
+
+        if (mWorkersExiting) {
+            return false;
+        }
+
+        range = *mPendingRanges.begin();
+        mPendingRanges.erase(mPendingRanges.begin());
+    }
+
+    writePacketRange(range);
+
+    Mutex::Autolock autoLock(mWorkLock);
+    if (--mNumRangesInProgress == 0) {
+        mDoneCondition.signal();
+    }
+
+    return true;
+}
+
+void TSPacketizer::writePayloadPacket(
+        uint8_t *packetDataStart,
+        unsigned continuityCounter,
+        size_t payloadOffset) const {
+    const sp<Track> &track = mTrack;
+
+    CHECK_LT(payloadOffset, mPayloadSize);
+
+    size_t payloadSizeLeft = mPayloadSize - payloadOffset;
+    bool padding = payloadSizeLeft < (188 - 4);
+
+    // for subsequent fragments of "buffer":
+    // 0x47
+    // transport_error_indicator = b0
+    // payload_unit_start_indicator = b0
+    // transport_priority = b0
+    // PID = b0 0001 1110 ???? (13 bits) [0x1e0 + 1 + sourceIndex]
+    // transport_scrambling_control = b00
+    // adaptation_field_control = b??
+    // continuity_counter = b????
+    // the fragment of "buffer" follows.
+
+    uint8_t *ptr = packetDataStart;
+    memcpy(ptr, track->TSHeader(false, padding), 4);
+    ptr[3] |= continuityCounter;
+    ptr += 4;
+
+    if (padding) {
+        size_t paddingSize = 188 - 4 - payloadSizeLeft;
+        *ptr++ = paddingSize - 1;
+        if (paddingSize >= 2) {
+            *ptr++ = 0x00;
+            memset(ptr, 0xff, paddingSize - 2);
+            ptr += paddingSize - 2;
+        }
+    }
+
+    // 4 bytes of TS header leave 188 - 4 = 184 bytes for the payload
 
     size_t sizeLeft = packetDataStart + 188 - ptr;
-    size_t copy = accessUnit->size();
+    size_t copy = payloadSizeLeft;
     if (copy > sizeLeft) {
         copy = sizeLeft;
     }
 
-    memcpy(ptr, accessUnit->data(), copy);
+    copyPayload(ptr, payloadOffset, copy);
     ptr += copy;
     CHECK_EQ(sizeLeft, copy);
     memset(ptr, 0xff, sizeLeft - copy);
+}
+
+void TSPacketizer::copyPayload(
+        uint8_t *dst, size_t offset, size_t size) const {
+    CHECK_LE(offset + size, mPayloadSize);
+
+    if (size == 0) {
+        return;
+    }
+
+    // There are only ever a few fragments.
+    size_t index = 0;
+    while (offset >= mFragments.itemAt(index)->size()) {
+        offset -= mFragments.itemAt(index)->size();
+        ++index;
+    }
+
+    while (size > 0) {
+        const sp<ABuffer> &fragment = mFragments.itemAt(index);
+
+        size_t copy = fragment->size() - offset;
+        if (copy > size) {
+            copy = size;
+        }
+
+        memcpy(dst, fragment->data() + offset, copy);
+        dst += copy;
+        size -= copy;
+
+        ++index;
+        offset = 0;
+    }
+}
+
+status_t TSPacketizer::packetize(
+        size_t trackIndex,
+        const sp<ABuffer> &accessUnit,
+        sp<ABuffer> *packets,
+        uint32_t flags,
+        const uint8_t *PES_private_data, size_t PES_private_data_len,
+        size_t numStuffingBytes) {
+    packets->clear();
+
+    status_t err = startAccessUnit(
+            trackIndex, accessUnit, flags,
+            PES_private_data, PES_private_data_len, numStuffingBytes);
+
+    if (err != OK) {
+        return err;
+    }
+
+    *packets = dequeuePackets(mNumPacketsLeft);
+
+    return OK;
+}
+
+// static
+uint8_t *TSPacketizer::packetAt(uint8_t *data, size_t index, bool rtpSlots) {
+    uint8_t *packetDataStart = data + index * 188;
+
+    if (rtpSlots) {
+        // Past the RTP headers up to and including that of the RTP packet
+        // this TS packet goes into.
+        packetDataStart +=
+            kRTPHeaderSize * (index / kNumTSPacketsPerRTPPacket + 1);
+    }
+
+    return packetDataStart;
+}
+
+sp<ABuffer> TSPacketizer::acquireBuffer(size_t size) {
+    sp<ABuffer> buffer = mBufferPool->acquire(size);
+
+    if (buffer == NULL) {
+        // A large access unit.
+        buffer = new ABuffer(size);
+    }
+
+    return buffer;
+}
+
+void TSPacketizer::buildTables() {
+    uint8_t *packetDataStart = mTablePackets;
+
+    // Program Association Table (PAT):
+    // 0x47
+    // transport_error_indicator = b0
+    // payload_unit_start_indicator = b1
+    // transport_priority = b0
+    // PID = b0000000000000 (13 bits)
+    // transport_scrambling_control = b00
+    // adaptation_field_control = b01 (no adaptation field, payload only)
+    // continuity_counter = b????
+    // skip = 0x00
+    // --- payload follows
+    // table_id = 0x00
+    // section_syntax_indicator = b1
+    // must_be_zero = b0
+    // reserved = b11
+    // section_length = 0x00d
+    // transport_stream_id = 0x0000
+    // reserved = b11
+    // version_number = b00001
+    // current_next_indicator = b1
+    // section_number = 0x00
+    // last_section_number = 0x00
+    //   one program follows:
+    //   program_number = 0x0001
+    //   reserved = b111
+    //   program_map_PID = kPID_PMT (13 bits!)
+    // CRC = 0x????????
+
+    uint8_t *ptr = packetDataStart;
+    *ptr++ = 0x47;
+    *ptr++ = 0x40;
+    *ptr++ = 0x00;
+    *ptr++ = 0x10;  // continuity_counter is filled in on emission.
+    *ptr++ = 0x00;
+
+    uint8_t *crcDataStart = ptr;
+    *ptr++ = 0x00;
+    *ptr++ = 0xb0;
+    *ptr++ = 0x0d;
+    *ptr++ = 0x00;
+    *ptr++ = 0x00;
+    *ptr++ = 0xc3;
+    *ptr++ = 0x00;
+    *ptr++ = 0x00;
+    *ptr++ = 0x00;
+    *ptr++ = 0x01;
+    *ptr++ = 0xe0 | (kPID_PMT >> 8);
+    *ptr++ = kPID_PMT & 0xff;
+
+    CHECK_EQ(ptr - crcDataStart, 12);
+    uint32_t crc = htonl(crc32(crcDataStart, ptr - crcDataStart));
+    memcpy(ptr, &crc, 4);
+    ptr += 4;
+
+    size_t sizeLeft = packetDataStart + 188 - ptr;
+    memset(ptr, 0xff, sizeLeft);
 
     packetDataStart += 188;
 
-    size_t offset = copy;
-    while (offset < accessUnit->size()) {
-        bool padding = (accessUnit->size() - offset) < (188 - 4);
+    // Program Map (PMT):
+    // 0x47
+    // transport_error_indicator = b0
+    // payload_unit_start_indicator = b1
+    // transport_priority = b0
+    // PID = kPID_PMT (13 bits)
+    // transport_scrambling_control = b00
+    // adaptation_field_control = b01 (no adaptation field, payload only)
+    // continuity_counter = b????
+    // skip = 0x00
+    // -- payload follows
+    // table_id = 0x02
+    // section_syntax_indicator = b1
+    // must_be_zero = b0
+    // reserved = b11
+    // section_length = 0x???
+    // program_number = 0x0001
+    // reserved = b11
+    // version_number = b00001
+    // current_next_indicator = b1
+    // section_number = 0x00
+    // last_section_number = 0x00
+    // reserved = b111
+    // PCR_PID = kPCR_PID or the video PID (13 bits)
+    // reserved = b1111
+    // program_info_length = 0x000
+    //   one or more elementary stream descriptions follow:
+    //   stream_type = 0x??
+    //   reserved = b111
+    //   elementary_PID = b? ???? ???? ???? (13 bits)
+    //   reserved = b1111
+    //   ES_info_length = 0x000
+    // CRC = 0x????????
+
+    ptr = packetDataStart;
+    *ptr++ = 0x47;
+    *ptr++ = 0x40 | (kPID_PMT >> 8);
+    *ptr++ = kPID_PMT & 0xff;
+    *ptr++ = 0x10;
+    *ptr++ = 0x00;
 
-        // for subsequent fragments of "buffer":
-        // 0x47
-        // transport_error_indicator = b0
-        // payload_unit_start_indicator = b0
-        // transport_priority = b0
-        // PID = b0 0001 1110 ???? (13 bits) [0x1e0 + 1 + sourceIndex]
-        // transport_scrambling_control = b00
-        // adaptation_field_control = b??
-        // continuity_counter = b????
-        // the fragment of "buffer" follows.
+    crcDataStart = ptr;
+    *ptr++ = 0x02;
 
-        uint8_t *ptr = packetDataStart;
-        *ptr++ = 0x47;
-        *ptr++ = 0x00 | (track->PID() >> 8);
-        *ptr++ = track->PID() & 0xff;
+    *ptr++ = 0x00;  // section_length to be filled in below.
+    *ptr++ = 0x00;
 
-        *ptr++ = (padding ? 0x30 : 0x10) | track->incrementContinuityCounter();
+    *ptr++ = 0x00;
+    *ptr++ = 0x01;
+    *ptr++ = 0xc3;
+    *ptr++ = 0x00;
+    *ptr++ = 0x00;
+    unsigned PCR_PID =
+        usesVideoPCR() ? mTracks.itemAt(mVideoTrackIndex)->PID() : kPID_PCR;
 
-        if (padding) {
-            size_t paddingSize = 188 - 4 - (accessUnit->size() - offset);
-            *ptr++ = paddingSize - 1;
-            if (paddingSize >= 2) {
-                *ptr++ = 0x00;
-                memset(ptr, 0xff, paddingSize - 2);
-                ptr += paddingSize - 2;
-            }
-        }
+    *ptr++ = 0xe0 | (PCR_PID >> 8);
+    *ptr++ = PCR_PID & 0xff;
+    *ptr++ = 0xf0;
+    *ptr++ = 0x00;
 
-        // 4 bytes of TS header leave 188 - 4 = 184 bytes for the payload
+    for (size_t i = 0; i < mTracks.size(); ++i) {
+        const sp<Track> &track = mTracks.itemAt(i);
 
-        size_t sizeLeft = packetDataStart + 188 - ptr;
-        size_t copy = accessUnit->size() - offset;
-        if (copy > sizeLeft) {
-            copy = sizeLeft;
+        // Make sure all the decriptors have been added.
+        track->finalize();
+
+        *ptr++ = track->streamType();
+        *ptr++ = 0xe0 | (track->PID() >> 8);
+        *ptr++ = track->PID() & 0xff;
+
+        size_t ES_info_length = 0;
+        for (size_t i = 0; i < track->countDescriptors(); ++i) {
+            ES_info_length += track->descriptorAt(i)->size();
         }
+        CHECK_LE(ES_info_length, 0xfff);
 
-        memcpy(ptr, accessUnit->data() + offset, copy);
-        ptr += copy;
-        CHECK_EQ(sizeLeft, copy);
-        memset(ptr, 0xff, sizeLeft - copy);
+        *ptr++ = 0xf0 | (ES_info_length >> 8);
+        *ptr++ = (ES_info_length & 0xff);
 
-        offset += copy;
-        packetDataStart += 188;
+        for (size_t i = 0; i < track->countDescriptors(); ++i) {
+            const sp<ABuffer> &descriptor = track->descriptorAt(i);
+            memcpy(ptr, descriptor->data(), descriptor->size());
+            ptr += descriptor->size();
+        }
     }
 
-    CHECK(packetDataStart == buffer->data() + buffer->capacity());
+    size_t section_length = ptr - (crcDataStart + 3) + 4 /* CRC */;
 
-    *packets = buffer;
+    crcDataStart[1] = 0xb0 | (section_length >> 8);
+    crcDataStart[2] = section_length & 0xff;
 
-    return OK;
+    crc = htonl(crc32(crcDataStart, ptr - crcDataStart));
+    memcpy(ptr, &crc, 4);
+    ptr += 4;
+
+    sizeLeft = packetDataStart + 188 - ptr;
+    memset(ptr, 0xff, sizeLeft);
+
+    mTablePacketsValid = true;
 }
 
 void TSPacketizer::initCrcTable() {
     uint32_t poly = 0x04C11DB7;
 
     for (int i = 0; i < 256; i++) {
-        uint32_t crc = i << 24;
+        uint32_t crc = (uint32_t)i << 24;
         for (int j = 0; j < 8; j++) {
             crc = (crc << 1) ^ ((crc & 0x80000000) ? (poly) : 0);
         }
-        mCrcTable[i] = crc;
+        mCrcTable[0][i] = crc;
+    }
+
+    // mCrcTable[k][i] is the CRC of byte i followed by k zero bytes.
+    for (int k = 1; k < 4; k++) {
+        for (int i = 0; i < 256; i++) {
+            uint32_t crc = mCrcTable[k - 1][i];
+            mCrcTable[k][i] = (crc << 8) ^ mCrcTable[0][crc >> 24];
+        }
     }
 }
 
 uint32_t TSPacketizer::crc32(const uint8_t *start, size_t size) const {
     uint32_t crc = 0xFFFFFFFF;
-    const uint8_t *p;
+    const uint8_t *p = start;
+
+    // Four bytes per step (slice-by-4).
+    for (; size >= 4; p += 4, size -= 4) {
+        crc ^= ((uint32_t)p[0] << 24)
+            | ((uint32_t)p[1] << 16)
+            | ((uint32_t)p[2] << 8)
+            | p[3];
+
+        crc = mCrcTable[3][crc >> 24]
+            ^ mCrcTable[2][(crc >> 16) & 0xff]
+            ^ mCrcTable[1][(crc >> 8) & 0xff]
+            ^ mCrcTable[0][crc & 0xff];
+    }
 
-    for (p = start; p < start + size; ++p) {
-        crc = (crc << 8) ^ mCrcTable[((crc >> 24) ^ *p) & 0xFF];
+    for (; size > 0; ++p, --size) {
+        crc = (crc << 8) ^ mCrcTable[0][((crc >> 24) ^ *p) & 0xFF];
     }
 
     return crc;
 }
 
+bool TSPacketizer::isRandomAccessPoint(
+        size_t trackIndex, const sp<ABuffer> &accessUnit) const {
+    CHECK_LT(trackIndex, mTracks.size());
+
+    return mTracks.itemAt(trackIndex)->isRandomAccessPoint(accessUnit);
+}
+
 sp<ABuffer> TSPacketizer::prependCSD(
         size_t trackIndex, const sp<ABuffer> &accessUnit) const {
     CHECK_LT(trackIndex, mTracks.size());
 
     const sp<Track> &track = mTracks.itemAt(trackIndex);
-    CHECK(track->isH264() && IsIDR(accessUnit));
+    CHECK(track->isRandomAccessPoint(accessUnit));
 
     int64_t timeUs;
     CHECK(accessUnit->meta()->findInt64("timeUs", &timeUs));
@@ -20,7 +20,9 @@
 
 #include <media/stagefright/foundation/ABase.h>
 #include <utils/Errors.h>
+#include <utils/List.h>
 #include <utils/RefBase.h>
+#include <utils/Thread.h>
 #include <utils/Vector.h>
 
 namespace android {
@@ -34,15 +36,46 @@ struct AMessage;
 struct TSPacketizer : public RefBase {
     TSPacketizer();
 
+    // Output of HEVC encoders, accepted by addTrack.
+    static const char *const kMIMETypeVideoHEVC;
+
     // Returns trackIndex or error.
     ssize_t addTrack(const sp<AMessage> &format);
 
+    // Instead of in packets of their own on a separate PID (EMIT_PCR,
+    // which is then ignored), PCRs are carried in the adaptation field of
+    // the video track, no more than about "intervalUs" apart, with the
+    // same time base as the PTS but a fixed 100ms behind it. Should there
+    // be no video frame in time, an adaptation field only packet on the
+    // video PID is inserted.
+    void enableVideoPCR(int64_t intervalUs);
+
+    // The payload packets of access units of at least "minAccessUnitSize"
+    // bytes are written by "numThreads" threads at once, the calling one
+    // included, whenever enough of them are asked for in one go. The
+    // output is the same as without.
+    void enableParallelPacketization(
+            size_t numThreads, size_t minAccessUnitSize);
+
     enum {
         EMIT_PAT_AND_PMT                = 1,
         EMIT_PCR                        = 2,
         IS_ENCRYPTED                    = 4,
+        // VPS, SPS and PPS to IRAP pictures for HEVC.
         PREPEND_SPS_PPS_TO_IDR_FRAMES   = 8,
+        EMIT_RTP_SLOTS                  = 16,
+    };
+
+    // With EMIT_RTP_SLOTS, kRTPHeaderSize bytes are left free in front of
+    // every kNumTSPacketsPerRTPPacket TS packets for the sender to fill in,
+    // so the packets can go out on the network without another copy.
+    enum {
+        kRTPHeaderSize              = 12,
+        kNumTSPacketsPerRTPPacket   = 7,
     };
+
+    // The buffers returned in "packets" are recycled once all references
+    // to them are gone.
     status_t packetize(
             size_t trackIndex, const sp<ABuffer> &accessUnit,
             sp<ABuffer> *packets,
@@ -50,6 +83,32 @@ struct TSPacketizer : public RefBase {
             const uint8_t *PES_private_data, size_t PES_private_data_len,
             size_t numStuffingBytes = 0);
 
+    // Incremental form of packetize(), so that the first packets of a
+    // large access unit can be sent before the rest of it is muxed. Once
+    // startAccessUnit() succeeds, each call to dequeuePackets() returns
+    // the next at most "maxNumPackets" TS packets, laid out as packetize()
+    // would, until there are none left and it returns NULL. Another access
+    // unit can only be started after that.
+    status_t startAccessUnit(
+            size_t trackIndex, const sp<ABuffer> &accessUnit,
+            uint32_t flags,
+            const uint8_t *PES_private_data, size_t PES_private_data_len,
+            size_t numStuffingBytes = 0);
+
+    sp<ABuffer> dequeuePackets(size_t maxNumPackets);
+    size_t countPacketsLeft() const;
+
+    // Whether the access unit being packetized, of some other track, was
+    // given an adaptation field only packet on the video PID to carry the
+    // PCR, see enableVideoPCR(). Its packets must then not be sent ahead
+    // of video packets dequeued before them.
+    bool carriesVideoPID() const;
+
+    // Whether "accessUnit" of the given video track can be decoded without
+    // reference to any before it, i.e. is an IDR or IRAP picture.
+    bool isRandomAccessPoint(
+            size_t trackIndex, const sp<ABuffer> &accessUnit) const;
+
     // XXX to be removed once encoder config option takes care of this for
     // encrypted mode.
     sp<ABuffer> prependCSD(
@@ -64,15 +123,99 @@ private:
         kPID_PCR = 0x1000,
     };
 
+    // Buffers of up to this many full RTP packets' worth of bytes are
+    // recycled. No more than kMaxBufferPoolBytes of them are kept unused,
+    // about what the sender's retransmission history holds at high
+    // bitrates.
+    static const size_t kMaxNumRTPPacketsPerPooledBuffer = 32;
+    static const size_t kMaxBufferPoolBytes = 4 * 1024 * 1024;
+
+    // Fewer packets than this aren't worth handing to another thread, a
+    // call to dequeuePackets() needs to ask for at least twice as many to
+    // be split up.
+    static const size_t kMinNumPacketsPerRange = 64;
+
     struct Track;
+    struct Worker;
+    struct BufferPool;
+
+    // Consecutive payload packets of the access unit being packetized.
+    struct PacketRange {
+        uint8_t *mData;
+        size_t mFirstIndex;
+        size_t mNumPackets;
+        unsigned mContinuityCounter;
+        size_t mPayloadOffset;
+    };
 
     Vector<sp<Track> > mTracks;
 
     unsigned mPATContinuityCounter;
     unsigned mPMTContinuityCounter;
 
-    uint32_t mCrcTable[256];
-
+    // PAT and PMT, ready to go but for their continuity_counters. Rebuilt
+    // whenever the set of tracks changes.
+    uint8_t mTablePackets[2 * 188];
+    bool mTablePacketsValid;
+
+    // The first video track, carries the PCR if enabled.
+    ssize_t mVideoTrackIndex;
+    int64_t mVideoPCRIntervalUs;
+    int64_t mLastPCRTimeUs;
+
+    // The access unit being packetized, see startAccessUnit(), as a list
+    // of fragments: the headers to go in front of it, if any, then the
+    // access unit itself.
+    sp<Track> mTrack;
+    Vector<sp<ABuffer> > mFragments;
+    size_t mPayloadSize;
+    size_t mPayloadOffset;
+    bool mRTPSlots;
+    bool mCarriesVideoPID;
+
+    // PAT, PMT, PCR and the first packet of the PES packet.
+    uint8_t mHeadPackets[4 * 188];
+    size_t mNumHeadPackets;
+    size_t mNextHeadPacket;
+
+    size_t mNumPacketsLeft;
+
+    // Buffers handed out by dequeuePackets() return to it once the last
+    // reference to them is gone, on whatever thread that happens.
+    sp<BufferPool> mBufferPool;
+
+    uint32_t mCrcTable[4][256];
+
+    // See enableParallelPacketization().
+    size_t mMinParallelPayloadSize;
+    Vector<sp<Worker> > mWorkers;
+    Mutex mWorkLock;
+    Condition mWorkCondition;
+    Condition mDoneCondition;
+    List<PacketRange> mPendingRanges;
+    size_t mNumRangesInProgress;
+    bool mWorkersExiting;
+
+    // Returns where the TS packet with the given index goes in a buffer
+    // returned by dequeuePackets().
+    static uint8_t *packetAt(uint8_t *data, size_t index, bool rtpSlots);
+
+    bool usesVideoPCR() const;
+    sp<ABuffer> acquireBuffer(size_t size);
+    void writePacketRange(const PacketRange &range) const;
+    void writePacketRangeInParallel(const PacketRange &range);
+    bool workerLoop();
+
+    void writePayloadPacket(
+            uint8_t *packetDataStart,
+            unsigned continuityCounter,
+            size_t payloadOffset) const;
+
+    // Copies "size" bytes of the fragments, starting "offset" bytes into
+    // them, to "dst".
+    void copyPayload(uint8_t *dst, size_t offset, size_t size) const;
+
+    void buildTables();
     void initCrcTable();
     uint32_t crc32(const uint8_t *start, size_t size) const;
 
@@ -23,6 +23,7 @@
 #include "Parameters.h"
 #include "ParsedMessage.h"
 #include "Sender.h"
+#include "TSPacketizer.h"
 
 #include <binder/IServiceManager.h>
 #include <gui/ISurfaceTexture.h>
@@ -32,6 +33,7 @@
 #include <media/stagefright/foundation/ABuffer.h>
 #include <media/stagefright/foundation/ADebug.h>
 #include <media/stagefright/foundation/AMessage.h>
+#include <media/stagefright/MediaCodecList.h>
 #include <media/stagefright/MediaErrors.h>
 
 #include <arpa/inet.h>
@@ -41,6 +43,47 @@
 
 namespace android {
 
+// HEVC is offered to sinks through the R2 "wfd2_video_formats" parameter
+// if enabled and there's an encoder for it.
+static bool CanEncodeHEVC() {
+    char val[PROPERTY_VALUE_MAX];
+    if (!property_get("media.wfd.enable-hevc", val, NULL)
+            || (strcasecmp("true", val) && strcmp("1", val))) {
+        return false;
+    }
+
+    return MediaCodecList::getInstance()->findCodecByType(
+            TSPacketizer::kMIMETypeVideoHEVC, true /* encoder */) >= 0;
+}
+
+// Finds the entry of the comma separated list "s" naming the HEVC codec,
+// i.e. starting with "HEVC " or "H265 ", and returns it in "format".
+static bool GetHEVCVideoFormat(const char *s, AString *format) {
+    while (*s != '\0') {
+        const char *commaPos = strchr(s, ',');
+        size_t len = (commaPos != NULL) ? commaPos - s : strlen(s);
+
+        if (len > 5
+                && (!strncasecmp(s, "HEVC ", 5)
+                    || !strncasecmp(s, "H265 ", 5))) {
+            format->setTo(s, len);
+            format->trim();
+            return true;
+        }
+
+        if (commaPos == NULL) {
+            break;
+        }
+
+        s = commaPos + 1;
+        while (isspace(*s)) {
+            ++s;
+        }
+    }
+
+    return false;
+}
+
 WifiDisplaySource::WifiDisplaySource(
         const sp<ANetworkSession> &netSession,
         const sp<IRemoteDisplayClient> &client)
@@ -51,6 +94,8 @@ WifiDisplaySource::WifiDisplaySource(
       mStopReplyID(0),
       mChosenRTPPort(-1),
       mUsingPCMAudio(false),
+      mOfferingHEVC(false),
+      mUsingHEVC(false),
       mClientSessionID(0),
       mReaperPending(false),
       mNextCSeq(1),
@@ -477,6 +522,13 @@ status_t WifiDisplaySource::sendM3(int32_t sessionID) {
         "wfd_audio_codecs\r\n"
         "wfd_client_rtp_ports\r\n";
 
+    // The response is matched against what was asked for here.
+    mOfferingHEVC = CanEncodeHEVC();
+
+    if (mOfferingHEVC) {
+        body.append("wfd2_video_formats\r\n");
+    }
+
     AString request = "GET_PARAMETER rtsp://localhost/wfd1.0 RTSP/1.0\r\n";
     AppendCommonResponse(&request, mNextCSeq);
 
@@ -551,6 +603,12 @@ status_t WifiDisplaySource::sendM4(int32_t sessionID) {
             : "AAC 00000001 00"),  // 2 ch AAC 48kHz
         mClientInfo.mLocalIP.c_str(), transportString.c_str(), mChosenRTPPort);
 
+    if (mUsingHEVC) {
+        body.append(
+                StringPrintf(
+                    "wfd2_video_formats: %s\r\n", mHEVCVideoFormat.c_str()));
+    }
+
     AString request = "SET_PARAMETER rtsp://localhost/wfd1.0 RTSP/1.0\r\n";
     AppendCommonResponse(&request, mNextCSeq);
 
@@ -750,6 +808,14 @@ status_t WifiDisplaySource::onReceiveM3Response(
         return ERROR_UNSUPPORTED;
     }
 
+    mUsingHEVC = false;
+    if (mOfferingHEVC
+            && params->findParameter("wfd2_video_formats", &value)
+            && GetHEVCVideoFormat(value.c_str(), &mHEVCVideoFormat)) {
+        ALOGI("Using HEVC video (%s).", mHEVCVideoFormat.c_str());
+        mUsingHEVC = true;
+    }
+
     mUsingHDCP = false;
     if (!params->findParameter("wfd_content_protection", &value)) {
         ALOGI("Sink doesn't appear to support content protection.");
@@ -1085,7 +1151,8 @@ status_t WifiDisplaySource::onSetupRequest(
             clientRtp,
             clientRtcp,
             transportMode,
-            mUsingPCMAudio);
+            mUsingPCMAudio,
+            mUsingHEVC);
 
     if (err != OK) {
         looper()->unregisterHandler(playbackSession->id());
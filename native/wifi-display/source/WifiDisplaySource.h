@@ -114,6 +114,13 @@ private:
     int32_t mChosenRTPPort;  // extracted from "wfd_client_rtp_ports"
 
     bool mUsingPCMAudio;
+
+    // Whether M3 asked for "wfd2_video_formats", and the sink's entry
+    // for HEVC in it if using it.
+    bool mOfferingHEVC;
+    bool mUsingHEVC;
+    AString mHEVCVideoFormat;
+
     int32_t mClientSessionID;
 
     struct ClientInfo {
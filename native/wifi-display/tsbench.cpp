@@ -0,0 +1,235 @@
+/*
+ * Copyright 2012, The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+//#define LOG_NDEBUG 0
+#define LOG_TAG "tsbench"
+#include <utils/Log.h>
+
+#include "source/TSPacketizer.h"
+
+#include <media/stagefright/foundation/ABuffer.h>
+#include <media/stagefright/foundation/ADebug.h>
+#include <media/stagefright/foundation/ALooper.h>
+#include <media/stagefright/foundation/AMessage.h>
+#include <media/stagefright/MediaDefs.h>
+
+#include <stdlib.h>
+#include <unistd.h>
+
+namespace android {
+
+// About the size of an IDR frame of 4K video at typical bitrates.
+static const size_t kDefaultAccessUnitSize = 1536 * 1024;
+
+static void usage(const char *me) {
+    fprintf(stderr,
+            "usage:\n"
+            "           %s [-s size] [-t threads] [-n iterations]\n"
+            "               -s size       \taccess unit size in bytes "
+            "(default: %d)\n"
+            "               -t threads    \tpacketizer threads (default: 4)\n"
+            "               -n iterations \t(default: 100)\n",
+            me,
+            kDefaultAccessUnitSize);
+}
+
+static sp<TSPacketizer> makePacketizer(size_t *trackIndex) {
+    static const uint8_t kCSD[] = {
+        0x00, 0x00, 0x00, 0x01, 0x67, 0x64, 0x00, 0x33,  // SPS, High@5.1
+        0x00, 0x00, 0x00, 0x01, 0x68, 0xee, 0x3c, 0x80,  // PPS
+    };
+
+    sp<ABuffer> csd = new ABuffer(sizeof(kCSD));
+    memcpy(csd->data(), kCSD, sizeof(kCSD));
+
+    sp<AMessage> format = new AMessage;
+    format->setString("mime", MEDIA_MIMETYPE_VIDEO_AVC);
+    format->setBuffer("csd-0", csd);
+
+    sp<TSPacketizer> packetizer = new TSPacketizer;
+
+    ssize_t index = packetizer->addTrack(format);
+    CHECK_GE(index, 0);
+
+    *trackIndex = index;
+
+    return packetizer;
+}
+
+// As many TS packets as PlaybackSession dequeues at a time from access
+// units large enough to be packetized in parallel.
+static const size_t kNumTSPacketsPerChunk =
+    32 * TSPacketizer::kNumTSPacketsPerRTPPacket;
+
+// Packetizes "accessUnit" the way PlaybackSession does, a chunk at a
+// time, and collects the chunks in "packets" with their RTP header slots
+// zeroed. Returns the time spent in startAccessUnit() and
+// dequeuePackets() in microseconds.
+static int64_t packetize(
+        const sp<TSPacketizer> &packetizer, size_t trackIndex,
+        const sp<ABuffer> &accessUnit, const sp<ABuffer> &packets) {
+    packets->setRange(0, 0);
+
+    int64_t timeUs = 0ll;
+    int64_t startTimeUs = ALooper::GetNowUs();
+
+    status_t err = packetizer->startAccessUnit(
+            trackIndex, accessUnit,
+            TSPacketizer::EMIT_PAT_AND_PMT | TSPacketizer::EMIT_RTP_SLOTS,
+            NULL, 0);
+
+    CHECK_EQ(err, (status_t)OK);
+
+    for (;;) {
+        sp<ABuffer> chunk = packetizer->dequeuePackets(kNumTSPacketsPerChunk);
+
+        int64_t nowUs = ALooper::GetNowUs();
+        timeUs += nowUs - startTimeUs;
+
+        if (chunk == NULL) {
+            break;
+        }
+
+        CHECK_LE(packets->size() + chunk->size(), packets->capacity());
+
+        uint8_t *dst = packets->data() + packets->size();
+        memcpy(dst, chunk->data(), chunk->size());
+
+        // Nothing's written to the RTP header slots.
+        for (size_t offset = 0; offset < chunk->size();
+                offset += TSPacketizer::kRTPHeaderSize
+                    + 188 * TSPacketizer::kNumTSPacketsPerRTPPacket) {
+            memset(dst + offset, 0, TSPacketizer::kRTPHeaderSize);
+        }
+
+        packets->setRange(0, packets->size() + chunk->size());
+
+        // Copying the chunk out stands in for the sender, it isn't timed.
+        chunk.clear();
+        startTimeUs = ALooper::GetNowUs();
+    }
+
+    return timeUs;
+}
+
+static void run(size_t size, size_t numThreads, size_t numIterations) {
+    size_t serialTrackIndex;
+    sp<TSPacketizer> serial = makePacketizer(&serialTrackIndex);
+
+    size_t parallelTrackIndex;
+    sp<TSPacketizer> parallel = makePacketizer(&parallelTrackIndex);
+    parallel->enableParallelPacketization(numThreads, 0);
+
+    sp<ABuffer> accessUnit = new ABuffer(size);
+    uint8_t *data = accessUnit->data();
+    for (size_t i = 0; i < size; ++i) {
+        data[i] = rand();
+    }
+    memcpy(data, "\x00\x00\x00\x01\x65", 5);  // IDR slice
+
+    // Plenty of room for the packets of the largest access unit, their
+    // headers, padding and RTP header slots.
+    size_t maxPacketsSize = 2 * size + 64 * 1024;
+    sp<ABuffer> serialPackets = new ABuffer(maxPacketsSize);
+    sp<ABuffer> parallelPackets = new ABuffer(maxPacketsSize);
+
+    int64_t serialTimeUs = 0ll;
+    int64_t parallelTimeUs = 0ll;
+
+    for (size_t i = 0; i < numIterations; ++i) {
+        // Odd sizes, so that the last packet needs padding now and then.
+        accessUnit->setRange(0, size - (i % 184));
+        accessUnit->meta()->setInt64("timeUs", i * 33333ll);
+
+        serialTimeUs += packetize(
+                serial, serialTrackIndex, accessUnit, serialPackets);
+
+        parallelTimeUs += packetize(
+                parallel, parallelTrackIndex, accessUnit, parallelPackets);
+
+        CHECK_EQ(serialPackets->size(), parallelPackets->size());
+
+        CHECK(!memcmp(serialPackets->data(),
+                      parallelPackets->data(),
+                      serialPackets->size()));
+    }
+
+    printf("%d access units of %d bytes, %d TS packets per chunk\n",
+           numIterations, size, kNumTSPacketsPerChunk);
+
+    printf("serial:   %.2f ms per access unit (%.1f MB/s)\n",
+           serialTimeUs / 1E3 / numIterations,
+           (double)size * numIterations / serialTimeUs);
+
+    printf("parallel: %.2f ms per access unit (%.1f MB/s), %d threads, "
+           "%.2fx\n",
+           parallelTimeUs / 1E3 / numIterations,
+           (double)size * numIterations / parallelTimeUs,
+           numThreads,
+           (double)serialTimeUs / parallelTimeUs);
+}
+
+}  // namespace android
+
+int main(int argc, char **argv) {
+    using namespace android;
+
+    size_t size = kDefaultAccessUnitSize;
+    size_t numThreads = 4;
+    size_t numIterations = 100;
+
+    int res;
+    while ((res = getopt(argc, argv, "hs:t:n:")) >= 0) {
+        switch (res) {
+            case 's':
+            case 't':
+            case 'n':
+            {
+                char *end;
+                unsigned long x = strtoul(optarg, &end, 10);
+
+                if (*end != '\0' || end == optarg || x < 1) {
+                    fprintf(stderr, "Illegal value specified.\n");
+                    exit(1);
+                }
+
+                if (res == 's') {
+                    size = x;
+                } else if (res == 't') {
+                    numThreads = x;
+                } else {
+                    numIterations = x;
+                }
+                break;
+            }
+
+            case '?':
+            case 'h':
+            default:
+                usage(argv[0]);
+                exit(1);
+        }
+    }
+
+    if (size < 184 + 5 || numThreads < 2) {
+        fprintf(stderr, "Need at least 2 threads and 189 bytes of data.\n");
+        exit(1);
+    }
+
+    run(size, numThreads, numIterations);
+
+    return 0;
+}
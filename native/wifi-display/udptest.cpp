@@ -19,6 +19,7 @@
 #include <utils/Log.h>
 
 #include "ANetworkSession.h"
+#include "MediaPacket.h"
 
 #include <binder/ProcessState.h>
 #include <media/stagefright/foundation/ABuffer.h>
@@ -234,8 +235,7 @@ void TestHandler::onMessageReceived(const sp<AMessage> &msg) {
                         int64_t t1 = U64_AT(data->data() + 4);
                         int64_t t2 = U64_AT(data->data() + 12);
 
-                        int64_t t3;
-                        CHECK(data->meta()->findInt64("arrivalTimeUs", &t3));
+                        int64_t t3 = MediaPacket::From(data)->mArrivalTimeUs;
 
 #if 0
                         printf("roundtrip seqNo %u, time = %lld us\n",
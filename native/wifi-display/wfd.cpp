@@ -18,6 +18,8 @@
 #define LOG_TAG "wfd"
 #include <utils/Log.h>
 
+#include "NetworkCapture.h"
+#include "sink/RTPReplayer.h"
 #include "sink/WifiDisplaySink.h"
 #include "source/WifiDisplaySource.h"
 
@@ -39,7 +41,16 @@ static void usage(const char *me) {
             "           %s -c host[:port]\tconnect to wifi source\n"
             "               -u uri        \tconnect to an rtsp uri\n"
             "               -l ip[:port] \tlisten on the specified port "
-            "(create a sink)\n",
+            "(create a sink)\n"
+            "               -p filename  \tcapture the sink's traffic to a "
+            "pcap file\n"
+            "               -r filename  \treplay a capture into a sink\n"
+            "               -f           \treplay as fast as possible, to "
+            "measure throughput\n"
+            "                            \tonly, timing statistics and "
+            "deadlines are meaningless\n"
+            "               -n           \tdon't decode or render, only "
+            "collect statistics\n",
             me);
 }
 
@@ -194,8 +205,13 @@ int main(int argc, char **argv) {
     AString listenOnAddr;
     int32_t listenOnPort = -1;
 
+    AString capturePath;
+    AString replayPath;
+    bool replayInRealTime = true;
+    bool headless = false;
+
     int res;
-    while ((res = getopt(argc, argv, "hc:l:u:")) >= 0) {
+    while ((res = getopt(argc, argv, "hc:l:u:p:r:fn")) >= 0) {
         switch (res) {
             case 'c':
             {
@@ -247,6 +263,30 @@ int main(int argc, char **argv) {
                 break;
             }
 
+            case 'p':
+            {
+                capturePath = optarg;
+                break;
+            }
+
+            case 'r':
+            {
+                replayPath = optarg;
+                break;
+            }
+
+            case 'f':
+            {
+                replayInRealTime = false;
+                break;
+            }
+
+            case 'n':
+            {
+                headless = true;
+                break;
+            }
+
             case '?':
             case 'h':
             default:
@@ -267,6 +307,24 @@ int main(int argc, char **argv) {
         exit(0);
     }
 
+    if (!replayPath.empty()) {
+        sp<ANetworkSession> session = new ANetworkSession;
+        session->start();
+
+        sp<ALooper> looper = new ALooper;
+
+        sp<RTPReplayer> replayer =
+            new RTPReplayer(
+                    session, NULL /* surfaceTex */, replayInRealTime, headless);
+        looper->registerHandler(replayer);
+
+        replayer->start(replayPath.c_str());
+
+        looper->start(true /* runOnCallingThread */);
+
+        exit(0);
+    }
+
     if (connectToPort < 0 && uri.empty()) {
         fprintf(stderr,
                 "You need to select either source host or uri.\n");
@@ -282,11 +340,24 @@ int main(int argc, char **argv) {
     }
 
     sp<ANetworkSession> session = new ANetworkSession;
+
+    if (!capturePath.empty()) {
+        sp<NetworkCapture> capture = new NetworkCapture(capturePath.c_str());
+
+        if (capture->initCheck() != OK) {
+            fprintf(stderr, "Unable to create capture file.\n");
+            exit(1);
+        }
+
+        session->setCapture(capture);
+    }
+
     session->start();
 
     sp<ALooper> looper = new ALooper;
 
-    sp<WifiDisplaySink> sink = new WifiDisplaySink(session);
+    sp<WifiDisplaySink> sink =
+        new WifiDisplaySink(session, NULL /* surfaceTex */, headless);
     looper->registerHandler(sink);
 
     if (connectToPort >= 0) {